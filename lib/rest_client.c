@@ -29,33 +29,229 @@
  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
+#ifdef __linux__
+/* For fallocate() */
+#define _GNU_SOURCE
+#endif
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "config.h"
 #include "rest_client.h"
+#include "rest_executor.h"
+
+#if defined(HAVE_MAKECONTEXT) && defined(HAVE_SWAPCONTEXT)
+/* Filter chains can run as coroutines on the asynchronous engine */
+#define REST_COROUTINES 1
+#include <ucontext.h>
+#endif
 
 #define CONNECT_TIMEOUT 200
+/** The struct of the given type holding member at ptr */
+#define REST_CONTAINER_OF(ptr, type, member) \
+	((type*)((char*)(ptr) - offsetof(type, member)))
 #define MAX_HEADER_SIZE 1024
 
 void lock_function(CURL *handle, curl_lock_data data,
 		curl_lock_access access, void *userptr) {
 #ifdef _PTHREADS
 	RestPrivate *private = (RestPrivate*)userptr;
-	pthread_mutex_lock(&private->curl_lock);
+	if(access == CURL_LOCK_ACCESS_SHARED) {
+		pthread_rwlock_rdlock(&private->curl_lock[data]);
+	} else {
+		pthread_rwlock_wrlock(&private->curl_lock[data]);
+	}
 #endif
 }
 
 void unlock_function(CURL *handle, curl_lock_data data, void *userptr) {
 #ifdef _PTHREADS
 	RestPrivate *private = (RestPrivate*)userptr;
-	pthread_mutex_unlock(&private->curl_lock);
+	pthread_rwlock_unlock(&private->curl_lock[data]);
 #endif
 }
 
 static const char *get_header_value(const char *header);
+#ifdef _PTHREADS
+static void rest_engines_stop(RestPrivate *priv);
+static void rest_file_io_pool_stop(RestPrivate *priv);
+#endif
+
+/** How long the multi handle loops wait for activity, in milliseconds */
+#define REST_ENGINE_POLL_TIMEOUT 1000
+
+/**
+ * Takes an idle cURL handle from the client's pool, or creates a new one if
+ * the pool is empty.
+ */
+static RestHandle *rest_handle_checkout(RestPrivate *priv) {
+	int i;
+	RestHandle *handle;
+
+	for(i=0; i<REST_HANDLE_POOL_SIZE; i++) {
+		// Peek first so we don't dirty the cache line of empty slots.
+		if(!__atomic_load_n(&priv->handle_pool[i], __ATOMIC_RELAXED)) {
+			continue;
+		}
+		handle = __atomic_exchange_n(&priv->handle_pool[i], NULL,
+				__ATOMIC_ACQUIRE);
+		if(handle) {
+			return handle;
+		}
+	}
+
+	handle = calloc(1, sizeof(RestHandle));
+	handle->curl = curl_easy_init();
+	return handle;
+}
+
+static void rest_handle_free(RestHandle *handle) {
+	if(handle->multi) {
+		curl_multi_cleanup(handle->multi);
+	}
+	curl_easy_cleanup(handle->curl);
+	free(handle->url);
+	free(handle);
+}
+
+/**
+ * Resets a cURL handle and returns it to the client's pool.  If the pool is
+ * full, the handle is destroyed.
+ */
+static void rest_handle_return(RestPrivate *priv, RestHandle *handle) {
+	int i;
+
+	// Clears the options but keeps the connection cache, DNS cache and
+	// SSL session IDs.
+	curl_easy_reset(handle->curl);
+
+	for(i=0; i<REST_HANDLE_POOL_SIZE; i++) {
+		RestHandle *empty = NULL;
+		if(__atomic_load_n(&priv->handle_pool[i], __ATOMIC_RELAXED)) {
+			continue;
+		}
+		if(__atomic_compare_exchange_n(&priv->handle_pool[i], &empty, handle,
+				0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			return;
+		}
+	}
+
+	// Pool is full
+	rest_handle_free(handle);
+}
+
+/**
+ * Returns the handle's URL buffer with room for at least size bytes.  The
+ * buffer only grows, so once it has held a long URL later requests build
+ * their URLs without allocating.
+ */
+static char *rest_handle_url(RestHandle *handle, size_t size) {
+	if(size > handle->url_capacity) {
+		size_t capacity = handle->url_capacity ? handle->url_capacity : 256;
+		char *url;
+
+		while(capacity < size) {
+			capacity *= 2;
+		}
+		url = realloc(handle->url, capacity);
+		if(!url) {
+			return NULL;
+		}
+		handle->url = url;
+		handle->url_capacity = capacity;
+	}
+	return handle->url;
+}
+
+/**
+ * Performs the handle's transfer like curl_easy_perform(), but on a multi
+ * handle of its own that is published in *multi while the transfer runs so
+ * other threads can wake it.
+ */
+static CURLcode rest_handle_perform(RestHandle *handle, CURLM **multi) {
+	CURLcode result = CURLE_FAILED_INIT;
+	CURLMsg *msg;
+	int msgs, still_running;
+
+	if(!handle->multi) {
+		handle->multi = curl_multi_init();
+	}
+	if(curl_multi_add_handle(handle->multi, handle->curl) != CURLM_OK) {
+		return CURLE_FAILED_INIT;
+	}
+	__atomic_store_n(multi, handle->multi, __ATOMIC_RELEASE);
+
+	do {
+		if(curl_multi_perform(handle->multi, &still_running) != CURLM_OK) {
+			break;
+		}
+		while((msg = curl_multi_info_read(handle->multi, &msgs))) {
+			if(msg->msg == CURLMSG_DONE) {
+				result = msg->data.result;
+			}
+		}
+		if(still_running) {
+			curl_multi_poll(handle->multi, NULL, 0, REST_ENGINE_POLL_TIMEOUT,
+					NULL);
+		}
+	} while(still_running);
+
+	__atomic_store_n(multi, NULL, __ATOMIC_RELEASE);
+	curl_multi_remove_handle(handle->multi, handle->curl);
+	return result;
+}
+
+/**
+ * Builds the scheme://host[:port] prefix for a client.  The scheme defaults
+ * to https for port 443 and http otherwise, and the port is left out if host
+ * already has one or it's the scheme's default.
+ */
+static char *rest_url_prefix(const char *host, int port) {
+	const char *scheme_end = strstr(host, "://");
+	const char *authority = scheme_end ? scheme_end + 3 : host;
+	const char *path = authority + strcspn(authority, "/?#");
+	const char *port_start = authority;
+	const char *bracket;
+	char port_str[16] = "";
+	int https;
+	size_t size;
+	char *prefix;
+
+	if(scheme_end) {
+		https = scheme_end - host == 5 && !strncasecmp(host, "https", 5);
+	} else {
+		https = port == 443;
+	}
+
+	// Skip over an IPv6 address before looking for a port.
+	bracket = memchr(authority, ']', path - authority);
+	if(bracket) {
+		port_start = bracket;
+	}
+	if(port > 0 && port != (https ? 443 : 80)
+			&& !memchr(port_start, ':', path - port_start)) {
+		snprintf(port_str, sizeof(port_str), ":%d", port);
+	}
+
+	size = strlen(host) + strlen(port_str) + sizeof("https://");
+	prefix = malloc(size);
+	snprintf(prefix, size, "%s%.*s%s%s",
+			scheme_end ? "" : https ? "https://" : "http://",
+			(int)(path - host), host, port_str, path);
+	return prefix;
+}
 
 RestClient *RestClient_init(RestClient *self, const char *host, int port) {
 	// Super init
@@ -72,18 +268,30 @@ RestClient *RestClient_init(RestClient *self, const char *host, int port) {
 
 	// Initialize cURL shared state.
 	RestPrivate *private = self->internal;
+	private->url_prefix = rest_url_prefix(host, port);
+	private->url_prefix_len = strlen(private->url_prefix);
 	private->curl_shared = curl_share_init();
 	curl_share_setopt(private->curl_shared, CURLSHOPT_LOCKFUNC, lock_function);
 	curl_share_setopt(private->curl_shared, CURLSHOPT_UNLOCKFUNC, unlock_function);
 
 #ifdef _PTHREADS
-	pthread_mutex_init(&private->curl_lock, NULL);
+	{
+		int i;
+		for(i=0; i<CURL_LOCK_DATA_LAST; i++) {
+			pthread_rwlock_init(&private->curl_lock[i], NULL);
+		}
+	}
+	pthread_mutex_init(&private->scheduler_lock, NULL);
+	pthread_mutex_init(&private->engine_lock, NULL);
 #endif
 
 	curl_share_setopt(private->curl_shared, CURLSHOPT_USERDATA, private);
 	curl_share_setopt(private->curl_shared, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
 	curl_share_setopt(private->curl_shared, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
 	curl_share_setopt(private->curl_shared, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+	// Share the connection cache so a connection opened by one thread can be
+	// reused by the next request on any thread.
+	curl_share_setopt(private->curl_shared, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
 
 	// Add default handlers
 	RestClient_add_curl_config_handler(self, rest_proxy_config);
@@ -93,6 +301,20 @@ RestClient *RestClient_init(RestClient *self, const char *host, int port) {
 }
 
 void RestClient_destroy(RestClient *self) {
+#ifdef _PTHREADS
+	// Let in-flight requests finish while the client is still intact.
+	if(self->internal) {
+		RestPrivate *private = self->internal;
+		if(private->executor) {
+			RestExecutor_destroy(private->executor);
+			free(private->executor);
+			private->executor = NULL;
+		}
+		rest_engines_stop(private);
+		rest_file_io_pool_stop(private);
+	}
+#endif
+
 	if(self->host) {
 		free(self->host);
 		self->host = NULL;
@@ -101,16 +323,30 @@ void RestClient_destroy(RestClient *self) {
 
 	if(self->internal) {
 		RestPrivate *private = self->internal;
+		int i;
+
+		// Handles must go before the shared state they point to.
+		for(i=0; i<REST_HANDLE_POOL_SIZE; i++) {
+			if(private->handle_pool[i]) {
+				rest_handle_free(private->handle_pool[i]);
+				private->handle_pool[i] = NULL;
+			}
+		}
 		if(private->curl_shared) {
 			curl_share_cleanup(private->curl_shared);
 			private->curl_shared = NULL;
 		}
 #ifdef _PTHREADS
-		pthread_mutex_destroy(&private->curl_lock);
+		for(i=0; i<CURL_LOCK_DATA_LAST; i++) {
+			pthread_rwlock_destroy(&private->curl_lock[i]);
+		}
+		pthread_mutex_destroy(&private->scheduler_lock);
+		pthread_mutex_destroy(&private->engine_lock);
 #endif
         if(private->handlers) {
             free(private->handlers);
         }
+		free(private->url_prefix);
 		free(private);
 		self->internal = NULL;
 	}
@@ -139,6 +375,40 @@ void RestClient_add_curl_config_handler(RestClient *self, rest_curl_config_handl
 	priv->handlers[priv->curl_config_handler_count++] = handler;
 }
 
+int RestClient_set_cookie_sharing(RestClient *self, int share) {
+	RestPrivate *priv = self->internal;
+	int i;
+
+	// libcurl won't change a share while handles are attached to it, and
+	// pooled handles keep theirs.  Detach them; rest_curl_shared_config()
+	// attaches them again for their next request.
+	for(i=0; i<REST_HANDLE_POOL_SIZE; i++) {
+		if(priv->handle_pool[i]) {
+			curl_easy_setopt(priv->handle_pool[i]->curl, CURLOPT_SHARE, NULL);
+		}
+	}
+	if(curl_share_setopt(priv->curl_shared,
+			share ? CURLSHOPT_SHARE : CURLSHOPT_UNSHARE,
+			CURL_LOCK_DATA_COOKIE) != CURLSHE_OK) {
+		return -1;
+	}
+	return 0;
+}
+
+void RestClient_set_http2(RestClient *self, int enabled) {
+	RestPrivate *priv = self->internal;
+
+	priv->http2 = enabled;
+}
+
+void RestClient_set_connection_limits(RestClient *self,
+		int max_host_connections, int max_connections) {
+	RestPrivate *priv = self->internal;
+
+	priv->max_host_connections = max_host_connections;
+	priv->max_connections = max_connections;
+}
+
 void RestClient_set_proxy(RestClient *self, const char *proxy_host,
 		int proxy_port, const char *proxy_user, const char *proxy_pass) {
 	if(self->proxy_host) {
@@ -173,6 +443,11 @@ int rest_curl_shared_config(RestClient *rest, CURL *handle) {
 	if(priv->curl_shared) {
 		curl_easy_setopt(handle, CURLOPT_SHARE, priv->curl_shared);
 	}
+	// Also sizes the shared connection cache.  libcurl's default only
+	// keeps a few idle connections, which isn't enough when many threads
+	// share the cache.
+	curl_easy_setopt(handle, CURLOPT_MAXCONNECTS, priv->max_connections > 0 ?
+			(long)priv->max_connections : (long)REST_DEFAULT_CONNECTION_CACHE);
 	return 0;
 }
 
@@ -243,6 +518,104 @@ size_t readfunc(void *ptr, size_t size, size_t nmemb, void *stream)
 	return 0;
 }
 
+/**
+ * Size of cURL's upload buffer for mapped and file descriptor bodies.
+ * Bigger chunks mean fewer calls, pread()s and send()s.
+ */
+#define REST_MMAP_UPLOAD_BUFFER (512 * 1024L)
+
+/**
+ * Reads a mapped file body, passing each chunk to the request's filter.
+ */
+static size_t readfunc_mmap(void *ptr, size_t size, size_t nmemb, void *stream)
+{
+	RestRequest *req = (RestRequest*)stream;
+	RestRequestBody *ud = req->request_body;
+	size_t c = size*nmemb;
+
+	if(ud->bytes_remaining <= 0) {
+		return 0;
+	}
+	if((int64_t)c > ud->bytes_remaining) {
+		c = (size_t)ud->bytes_remaining;
+	}
+	memcpy(ptr, ud->body + ud->bytes_written, c);
+	if(ud->filter) {
+		if(!((rest_file_data_filter)ud->filter)(req, ptr, c)) {
+			return CURL_READFUNC_ABORT;
+		}
+	}
+	ud->bytes_written += c;
+	ud->bytes_remaining -= c;
+	return c;
+}
+
+/**
+ * Reads a file descriptor body with pread(), passing each chunk to the
+ * request's filter.
+ */
+static size_t readfunc_fd(void *ptr, size_t size, size_t nmemb, void *stream)
+{
+	RestRequest *req = (RestRequest*)stream;
+	RestRequestBody *ud = req->request_body;
+	size_t c = size*nmemb;
+	ssize_t r;
+
+	if(ud->bytes_remaining <= 0) {
+		return 0;
+	}
+	if((int64_t)c > ud->bytes_remaining) {
+		c = (size_t)ud->bytes_remaining;
+	}
+	do {
+		r = pread(ud->body_fd, ptr, c, ud->fd_offset + ud->bytes_written);
+	} while(r < 0 && errno == EINTR);
+	if(r <= 0) {
+		// An error, or the file is shorter than the body.
+		return CURL_READFUNC_ABORT;
+	}
+	if(ud->filter) {
+		if(!((rest_file_data_filter)ud->filter)(req, ptr, r)) {
+			return CURL_READFUNC_ABORT;
+		}
+	}
+	ud->bytes_written += r;
+	ud->bytes_remaining -= r;
+	return r;
+}
+
+/**
+ * Reads the body from its iovec segments, copying straight from each
+ * segment into cURL's buffer.
+ */
+static size_t readfunc_iov(void *ptr, size_t size, size_t nmemb, void *stream)
+{
+	RestRequest *req = (RestRequest*)stream;
+	RestRequestBody *ud = req->request_body;
+	size_t room = size*nmemb;
+	size_t copied = 0;
+
+	while(room > 0 && ud->iov_index < ud->iovcnt) {
+		const struct iovec *seg = &ud->iov[ud->iov_index];
+		size_t n = seg->iov_len - ud->iov_offset;
+
+		if(n > room) {
+			n = room;
+		}
+		memcpy((char*)ptr + copied, (const char*)seg->iov_base + ud->iov_offset, n);
+		copied += n;
+		room -= n;
+		ud->iov_offset += n;
+		if(ud->iov_offset == seg->iov_len) {
+			ud->iov_index++;
+			ud->iov_offset = 0;
+		}
+	}
+	ud->bytes_written += copied;
+	ud->bytes_remaining -= copied;
+	return copied;
+}
+
 /**
  * The normal curl file readfunc reads the entire file, even though the curlopt
  * FILESIZE was set to the actual number of bytes we want.  This version will
@@ -285,14 +658,187 @@ size_t readfunc_file(void *ptr, size_t size, size_t nmemb, void *stream)
 }
 
 
+/*
+ * Response memory
+ *
+ * A response keeps its header block, header index and body buffer when it
+ * is reset so the next request can reuse them.
+ */
+
+/** Initial size of a response's header block */
+#define REST_HEADER_BLOCK_SIZE 1024
+/** Initial number of entries in a response's header index */
+#define REST_HEADER_INDEX_SIZE 16
+/** Initial number of slots in a response's header hash table */
+#define REST_HEADER_TABLE_SIZE 32
+/** Smallest buffer allocated for a request header */
+#define REST_REQUEST_HEADER_SIZE 64
+
+/** Smallest buffer allocated for a response's content type */
+#define REST_CONTENT_TYPE_SIZE 64
+
+/**
+ * Clears the response's content type.  Like a request header, one the
+ * caller replaced or freed (and set to NULL) is the caller's; its buffer is
+ * dropped.
+ */
+static void rest_response_clear_content_type(RestResponse *response) {
+	if(response->content_type != response->content_type_storage) {
+		free(response->content_type);
+		if(response->content_type_lent) {
+			response->content_type_storage = NULL;
+			response->content_type_capacity = 0;
+		}
+	}
+	response->content_type = NULL;
+	response->content_type_lent = 0;
+}
+
+/**
+ * Sets the response's content type to the first len bytes of str, copied
+ * into a buffer that is only reallocated when it's too small.
+ */
+static void rest_response_set_content_type(RestResponse *response,
+		const char *str, size_t len) {
+	rest_response_clear_content_type(response);
+	if(response->content_type_capacity < len + 1) {
+		size_t capacity = len + 1 > REST_CONTENT_TYPE_SIZE ?
+				len + 1 : REST_CONTENT_TYPE_SIZE;
+
+		free(response->content_type_storage);
+		response->content_type_storage = malloc(capacity);
+		if(!response->content_type_storage) {
+			response->content_type_capacity = 0;
+			return;
+		}
+		response->content_type_capacity = capacity;
+	}
+	memcpy(response->content_type_storage, str, len);
+	response->content_type_storage[len] = '\0';
+	response->content_type = response->content_type_storage;
+	response->content_type_lent = 1;
+}
+
+/**
+ * Grows the response body to hold at least content_length bytes.  The
+ * capacity doubles so a body received in many small writes is only copied a
+ * few times.  If the Content-Length is known, the whole body is allocated up
+ * front.  Reserving on the first write rather than when the header arrives
+ * avoids allocating for HEAD requests.
+ * @return zero on success.
+ */
+static int rest_response_grow(RestResponse *ws) {
+	size_t needed = (size_t)ws->content_length;
+	size_t capacity = ws->body_capacity * 2;
+	char *body;
+
+	if(ws->expected_length > 0 && (size_t)ws->expected_length > capacity) {
+		capacity = (size_t)ws->expected_length;
+	}
+	if(capacity < needed) {
+		capacity = needed;
+	}
+
+	/* Add an extra byte so we can null terminate it */
+	body = realloc(ws->body, capacity + 1);
+	if(!body && capacity > needed) {
+		// A bogus Content-Length shouldn't fail a request that fits.
+		capacity = needed;
+		body = realloc(ws->body, capacity + 1);
+	}
+	if(!body) {
+		return -1;
+	}
+	ws->body = body;
+	ws->body_capacity = capacity;
+	return 0;
+}
+
+/** RestResponse.sink_state values */
+#define REST_SINK_RUNNING 0
+#define REST_SINK_PAUSED 1
+#define REST_SINK_RESUMING 2
+
+/**
+ * Passes received data to the response's sink.
+ */
+static size_t rest_sink_write(RestResponse *ws, const char *data, size_t size) {
+	int running = REST_SINK_RUNNING;
+
+	switch(ws->sink(ws->sink_ctx, data, size)) {
+	case REST_SINK_CONTINUE:
+		ws->content_length += size;
+		return size;
+	case REST_SINK_PAUSE:
+		// If the sink already called RestResponse_resume(), stay in the
+		// resuming state so the progress callback unpauses right away.
+		__atomic_compare_exchange_n(&ws->sink_state, &running,
+				REST_SINK_PAUSED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+		return CURL_WRITEFUNC_PAUSE;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Progress callback of sink transfers.  A paused transfer can only be
+ * resumed from its own thread, so RestResponse_resume() leaves it to this.
+ */
+static int rest_sink_progress(void *clientp, curl_off_t dltotal,
+		curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+	RestResponse *ws = clientp;
+
+	if(__atomic_load_n(&ws->sink_state, __ATOMIC_ACQUIRE) == REST_SINK_RESUMING) {
+		__atomic_store_n(&ws->sink_state, REST_SINK_RUNNING, __ATOMIC_RELEASE);
+		curl_easy_pause(ws->sink_curl, CURLPAUSE_CONT);
+	}
+	return 0;
+}
+
+/**
+ * Writes received data to the response's file descriptor.
+ */
+static size_t rest_fd_write(RestResponse *ws, const char *data, size_t size) {
+	off_t offset = ws->fd_offset + ws->content_length;
+	size_t done = 0;
+
+#ifdef FALLOC_FL_KEEP_SIZE
+	if(ws->content_length == 0 && ws->expected_length > 0) {
+		// Reserve the whole body up front so the file isn't fragmented.
+		// Not all filesystems can, and that's fine.
+		fallocate(ws->body_fd, FALLOC_FL_KEEP_SIZE, ws->fd_offset,
+				ws->expected_length);
+	}
+#endif
+	while(done < size) {
+		ssize_t c = pwrite(ws->body_fd, data + done, size - done,
+				offset + done);
+		if(c < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		done += c;
+	}
+	ws->content_length += size;
+	return size;
+}
+
 size_t writefunc(void *ptr, size_t size, size_t nmemb, void *stream)
 {
 	RestResponse *ws = (RestResponse*)stream;
 
-    void *new_response = NULL;
     unsigned long long data_offset = ws->content_length;
 
     size_t mem_required = size*nmemb;
+
+    if(ws->sink) {
+        return rest_sink_write(ws, ptr, mem_required);
+    }
+    if(ws->use_fd) {
+        return rest_fd_write(ws, ptr, mem_required);
+    }
     ws->content_length += mem_required;
     
     if(ws->use_buffer) {
@@ -302,12 +848,8 @@ size_t writefunc(void *ptr, size_t size, size_t nmemb, void *stream)
             // TODO: Logging
             return 0;
         }
-    } else {
-        /* Add an extra byte so we can null terminate it */
-        new_response = realloc(ws->body,ws->content_length+1);
-        if(new_response) {
-          ws->body = (char*)new_response;
-        } else {
+    } else if((size_t)ws->content_length > ws->body_capacity || !ws->body) {
+        if(rest_response_grow(ws)) {
           return 0; // Error
         }
     }
@@ -329,153 +871,2888 @@ size_t writefunc(void *ptr, size_t size, size_t nmemb, void *stream)
     return mem_required;
 }
 
-size_t headerfunc(void *ptr, size_t size, size_t nmemb, void *stream)
-{
-    RestResponse *ws = (RestResponse*)stream;
-    size_t mem_required = size*nmemb-2; // - 2 for the /r/n at the end of each header
+/*
+ * Header lookup
+ *
+ * Request and response headers are indexed by an open-addressing hash table
+ * keyed on the case-folded header name.  A table slot points at the first
+ * header with a name and headers with the same name are chained in order, so
+ * a lookup touches one or two slots and a repeated header's values are found
+ * without scanning.
+ */
+
+/**
+ * FNV-1a hash of a header name, ignoring ASCII case.
+ */
+static uint32_t rest_header_hash(const char *name, size_t len) {
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for(i=0; i<len; i++) {
+		unsigned char c = name[i];
+		if(c >= 'A' && c <= 'Z') {
+			c += 'a' - 'A';
+		}
+		hash = (hash ^ c) * 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Returns the length of the name of a "name: value" header line.
+ */
+static size_t rest_header_name_len(const char *line) {
+	size_t len = strcspn(line, ":");
+
+	while(len > 0 && isspace((unsigned char)line[len - 1])) {
+		len--;
+	}
+	return len;
+}
+
+static void rest_response_table_insert(RestResponse *ws, int i) {
+	RestHeader *header = &ws->header_index[i];
+	uint32_t mask = ws->header_table_size - 1;
+	uint32_t slot = header->hash & mask;
+
+	header->next = 0;
+	while(ws->header_table[slot]) {
+		RestHeader *first = &ws->header_index[ws->header_table[slot] - 1];
+		if(first->hash == header->hash && first->name_len == header->name_len
+				&& !strncasecmp(ws->header_block + first->name_off,
+						ws->header_block + header->name_off, header->name_len)) {
+			// Repeated header; append it to the chain.
+			while(first->next) {
+				first = &ws->header_index[first->next - 1];
+			}
+			first->next = i + 1;
+			return;
+		}
+		slot = (slot + 1) & mask;
+	}
+	ws->header_table[slot] = i + 1;
+}
+
+/**
+ * Adds header i to the hash table, growing it to keep it at most half full.
+ * @return zero on success.
+ */
+static int rest_response_index_header(RestResponse *ws, int i) {
+	if(ws->response_header_count * 2 > ws->header_table_size) {
+		int size = ws->header_table_size ? ws->header_table_size * 2
+				: REST_HEADER_TABLE_SIZE;
+		uint32_t *table = calloc(size, sizeof(uint32_t));
+		int j;
+
+		if(!table) {
+			return -1;
+		}
+		free(ws->header_table);
+		ws->header_table = table;
+		ws->header_table_size = size;
+		for(j=0; j<i; j++) {
+			rest_response_table_insert(ws, j);
+		}
+	}
+	rest_response_table_insert(ws, i);
+	return 0;
+}
+
+static RestHeader *rest_response_find_header(RestResponse *self,
+		const char *header_name, size_t name_len) {
+	uint32_t hash, mask, slot;
+
+	if(self->response_header_count == 0) {
+		return NULL;
+	}
+	hash = rest_header_hash(header_name, name_len);
+	mask = self->header_table_size - 1;
+	for(slot = hash & mask; self->header_table[slot]; slot = (slot + 1) & mask) {
+		RestHeader *header = &self->header_index[self->header_table[slot] - 1];
+		if(header->hash == hash && header->name_len == name_len
+				&& !strncasecmp(self->header_block + header->name_off,
+						header_name, name_len)) {
+			return header;
+		}
+	}
+	return NULL;
+}
+
+static void rest_request_table_insert(RestRequest *self, int i) {
+	const char *header = self->headers[i];
+	size_t name_len = rest_header_name_len(header);
+	uint32_t mask = REST_REQUEST_HEADER_TABLE_SIZE - 1;
+	uint32_t slot;
+
+	self->header_hash[i] = rest_header_hash(header, name_len);
+	self->header_next[i] = 0;
+	for(slot = self->header_hash[i] & mask; self->header_table[slot];
+			slot = (slot + 1) & mask) {
+		int first = self->header_table[slot] - 1;
+		if(self->header_hash[first] == self->header_hash[i]
+				&& rest_header_name_len(self->headers[first]) == name_len
+				&& !strncasecmp(self->headers[first], header, name_len)) {
+			while(self->header_next[first]) {
+				first = self->header_next[first] - 1;
+			}
+			self->header_next[first] = i + 1;
+			return;
+		}
+	}
+	self->header_table[slot] = i + 1;
+}
+
+/**
+ * Rebuilds the request's hash table if headers were added or removed
+ * without RestRequest_add_header().
+ */
+static void rest_request_index_headers(RestRequest *self) {
+	int i;
+
+	if(self->indexed_header_count == self->header_count) {
+		return;
+	}
+	memset(self->header_table, 0, sizeof(self->header_table));
+	for(i=0; i<self->header_count; i++) {
+		if(self->headers[i]) {
+			rest_request_table_insert(self, i);
+		}
+	}
+	self->indexed_header_count = self->header_count;
+}
+
+/**
+ * Finds the index of the first request header with a name, or -1.
+ */
+static int rest_request_find_header(RestRequest *self,
+		const char *header_name) {
+	size_t name_len = strlen(header_name);
+	uint32_t hash = rest_header_hash(header_name, name_len);
+	uint32_t mask = REST_REQUEST_HEADER_TABLE_SIZE - 1;
+	uint32_t slot;
+
+	rest_request_index_headers(self);
+	for(slot = hash & mask; self->header_table[slot]; slot = (slot + 1) & mask) {
+		int i = self->header_table[slot] - 1;
+		const char *header = self->headers[i];
+		// The header is checked in case it was replaced behind our back.
+		if(self->header_hash[i] == hash && header
+				&& !strncasecmp(header, header_name, name_len)
+				&& rest_header_name_len(header) == name_len) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Makes room for at least needed bytes at the end of the header block.
+ * @return zero on success.
+ */
+static int rest_header_block_reserve(RestResponse *ws, size_t needed) {
+	size_t capacity = ws->header_block_capacity ? ws->header_block_capacity
+			: REST_HEADER_BLOCK_SIZE;
+	char *block;
+
+	if(ws->header_block_size + needed <= ws->header_block_capacity) {
+		return 0;
+	}
+	while(capacity < ws->header_block_size + needed) {
+		capacity *= 2;
+	}
+	block = realloc(ws->header_block, capacity);
+	if(!block) {
+		return -1;
+	}
+	ws->header_block = block;
+	ws->header_block_capacity = capacity;
+	return 0;
+}
+
+/**
+ * Parses the status line, e.g. "HTTP/1.1 200 OK", of a response.  Any
+ * headers collected so far belonged to an interim response (100 Continue) or
+ * a redirect, so they're dropped.
+ * @return nonzero if the response requires 206 and this is another final
+ * status.
+ */
+static int rest_response_status_line(RestResponse *ws, const char *line,
+		size_t len) {
+	const char *end = line + len;
+	int space = 0;
+	int code = 0;
+
+	ws->response_header_count = 0;
+	ws->header_block_size = 0;
+	ws->expected_length = 0;
+	if(ws->header_table) {
+		memset(ws->header_table, 0, ws->header_table_size * sizeof(uint32_t));
+	}
+
+	// The status code follows the first space and the message the second.
+	while(line < end && space < 2) {
+		if(*line++ == ' ' && ++space == 1) {
+			code = atoi(line);
+		}
+	}
+	snprintf(ws->http_status, ERROR_MESSAGE_SIZE, "%.*s",
+			space == 2 ? (int)(end - line) : 0, line);
+
+	// Interim responses and redirects are followed by the real one.
+	return ws->require_partial && code != 206 && code / 100 != 1
+			&& code / 100 != 3;
+}
+
+/**
+ * Adds a header line to the response.  The line may end in CRLF, LF or
+ * nothing at all.
+ * @return zero on success.
+ */
+static int rest_response_add_header_line(RestResponse *ws, const char *line,
+		size_t len) {
+	RestHeader *header;
+	const char *colon, *value;
+	size_t name_len;
+
+	while(len > 0 && isspace((unsigned char)line[len - 1])) {
+		len--;
+	}
+	if(len == 0) {
+		// Blank line ending the header block
+		return 0;
+	}
+	if(len > 5 && !strncmp(line, "HTTP/", 5)) {
+		return rest_response_status_line(ws, line, len) ? -1 : 0;
+	}
+
+	if((*line == ' ' || *line == '\t') && ws->response_header_count > 0) {
+		// Obsolete line folding continues the previous header's value,
+		// which is always the last thing in the block.
+		while(isspace((unsigned char)*line)) {
+			line++;
+			len--;
+		}
+		if(rest_header_block_reserve(ws, len + 1)) {
+			return -1;
+		}
+		header = &ws->header_index[ws->response_header_count - 1];
+		ws->header_block[ws->header_block_size - 1] = ' ';
+		memcpy(ws->header_block + ws->header_block_size, line, len);
+		ws->header_block_size += len;
+		ws->header_block[ws->header_block_size++] = '\0';
+		header->value_len = ws->header_block_size - 1 - header->value_off;
+		return 0;
+	}
+
+	colon = memchr(line, ':', len);
+	if(!colon) {
+		// Not a header; ignore it.
+		return 0;
+	}
+
+	if(ws->response_header_count == ws->header_index_capacity) {
+		int capacity = ws->header_index_capacity ?
+				ws->header_index_capacity * 2 : REST_HEADER_INDEX_SIZE;
+		header = realloc(ws->header_index, capacity * sizeof(RestHeader));
+		if(!header) {
+			return -1;
+		}
+		ws->header_index = header;
+		ws->header_index_capacity = capacity;
+	}
+	if(rest_header_block_reserve(ws, len + 1)) {
+		return -1;
+	}
+
+	name_len = colon - line;
+	while(name_len > 0 && isspace((unsigned char)line[name_len - 1])) {
+		name_len--;
+	}
+	value = colon + 1;
+	while(*value == ' ' || *value == '\t') {
+		value++;
+	}
+
+	header = &ws->header_index[ws->response_header_count++];
+	header->name_off = ws->header_block_size;
+	header->name_len = name_len;
+	header->value_off = ws->header_block_size + (value - line);
+	header->value_len = len - (value - line);
+	header->hash = rest_header_hash(line, name_len);
+
+	memcpy(ws->header_block + ws->header_block_size, line, len);
+	ws->header_block_size += len;
+	ws->header_block[ws->header_block_size++] = '\0';
+
+	if(rest_response_index_header(ws, ws->response_header_count - 1)) {
+		return -1;
+	}
+
+	if(name_len == 14 && !strncasecmp(line, HTTP_HEADER_CONTENT_LENGTH, 14)) {
+		ws->expected_length = strtoll(value, NULL, 10);
+	}
+	return 0;
+}
+
+size_t headerfunc(void *ptr, size_t size, size_t nmemb, void *stream)
+{
+    RestResponse *ws = (RestResponse*)stream;
+
+    if(rest_response_add_header_line(ws, ptr, size*nmemb)) {
+        return 0; // Error
+    }
+
+    return size*nmemb;
+}
+
+void RestClient_execute_request(RestClient *self, RestFilter *filters,
+		RestRequest *request, RestResponse *response) {
+
+	if(!filters) {
+		fprintf(stderr, "RestClient_execute_request called with no filters.");
+		abort();
+	} else {
+		// Simply invoke the head of the filter chain.
+		((rest_http_filter)filters->func)(filters, self, request, response);
+	}
+}
+
+RestFilter *RestFilter_add(RestFilter *start, rest_http_filter next) {
+	RestFilter *newfilter = calloc(sizeof(RestFilter), 1);
+
+	newfilter->func = next;
+	if(start) {
+		newfilter->next = start;
+	}
+
+	return newfilter;
+}
+
+void RestFilter_free(RestFilter *start) {
+	if(start->next) {
+		RestFilter_free(start->next);
+	}
+	free(start);
+}
+
+/**
+ * Sets the Content-Type and Content-Length headers
+ */
+void RestFilter_set_content_headers(RestFilter *self, RestClient *rest,
+		RestRequest *request, RestResponse *response) {
+	char headerbuf[MAX_HEADER_SIZE];
+
+	if(request->request_body) {
+	    /** Curl should set this itself */
+		/* snprintf(headerbuf, MAX_HEADER_SIZE, "%s: %" PRId64,
+		        HTTP_HEADER_CONTENT_LENGTH,
+				(long long)request->request_body->data_size);
+		RestRequest_add_header(request, headerbuf); */
+		snprintf(headerbuf, MAX_HEADER_SIZE, "%s: %s", HTTP_HEADER_CONTENT_TYPE,
+				request->request_body->content_type);
+        RestRequest_add_header(request, headerbuf);
+	} else if(request->method == HTTP_POST || request->method == HTTP_PUT || request->method == HTTP_PATCH) {
+		// Zero-length body
+		RestRequest_add_header(request, HTTP_HEADER_CONTENT_LENGTH ":0");
+	}
+
+	// Pass to the next filter
+	if(self->next) {
+		((rest_http_filter)self->next->func)(self->next, rest, request, response);
+	}
+
+	// Parse content-type from response, unless the transfer already set it
+	const char *content_type;
+	size_t content_type_len;
+	content_type = response->content_type ? NULL : RestResponse_find_header(
+			response, HTTP_HEADER_CONTENT_TYPE,
+			strlen(HTTP_HEADER_CONTENT_TYPE), &content_type_len);
+	if(content_type) {
+		rest_response_set_content_type(response, content_type,
+				content_type_len);
+	}
+}
+
+/*
+ * Resumable transfers
+ *
+ * RestFilter_resume() repeats an interrupted GET or PUT for the part that
+ * is missing instead of starting over.  Each repeat is a copy of the
+ * original request with a range and a precondition on the object's
+ * validator, so a changed object fails the request with 412 rather than
+ * being mixed with the old one.
+ */
+
+/**
+ * Whether a transfer that failed with a cURL error may have been cut off
+ * partway, so the rest of it can be requested.
+ */
+static int rest_resume_interrupted(int curl_error) {
+	switch(curl_error) {
+	case CURLE_PARTIAL_FILE:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_SEND_FAIL_REWIND:
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_HTTP2:
+	case CURLE_HTTP2_STREAM:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Builds the precondition header for a repeat from the response's
+ * validator: If-Match for a strong ETag, or If-Unmodified-Since for
+ * Last-Modified.
+ * @return nonzero if the response has a usable validator.
+ */
+static int rest_resume_validator(RestResponse *response, char *header,
+		size_t size) {
+	const char *value;
+	size_t value_len;
+
+	value = RestResponse_find_header(response, "ETag", 4, &value_len);
+	if(value && strncmp(value, "W/", 2)) {
+		return snprintf(header, size, "If-Match: %.*s", (int)value_len,
+				value) < (int)size;
+	}
+	value = RestResponse_find_header(response, "Last-Modified", 13,
+			&value_len);
+	if(value) {
+		return snprintf(header, size, "If-Unmodified-Since: %.*s",
+				(int)value_len, value) < (int)size;
+	}
+	return 0;
+}
+
+/**
+ * Whether a "name: value" header line has the given name.
+ */
+static int rest_header_is(const char *line, const char *name) {
+	size_t len = rest_header_name_len(line);
+
+	return len == strlen(name) && !strncasecmp(line, name, len);
+}
+
+/**
+ * Initializes copy as a repeat of request, with the first header_count
+ * headers except those the repeat replaces.
+ */
+static void rest_resume_request(RestRequest *copy, RestRequest *request,
+		int header_count, enum http_method method) {
+	int i;
+
+	RestRequest_init(copy, request->uri, method);
+	copy->uri_encoded = request->uri_encoded;
+	copy->priority = request->priority;
+	for(i=0; i<header_count; i++) {
+		if(request->headers[i]
+				&& !rest_header_is(request->headers[i], HTTP_HEADER_RANGE)
+				&& !rest_header_is(request->headers[i], "If-Match")
+				&& !rest_header_is(request->headers[i], "If-Unmodified-Since")) {
+			RestRequest_add_header(copy, request->headers[i]);
+		}
+	}
+}
+
+/**
+ * Requests the rest of an interrupted GET.  Data is appended to the
+ * response's destination as usual; only a file destination's content_length
+ * has to be summed over the attempts.  A repeat that isn't answered with
+ * 206 is refused before its body can be appended.
+ */
+static void rest_resume_get(RestFilter *self, RestClient *rest,
+		RestRequest *request, RestResponse *response, int header_count) {
+	RestRequest copy;
+	const char *value;
+	size_t value_len;
+	char validator[256];
+	char range[96];
+	long long start = 0, end = -1, offset;
+	int http_code = response->http_code;
+	char http_status[ERROR_MESSAGE_SIZE];
+	int64_t received = response->content_length;
+	int attempts = 0;
+
+	if((http_code != 200 && http_code != 206)
+			|| !rest_resume_validator(response, validator, sizeof(validator))) {
+		return;
+	}
+	if(http_code == 206) {
+		// The range actually sent, which also covers suffix and open ranges.
+		// Multipart replies to several ranges have no Content-Range.
+		value = RestResponse_find_header(response, HTTP_HEADER_CONTENT_RANGE,
+				strlen(HTTP_HEADER_CONTENT_RANGE), &value_len);
+		if(!value || sscanf(value, "bytes %lld-%lld", &start, &end) != 2) {
+			return;
+		}
+	}
+	strcpy(http_status, response->http_status);
+
+	while(rest_resume_interrupted(response->curl_error)
+			&& attempts++ < REST_RESUME_ATTEMPTS) {
+		offset = start + response->content_length;
+		if(end >= 0) {
+			snprintf(range, sizeof(range), HTTP_HEADER_RANGE ": bytes=%lld-%lld",
+					offset, end);
+		} else {
+			snprintf(range, sizeof(range), HTTP_HEADER_RANGE ": bytes=%lld-",
+					offset);
+		}
+		rest_resume_request(&copy, request, header_count, HTTP_GET);
+		RestRequest_add_header(&copy, range);
+		RestRequest_add_header(&copy, validator);
+		response->curl_error = 0;
+		response->curl_error_message[0] = '\0';
+		response->require_partial = 1;
+		((rest_http_filter)self->next->func)(self->next, rest, &copy, response);
+		response->require_partial = 0;
+		RestRequest_destroy(&copy);
+
+		if(response->file_body) {
+			received += response->content_length;
+			response->content_length = received;
+		}
+		if(response->http_code != 206 && (response->http_code
+				|| !rest_resume_interrupted(response->curl_error))) {
+			// The reply was refused at its status line.  412 means the
+			// object changed; leave it for the caller.
+			if(response->http_code) {
+				response->curl_error = 0;
+				response->curl_error_message[0] = '\0';
+			}
+			if(response->http_code / 100 == 2) {
+				response->curl_error = CURLE_RANGE_ERROR;
+				sprintf(response->curl_error_message,
+						"Server ignored the Range header (HTTP %d)",
+						response->http_code);
+			}
+			return;
+		}
+	}
+	if(!response->curl_error) {
+		// Report the status of the original request.
+		response->http_code = http_code;
+		strcpy(response->http_status, http_status);
+	}
+}
+
+/**
+ * Points copy's body at the part of request's body past offset.
+ * @return nonzero if the body can't be repositioned.
+ */
+static int rest_resume_body(RestRequest *copy, RestRequestBody *body,
+		int64_t offset, off_t file_start) {
+	int64_t length = body->data_size - offset;
+
+	if(body->use_fd) {
+		RestRequest_set_fd_body(copy, body->body_fd, body->fd_offset + offset,
+				length, body->content_type);
+	} else if(body->file_body) {
+		if(fseeko(body->file_body, file_start + offset, SEEK_SET)) {
+			return -1;
+		}
+		RestRequest_set_file_body(copy, body->file_body, length,
+				body->content_type);
+	} else if(body->body) {
+		RestRequest_set_array_body(copy, body->body + offset, length,
+				body->content_type);
+	} else {
+		return -1;
+	}
+	copy->request_body->filter = body->filter;
+	return 0;
+}
+
+/**
+ * Sends the rest of an interrupted PUT.  A HEAD request tells how much of
+ * the body the server stored and the object's validator at that point.
+ */
+static void rest_resume_put(RestFilter *self, RestClient *rest,
+		RestRequest *request, RestResponse *response, int header_count,
+		off_t file_start) {
+	RestRequestBody *body = request->request_body;
+	RestRequest copy;
+	RestResponse head;
+	const char *value;
+	size_t value_len;
+	char validator[256];
+	char range[128];
+	int64_t stored;
+	int attempts = 0;
+
+	if(!body || body->iov || RestRequest_get_header(request,
+			HTTP_HEADER_CONTENT_RANGE)) {
+		return;
+	}
+	while(rest_resume_interrupted(response->curl_error)
+			&& attempts++ < REST_RESUME_ATTEMPTS) {
+		rest_resume_request(&copy, request, header_count, HTTP_HEAD);
+		RestResponse_init(&head);
+		((rest_http_filter)self->next->func)(self->next, rest, &copy, &head);
+		RestRequest_destroy(&copy);
+		value = RestResponse_find_header(&head, HTTP_HEADER_CONTENT_LENGTH,
+				strlen(HTTP_HEADER_CONTENT_LENGTH), &value_len);
+		stored = value ? strtoll(value, NULL, 10) : -1;
+		if(head.curl_error || head.http_code / 100 != 2 || stored <= 0
+				|| stored >= body->data_size
+				|| !rest_resume_validator(&head, validator, sizeof(validator))) {
+			RestResponse_destroy(&head);
+			return;
+		}
+		RestResponse_destroy(&head);
+
+		rest_resume_request(&copy, request, header_count, HTTP_PUT);
+		if(rest_resume_body(&copy, body, stored, file_start)) {
+			RestRequest_destroy(&copy);
+			return;
+		}
+		snprintf(range, sizeof(range), HTTP_HEADER_CONTENT_RANGE
+				": bytes %lld-%lld/%lld", (long long)stored,
+				(long long)(body->data_size - 1), (long long)body->data_size);
+		RestRequest_add_header(&copy, range);
+		RestRequest_add_header(&copy, validator);
+		RestResponse_reset(response);
+		((rest_http_filter)self->next->func)(self->next, rest, &copy, response);
+		RestRequest_destroy(&copy);
+	}
+}
+
+void RestFilter_resume(RestFilter *self, RestClient *rest,
+		RestRequest *request, RestResponse *response) {
+	int header_count = request->header_count;
+	off_t file_start = 0;
+
+	if(!self->next) {
+		return;
+	}
+	if(request->request_body && request->request_body->file_body) {
+		file_start = ftello(request->request_body->file_body);
+	}
+
+	((rest_http_filter)self->next->func)(self->next, rest, request, response);
+
+	if(!rest_resume_interrupted(response->curl_error)) {
+		return;
+	}
+	if(request->method == HTTP_GET) {
+		rest_resume_get(self, rest, request, response, header_count);
+	} else if(request->method == HTTP_PUT) {
+		rest_resume_put(self, rest, request, response, header_count,
+				file_start);
+	}
+}
+
+
+
+/*
+ * Asynchronous engine
+ *
+ * Requests passed to RestClient_submit() run their filter chain on a small
+ * coroutine stack owned by an engine.  When the chain reaches
+ * RestFilter_execute_curl_request(), the cURL handle is added to the engine's
+ * multi handle and the coroutine yields back to the engine loop.  When the
+ * transfer completes, the coroutine is resumed and the filters see the
+ * response as the chain unwinds.  Thus a single thread can drive any number
+ * of requests using unmodified filters.
+ *
+ * Each stack is mapped with a guard page below it, so a filter that
+ * overflows it faults instead of corrupting the heap.  Without
+ * makecontext() and swapcontext() (REST_COROUTINES undefined), a task's
+ * chain runs to completion when the engine starts it, performing its
+ * transfers one at a time.
+ */
+
+/** Number of idle coroutine stacks an engine keeps for reuse */
+#define REST_ENGINE_STACK_CACHE 64
+
+/**
+ * A request executing on an engine.
+ */
+typedef struct RestTaskTag {
+#ifdef REST_COROUTINES
+	/** Saved state of the coroutine while it's suspended */
+	ucontext_t context;
+#endif
+	/** Coroutine stack, see rest_stack_alloc() */
+	void *stack;
+	/** The engine running this task */
+	struct RestEngineTag *engine;
+	RestClient *client;
+	RestFilter *filters;
+	RestRequest *request;
+	RestResponse *response;
+	rest_request_complete on_complete;
+	void *ctx;
+	/** Result of the last transfer performed by the task */
+	CURLcode result;
+	/** Nonzero when the filter chain has returned */
+	int done;
+	/** Next task in the submit queue */
+	struct RestTaskTag *next;
+	/**
+	 * Set for a transfer handed over by a blocking call (see
+	 * rest_engine_transfer()).  Such a task has no coroutine or filters;
+	 * the engine just performs the transfer and signals the caller.
+	 */
+	CURL *curl;
+#ifdef _PTHREADS
+	/** Signalled (under the engine lock) when curl's transfer is done */
+	pthread_cond_t *finished;
+#endif
+} RestTask;
+
+typedef struct RestEngineTag {
+	/** Multi handle multiplexing the transfers of all tasks */
+	CURLM *multi;
+#ifdef REST_COROUTINES
+	/** State of the engine loop while a task is running */
+	ucontext_t loop_context;
+#endif
+	/** Number of tasks started but not yet complete */
+	int running;
+	/** Idle coroutine stacks */
+	void *stacks[REST_ENGINE_STACK_CACHE];
+	int stack_count;
+	/** Tasks submitted but not yet started */
+	RestTask *submitted;
+	RestTask *submitted_tail;
+	/** The RestLoop driving this engine, or NULL if it drives itself */
+	RestLoop *loop;
+	/**
+	 * Pipe a RestLoop's engine is woken through from other threads.  The
+	 * read end is watched by the application like any socket.
+	 */
+	int wake_fds[2];
+#ifdef _PTHREADS
+	/** Protects submitted and stop */
+	pthread_mutex_t lock;
+	pthread_t thread;
+	/** Nonzero when the engine should exit once all tasks are complete */
+	int stop;
+#endif
+} RestEngine;
+
+/** The task currently running on this thread, if any. */
+static __thread RestTask *rest_current_task = NULL;
+
+#ifdef REST_COROUTINES
+/**
+ * Maps a coroutine stack of REST_TASK_STACK_SIZE bytes above an inaccessible
+ * guard page.
+ * @return the start of the mapping, guard page included, or NULL.
+ */
+static void *rest_stack_alloc(void) {
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	void *stack = mmap(NULL, REST_TASK_STACK_SIZE + page,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if(stack == MAP_FAILED) {
+		return NULL;
+	}
+	// Stacks grow down, so overflowing runs into the lowest page.
+	if(mprotect(stack, page, PROT_NONE)) {
+		munmap(stack, REST_TASK_STACK_SIZE + page);
+		return NULL;
+	}
+	return stack;
+}
+#endif
+
+static void rest_stack_free(void *stack) {
+#ifdef REST_COROUTINES
+	munmap(stack, REST_TASK_STACK_SIZE + (size_t)sysconf(_SC_PAGESIZE));
+#endif
+}
+
+static RestEngine *rest_engine_create(RestPrivate *priv) {
+	RestEngine *engine = calloc(1, sizeof(RestEngine));
+
+	engine->multi = curl_multi_init();
+	if(priv->http2) {
+		curl_multi_setopt(engine->multi, CURLMOPT_PIPELINING,
+				(long)CURLPIPE_MULTIPLEX);
+	}
+	if(priv->max_host_connections > 0) {
+		curl_multi_setopt(engine->multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+				(long)priv->max_host_connections);
+	}
+	if(priv->max_connections > 0) {
+		curl_multi_setopt(engine->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+				(long)priv->max_connections);
+	}
+#ifdef _PTHREADS
+	pthread_mutex_init(&engine->lock, NULL);
+#endif
+
+	return engine;
+}
+
+static void rest_engine_free(RestEngine *engine) {
+	int i;
+
+	for(i=0; i<engine->stack_count; i++) {
+		rest_stack_free(engine->stacks[i]);
+	}
+	curl_multi_cleanup(engine->multi);
+#ifdef _PTHREADS
+	pthread_mutex_destroy(&engine->lock);
+#endif
+	free(engine);
+}
+
+#ifdef REST_COROUTINES
+/**
+ * Entry point of a task's coroutine.  Returning resumes the engine loop.
+ */
+static void rest_task_main(void) {
+	RestTask *task = rest_current_task;
+
+	RestClient_execute_request(task->client, task->filters, task->request,
+			task->response);
+	task->done = 1;
+}
+#endif
+
+/**
+ * Switches from the running task back to its engine's loop.
+ */
+static void rest_task_yield(RestTask *task) {
+#ifdef REST_COROUTINES
+	swapcontext(&task->context, &task->engine->loop_context);
+#else
+	// Never reached: tasks only run on the engine's own stack.
+	abort();
+#endif
+}
+
+/**
+ * Invokes the callback of a task whose filter chain returned and frees it.
+ */
+static void rest_task_complete(RestTask *task) {
+	RestEngine *engine = task->engine;
+
+	if(task->stack) {
+		if(engine->stack_count < REST_ENGINE_STACK_CACHE) {
+			engine->stacks[engine->stack_count++] = task->stack;
+		} else {
+			rest_stack_free(task->stack);
+		}
+	}
+	engine->running--;
+
+	if(task->on_complete) {
+		task->on_complete(task->client, task->request, task->response,
+				task->ctx);
+	}
+	free(task);
+}
+
+/**
+ * Switches from the engine loop to the task until it yields or completes.
+ * If the task completed, its callback is invoked and the task is freed.
+ */
+static void rest_task_resume(RestTask *task) {
+#ifdef REST_COROUTINES
+	RestEngine *engine = task->engine;
+	// Engines can nest, e.g. a filter executing a batch.
+	RestTask *previous = rest_current_task;
+
+	rest_current_task = task;
+	swapcontext(&engine->loop_context, &task->context);
+	rest_current_task = previous;
+#endif
+
+	if(task->done) {
+		rest_task_complete(task);
+	}
+}
+
+static void rest_task_start(RestTask *task) {
+	RestEngine *engine = task->engine;
+
+	engine->running++;
+#ifdef REST_COROUTINES
+	if(engine->stack_count > 0) {
+		task->stack = engine->stacks[--engine->stack_count];
+	} else {
+		task->stack = rest_stack_alloc();
+	}
+	if(task->stack) {
+		getcontext(&task->context);
+		task->context.uc_stack.ss_sp = (char*)task->stack
+				+ sysconf(_SC_PAGESIZE);
+		task->context.uc_stack.ss_size = REST_TASK_STACK_SIZE;
+		task->context.uc_link = &engine->loop_context;
+		makecontext(&task->context, rest_task_main, 0);
+
+		rest_task_resume(task);
+		return;
+	}
+	task->response->curl_error = CURLE_OUT_OF_MEMORY;
+	sprintf(task->response->curl_error_message,
+			"Could not allocate a stack for the request");
+#else
+	// No coroutines: run the chain here, blocking in each transfer.
+	RestClient_execute_request(task->client, task->filters, task->request,
+			task->response);
+#endif
+	task->done = 1;
+	rest_task_complete(task);
+}
+
+/**
+ * Called from RestFilter_execute_curl_request() when running inside a task.
+ * Hands the transfer to the engine and suspends the task until it completes.
+ */
+static CURLcode rest_task_perform(RestTask *task, CURL *curl) {
+	RestEngine *engine = task->engine;
+
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, task);
+	if(curl_multi_add_handle(engine->multi, curl) != CURLM_OK) {
+		return CURLE_FAILED_INIT;
+	}
+
+	rest_task_yield(task);
+
+	curl_multi_remove_handle(engine->multi, curl);
+	return task->result;
+}
+
+static RestTask *rest_task_create(RestClient *client, RestFilter *filters,
+		RestRequest *request, RestResponse *response,
+		rest_request_complete on_complete, void *ctx) {
+	RestTask *task = calloc(1, sizeof(RestTask));
+
+	task->client = client;
+	task->filters = filters;
+	task->request = request;
+	task->response = response;
+	task->on_complete = on_complete;
+	task->ctx = ctx;
+
+	return task;
+}
+
+/**
+ * Wakes the engine so it starts its submitted tasks.  Safe to call from any
+ * thread.
+ */
+static void rest_engine_wake(RestEngine *engine) {
+	char c = 0;
+
+	if(!engine->loop) {
+		curl_multi_wakeup(engine->multi);
+	} else if(write(engine->wake_fds[1], &c, 1) < 0) {
+		// The pipe is full, so a wakeup is already pending.
+	}
+}
+
+/**
+ * Queues a task without waking the engine.
+ */
+static void rest_engine_push(RestEngine *engine, RestTask *task) {
+	task->engine = engine;
+	task->next = NULL;
+#ifdef _PTHREADS
+	pthread_mutex_lock(&engine->lock);
+#endif
+	if(engine->submitted_tail) {
+		engine->submitted_tail->next = task;
+	} else {
+		engine->submitted = task;
+	}
+	engine->submitted_tail = task;
+#ifdef _PTHREADS
+	pthread_mutex_unlock(&engine->lock);
+#endif
+}
+
+static void rest_engine_enqueue(RestEngine *engine, RestTask *task) {
+	rest_engine_push(engine, task);
+	rest_engine_wake(engine);
+}
+
+static RestTask *rest_engine_dequeue(RestEngine *engine) {
+	RestTask *task;
+
+#ifdef _PTHREADS
+	pthread_mutex_lock(&engine->lock);
+#endif
+	task = engine->submitted;
+	if(task) {
+		engine->submitted = task->next;
+		if(!engine->submitted) {
+			engine->submitted_tail = NULL;
+		}
+	}
+#ifdef _PTHREADS
+	pthread_mutex_unlock(&engine->lock);
+#endif
+
+	return task;
+}
+
+#ifdef _PTHREADS
+static void rest_engine_add_transfer(RestEngine *engine, RestTask *task) {
+	curl_easy_setopt(task->curl, CURLOPT_PRIVATE, task);
+	if(curl_multi_add_handle(engine->multi, task->curl) != CURLM_OK) {
+		pthread_mutex_lock(&engine->lock);
+		task->result = CURLE_FAILED_INIT;
+		task->done = 1;
+		pthread_cond_signal(task->finished);
+		pthread_mutex_unlock(&engine->lock);
+		return;
+	}
+	engine->running++;
+}
+
+static void rest_engine_finish_transfer(RestEngine *engine, RestTask *task) {
+	curl_multi_remove_handle(engine->multi, task->curl);
+	engine->running--;
+
+	// The task lives on the waiting thread's stack; don't touch it after
+	// releasing the lock.
+	pthread_mutex_lock(&engine->lock);
+	task->done = 1;
+	pthread_cond_signal(task->finished);
+	pthread_mutex_unlock(&engine->lock);
+}
+#endif
+
+/**
+ * Starts the tasks submitted to the engine.  Each runs its filter chain until
+ * its transfer is added to the multi handle (or the chain returns).  Tasks
+ * woken by the scheduler are resumed.
+ */
+static void rest_engine_start_submitted(RestEngine *engine) {
+	RestTask *task;
+
+	while((task = rest_engine_dequeue(engine))) {
+#ifdef _PTHREADS
+		if(task->curl) {
+			rest_engine_add_transfer(engine, task);
+			continue;
+		}
+#endif
+		if(task->stack) {
+			// A started task that was granted a slot by the scheduler
+			rest_task_resume(task);
+			continue;
+		}
+		rest_task_start(task);
+	}
+}
+
+/**
+ * Resumes the tasks whose transfers have completed.
+ */
+static void rest_engine_finish_completed(RestEngine *engine) {
+	RestTask *task;
+	CURLMsg *msg;
+	int msgs;
+
+	while((msg = curl_multi_info_read(engine->multi, &msgs))) {
+		if(msg->msg != CURLMSG_DONE) {
+			continue;
+		}
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&task);
+		task->result = msg->data.result;
+#ifdef _PTHREADS
+		if(task->curl) {
+			rest_engine_finish_transfer(engine, task);
+			continue;
+		}
+#endif
+		rest_task_resume(task);
+	}
+}
+
+/**
+ * Runs one iteration of the engine loop: starts submitted tasks, drives the
+ * transfers, resumes the tasks whose transfers completed, and then waits up
+ * to timeout_ms for more activity.
+ */
+static void rest_engine_run(RestEngine *engine, int timeout_ms) {
+	int still_running;
+
+	rest_engine_start_submitted(engine);
+	curl_multi_perform(engine->multi, &still_running);
+	rest_engine_finish_completed(engine);
+
+	// Returns early on curl_multi_wakeup() when tasks are submitted.
+	curl_multi_poll(engine->multi, NULL, 0, timeout_ms, NULL);
+}
+
+/*
+ * External event loop integration.  A RestLoop's engine is driven by the
+ * application through curl_multi_socket_action() instead of a thread.
+ */
+
+static int rest_loop_socket_function(CURL *easy, curl_socket_t fd, int what,
+		void *userp, void *socketp) {
+	RestLoop *loop = userp;
+
+	loop->socket_callback(loop, fd, what, loop->userdata);
+	return 0;
+}
+
+static int rest_loop_timer_function(CURLM *multi, long timeout_ms,
+		void *userp) {
+	RestLoop *loop = userp;
+
+	loop->timer_callback(loop, timeout_ms, loop->userdata);
+	return 0;
+}
+
+RestLoop *RestLoop_init(RestLoop *self, RestClient *client,
+		rest_loop_socket_callback socket_callback,
+		rest_loop_timer_callback timer_callback, void *userdata) {
+	RestEngine *engine;
+
+	Object_init_with_class_name((Object*)self, CLASS_REST_LOOP);
+	OBJECT_ZERO(self, RestLoop, Object);
+
+	self->client = client;
+	self->socket_callback = socket_callback;
+	self->timer_callback = timer_callback;
+	self->userdata = userdata;
+
+	engine = rest_engine_create(client->internal);
+	engine->loop = self;
+	curl_multi_setopt(engine->multi, CURLMOPT_SOCKETFUNCTION,
+			rest_loop_socket_function);
+	curl_multi_setopt(engine->multi, CURLMOPT_SOCKETDATA, self);
+	curl_multi_setopt(engine->multi, CURLMOPT_TIMERFUNCTION,
+			rest_loop_timer_function);
+	curl_multi_setopt(engine->multi, CURLMOPT_TIMERDATA, self);
+	self->internal = engine;
+
+	// Tasks granted a slot by another thread are started through the pipe.
+	if(pipe(engine->wake_fds)) {
+		fprintf(stderr, "RestLoop_init could not create its wakeup pipe.\n");
+		abort();
+	}
+	fcntl(engine->wake_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(engine->wake_fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(engine->wake_fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(engine->wake_fds[1], F_SETFD, FD_CLOEXEC);
+	socket_callback(self, engine->wake_fds[0], CURL_POLL_IN, userdata);
+
+	return self;
+}
+
+void RestLoop_destroy(RestLoop *self) {
+	RestEngine *engine = self->internal;
+
+	if(engine) {
+		self->socket_callback(self, engine->wake_fds[0], CURL_POLL_REMOVE,
+				self->userdata);
+		close(engine->wake_fds[0]);
+		close(engine->wake_fds[1]);
+		rest_engine_free(engine);
+	}
+	OBJECT_ZERO(self, RestLoop, Object);
+	Object_destroy((Object*)self);
+}
+
+void RestLoop_submit(RestLoop *self, RestFilter *filters,
+		RestRequest *request, RestResponse *response,
+		rest_request_complete on_complete, void *ctx) {
+	if(!filters) {
+		fprintf(stderr, "RestLoop_submit called with no filters.");
+		abort();
+	}
+
+	// Started on the next socket action or timeout; may be called from a
+	// filter running on this loop.
+	rest_engine_push(self->internal, rest_task_create(self->client,
+			filters, request, response, on_complete, ctx));
+	// Ask the application to call back right away.
+	self->timer_callback(self, 0, self->userdata);
+}
+
+void RestLoop_socket_action(RestLoop *self, int fd, int events) {
+	RestEngine *engine = self->internal;
+	int still_running;
+	char buffer[64];
+
+	if(fd == engine->wake_fds[0]) {
+		while(read(fd, buffer, sizeof(buffer)) > 0);
+		rest_engine_start_submitted(engine);
+		return;
+	}
+	rest_engine_start_submitted(engine);
+	curl_multi_socket_action(engine->multi, fd, events, &still_running);
+	rest_engine_finish_completed(engine);
+}
+
+void RestLoop_timeout(RestLoop *self) {
+	RestLoop_socket_action(self, CURL_SOCKET_TIMEOUT, 0);
+}
+
+int RestLoop_get_request_count(RestLoop *self) {
+	RestEngine *engine = self->internal;
+	RestTask *task;
+	int count = engine->running;
+
+	for(task=engine->submitted; task; task=task->next) {
+		count++;
+	}
+	return count;
+}
+
+/**
+ * State of a RestClient_execute_batch() call.
+ */
+typedef struct {
+	RestEngine *engine;
+	RestFilter *filters;
+	RestRequest **requests;
+	RestResponse **responses;
+	int count;
+	/** Index of the next request to start */
+	int next;
+	int completed;
+} RestBatch;
+
+static void rest_batch_complete(RestClient *rest, RestRequest *request,
+		RestResponse *response, void *ctx) {
+	RestBatch *batch = ctx;
+
+	batch->completed++;
+	if(batch->next < batch->count) {
+		rest_engine_enqueue(batch->engine, rest_task_create(rest,
+				batch->filters, batch->requests[batch->next],
+				batch->responses[batch->next], rest_batch_complete, batch));
+		batch->next++;
+	}
+}
+
+void RestClient_execute_batch(RestClient *self, RestFilter *filters,
+		RestRequest **requests, RestResponse **responses, int count,
+		int max_parallel) {
+	RestBatch batch;
+
+	if(!filters) {
+		fprintf(stderr, "RestClient_execute_batch called with no filters.");
+		abort();
+	}
+	if(count <= 0) {
+		return;
+	}
+	if(max_parallel <= 0 || max_parallel > count) {
+		max_parallel = count;
+	}
+
+	// The batch gets its own engine, driven by the calling thread.
+	memset(&batch, 0, sizeof(RestBatch));
+	batch.engine = rest_engine_create(self->internal);
+	batch.filters = filters;
+	batch.requests = requests;
+	batch.responses = responses;
+	batch.count = count;
+
+	for(batch.next=0; batch.next<max_parallel; batch.next++) {
+		rest_engine_enqueue(batch.engine, rest_task_create(self, filters,
+				requests[batch.next], responses[batch.next],
+				rest_batch_complete, &batch));
+	}
+
+	while(batch.completed < count) {
+		rest_engine_run(batch.engine, REST_ENGINE_POLL_TIMEOUT);
+	}
+
+	rest_engine_free(batch.engine);
+}
+
+/**
+ * One part of a RestClient_parallel_download() call.
+ */
+typedef struct RestDownloadPartTag {
+	struct RestDownloadTag *download;
+	RestRequest request;
+	RestResponse response;
+	/** Range of the object this part covers */
+	int64_t offset;
+	int64_t length;
+	/** Number of times this range has been requested */
+	int attempts;
+} RestDownloadPart;
+
+/**
+ * State of a RestClient_parallel_download() call.
+ */
+typedef struct RestDownloadTag {
+	RestClient *client;
+	RestEngine *engine;
+	RestFilter *filters;
+	const char *uri;
+	int fd;
+	int64_t part_size;
+	/** Size of the whole object */
+	int64_t total;
+	/** Offset of the next part to start */
+	int64_t next;
+	/** Number of parts in flight */
+	int running;
+	/** "If-Match" header sent with each part, or empty */
+	char if_match[256];
+	/** Receives the outcome of the download */
+	RestResponse *response;
+	int failed;
+} RestDownload;
+
+/**
+ * Checks that a part transferred exactly the requested range.  Turns a
+ * server ignoring the Range header or a short body into a cURL error.
+ * @return nonzero if the part is complete.
+ */
+static int rest_download_check(RestResponse *response, int64_t length) {
+	if(response->curl_error || response->http_code < 200
+			|| response->http_code > 299) {
+		return 0;
+	}
+	if(response->http_code != 206) {
+		response->curl_error = CURLE_RANGE_ERROR;
+		sprintf(response->curl_error_message,
+				"Server ignored the Range header (HTTP %d)", response->http_code);
+		return 0;
+	}
+	if(response->content_length != length) {
+		response->curl_error = CURLE_PARTIAL_FILE;
+		sprintf(response->curl_error_message,
+				"Expected %lld bytes, got %lld", (long long)length,
+				(long long)response->content_length);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Transport errors and server errors are worth another attempt.  Anything
+ * else (e.g. 404, 412 or a failed disk access) fails the same way again.
+ */
+static int rest_part_retryable(RestResponse *response) {
+	if(response->curl_error) {
+		return response->curl_error != CURLE_WRITE_ERROR
+				&& response->curl_error != CURLE_READ_ERROR
+				&& response->curl_error != CURLE_ABORTED_BY_CALLBACK
+				&& response->curl_error != CURLE_RANGE_ERROR;
+	}
+	return response->http_code >= 500 || response->http_code == 0;
+}
+
+static void rest_download_range(RestRequest *request, const char *uri,
+		int64_t offset, int64_t length, const char *if_match) {
+	char range[64];
+
+	RestRequest_reset(request, uri, HTTP_GET);
+	snprintf(range, sizeof(range), HTTP_HEADER_RANGE ": bytes=%lld-%lld",
+			(long long)offset, (long long)(offset + length - 1));
+	RestRequest_add_header(request, range);
+	if(if_match[0]) {
+		RestRequest_add_header(request, if_match);
+	}
+}
+
+static void rest_download_complete(RestClient *rest, RestRequest *request,
+		RestResponse *response, void *ctx);
+
+static void rest_download_start(RestDownload *download,
+		RestDownloadPart *part) {
+	rest_download_range(&part->request, download->uri, part->offset,
+			part->length, download->if_match);
+	RestResponse_reset(&part->response);
+	RestResponse_use_fd(&part->response, download->fd, part->offset);
+	part->attempts++;
+	download->running++;
+	rest_engine_enqueue(download->engine, rest_task_create(download->client,
+			download->filters, &part->request, &part->response,
+			rest_download_complete, part));
+}
+
+/**
+ * Starts the next part of the object on the part's slot, if any are left.
+ */
+static void rest_download_next(RestDownload *download,
+		RestDownloadPart *part) {
+	if(download->failed || download->next >= download->total) {
+		return;
+	}
+	part->offset = download->next;
+	part->length = download->total - download->next;
+	if(part->length > download->part_size) {
+		part->length = download->part_size;
+	}
+	part->attempts = 0;
+	download->next += part->length;
+	rest_download_start(download, part);
+}
+
+/**
+ * Copies the status of a part into the response of the whole transfer.
+ */
+static void rest_part_status(RestResponse *result, RestResponse *response) {
+	result->http_code = response->http_code;
+	strcpy(result->http_status, response->http_status);
+	result->curl_error = response->curl_error;
+	strcpy(result->curl_error_message, response->curl_error_message);
+}
+
+static void rest_download_complete(RestClient *rest, RestRequest *request,
+		RestResponse *response, void *ctx) {
+	RestDownloadPart *part = ctx;
+	RestDownload *download = part->download;
+
+	download->running--;
+	if(download->failed) {
+		return;
+	}
+	if(!rest_download_check(response, part->length)) {
+		if(rest_part_retryable(response)
+				&& part->attempts < REST_DOWNLOAD_ATTEMPTS) {
+			rest_download_start(download, part);
+		} else {
+			download->failed = 1;
+			rest_part_status(download->response, response);
+		}
+		return;
+	}
+	rest_download_next(download, part);
+}
+
+/**
+ * Reads the size of the object from the first part's Content-Range header.
+ * @return the size, or -1 if the header is missing or doesn't give it.
+ */
+static int64_t rest_download_total(RestResponse *response) {
+	const char *value;
+	size_t value_len;
+	long long start, end, total;
+
+	value = RestResponse_find_header(response, HTTP_HEADER_CONTENT_RANGE,
+			strlen(HTTP_HEADER_CONTENT_RANGE), &value_len);
+	if(!value || sscanf(value, "bytes %lld-%lld/%lld", &start, &end,
+			&total) != 3 || start != 0) {
+		return -1;
+	}
+	return total;
+}
+
+/**
+ * Body of RestClient_parallel_download() once the response writes to fd.
+ */
+static void rest_parallel_download(RestClient *self, RestFilter *filters,
+		const char *uri, int fd, int64_t part_size, int parallelism,
+		RestResponse *response) {
+	RestDownload download;
+	RestDownloadPart *parts;
+	RestRequest request;
+	const char *etag;
+	size_t etag_len;
+	int attempts = 0;
+	int i;
+
+	if(part_size <= 0) {
+		part_size = REST_DOWNLOAD_PART_SIZE;
+	}
+	if(parallelism <= 0) {
+		parallelism = REST_DOWNLOAD_PARALLELISM;
+	}
+
+	// The first part tells us the size of the object and its ETag.
+	RestRequest_init(&request, uri, HTTP_GET);
+	do {
+		RestResponse_reset(response);
+		rest_download_range(&request, uri, 0, part_size, "");
+		RestClient_execute_request(self, filters, &request, response);
+		attempts++;
+	} while(rest_part_retryable(response)
+			&& attempts < REST_DOWNLOAD_ATTEMPTS);
+	RestRequest_destroy(&request);
+
+	memset(&download, 0, sizeof(RestDownload));
+	if(response->curl_error) {
+		return;
+	}
+	if(response->http_code == 416) {
+		// Nothing to download.
+		response->http_code = 200;
+	} else if(response->http_code == 200) {
+		// The server sent the whole object.
+		download.total = response->content_length;
+	} else if(response->http_code == 206) {
+		download.total = rest_download_total(response);
+		if(download.total < 0 || response->content_length
+				!= (download.total < part_size ? download.total : part_size)) {
+			response->curl_error = CURLE_RANGE_ERROR;
+			sprintf(response->curl_error_message,
+					"Invalid Content-Range in response");
+			return;
+		}
+	} else {
+		return;
+	}
+	if(ftruncate(fd, download.total)) {
+		response->curl_error = CURLE_WRITE_ERROR;
+		sprintf(response->curl_error_message, "Error resizing file: %s",
+				strerror(errno));
+		return;
+	}
+	download.next = response->content_length;
+	response->content_length = download.total;
+	if(download.next >= download.total) {
+		return;
+	}
+
+	// Don't mix the rest of the object with a version that replaced it.
+	etag = RestResponse_find_header(response, "ETag", 4, &etag_len);
+	if(etag && strncmp(etag, "W/", 2) && etag_len < sizeof(download.if_match)
+			- sizeof("If-Match: ")) {
+		sprintf(download.if_match, "If-Match: %.*s", (int)etag_len, etag);
+	}
+
+	// The remaining parts get their own engine, driven by the calling thread.
+	if((download.total - download.next + part_size - 1) / part_size
+			< parallelism) {
+		parallelism = (download.total - download.next + part_size - 1)
+				/ part_size;
+	}
+	download.client = self;
+	download.engine = rest_engine_create(self->internal);
+	download.filters = filters;
+	download.uri = uri;
+	download.fd = fd;
+	download.part_size = part_size;
+	download.response = response;
+	parts = calloc(parallelism, sizeof(RestDownloadPart));
+	for(i=0; i<parallelism; i++) {
+		parts[i].download = &download;
+		RestRequest_init(&parts[i].request, uri, HTTP_GET);
+		RestResponse_init(&parts[i].response);
+		rest_download_next(&download, &parts[i]);
+	}
+
+	while(download.running > 0) {
+		rest_engine_run(download.engine, REST_ENGINE_POLL_TIMEOUT);
+	}
+
+	for(i=0; i<parallelism; i++) {
+		RestRequest_destroy(&parts[i].request);
+		RestResponse_destroy(&parts[i].response);
+	}
+	free(parts);
+	rest_engine_free(download.engine);
+}
+
+void RestClient_parallel_download(RestClient *self, RestFilter *filters,
+		const char *uri, int fd, int64_t part_size, int parallelism,
+		RestResponse *response) {
+	// Where the caller's response puts its body, restored at the end.
+	char *body = response->body;
+	size_t buffer_size = response->buffer_size;
+	int use_buffer = response->use_buffer;
+	FILE *file_body = response->file_body;
+	rest_response_sink sink = response->sink;
+	void *sink_ctx = response->sink_ctx;
+	int use_fd = response->use_fd;
+	int body_fd = response->body_fd;
+	off_t fd_offset = response->fd_offset;
+
+	if(!filters) {
+		fprintf(stderr, "RestClient_parallel_download called with no filters.");
+		abort();
+	}
+
+	RestResponse_use_fd(response, fd, 0);
+	rest_parallel_download(self, filters, uri, fd, part_size, parallelism,
+			response);
+
+	if(use_buffer) {
+		response->body = body;
+	}
+	response->buffer_size = buffer_size;
+	response->use_buffer = use_buffer;
+	response->file_body = file_body;
+	response->sink = sink;
+	response->sink_ctx = sink_ctx;
+	response->use_fd = use_fd;
+	response->body_fd = body_fd;
+	response->fd_offset = fd_offset;
+}
+
+/**
+ * One part of a RestClient_parallel_upload() call.  The file filter finds
+ * its part from the request with REST_CONTAINER_OF().
+ */
+typedef struct RestUploadPartTag {
+	RestRequest request;
+	RestResponse response;
+	struct RestUploadTag *upload;
+	/** Range of the file this part covers */
+	int64_t offset;
+	int64_t length;
+	/** Bytes of the current attempt sent so far */
+	int64_t sent;
+	/** Number of times this range has been sent */
+	int attempts;
+} RestUploadPart;
+
+/**
+ * State of a RestClient_parallel_upload() call.
+ */
+typedef struct RestUploadTag {
+	RestClient *client;
+	RestEngine *engine;
+	RestFilter *filters;
+	const char *uri;
+	const char *content_type;
+	int fd;
+	int64_t part_size;
+	/** Size of the whole upload */
+	int64_t total;
+	/** Offset of the next part to start */
+	int64_t next;
+	/** Bytes sent so far, summed over the parts */
+	int64_t sent;
+	/** Number of parts in flight */
+	int running;
+	rest_upload_progress progress;
+	void *progress_ctx;
+	/** Receives the outcome of the upload */
+	RestResponse *response;
+	int failed;
+} RestUpload;
+
+/**
+ * File filter of each part, counting the bytes read for the progress
+ * callback.
+ */
+static int rest_upload_filter(RestRequest *request, char *data,
+		size_t size) {
+	RestUploadPart *part = REST_CONTAINER_OF(request, RestUploadPart, request);
+	RestUpload *upload = part->upload;
+
+	part->sent += size;
+	upload->sent += size;
+	if(upload->progress) {
+		upload->progress(upload->progress_ctx, upload->sent, upload->total);
+	}
+	return 1;
+}
+
+static void rest_upload_complete(RestClient *rest, RestRequest *request,
+		RestResponse *response, void *ctx);
+
+static void rest_upload_start(RestUpload *upload, RestUploadPart *part) {
+	char range[96];
+
+	RestRequest_reset(&part->request, upload->uri, HTTP_PUT);
+	RestRequest_set_fd_body(&part->request, upload->fd, part->offset,
+			part->length, upload->content_type);
+	RestRequest_set_file_filter(&part->request, rest_upload_filter);
+	if(upload->total > 0) {
+		snprintf(range, sizeof(range), HTTP_HEADER_CONTENT_RANGE
+				": bytes %lld-%lld/%lld", (long long)part->offset,
+				(long long)(part->offset + part->length - 1),
+				(long long)upload->total);
+		RestRequest_add_header(&part->request, range);
+	}
+	RestResponse_reset(&part->response);
+	upload->sent -= part->sent;
+	part->sent = 0;
+	part->attempts++;
+	upload->running++;
+	rest_engine_enqueue(upload->engine, rest_task_create(upload->client,
+			upload->filters, &part->request, &part->response,
+			rest_upload_complete, part));
+}
+
+/**
+ * Starts the next part of the file on the part's slot, if any are left.
+ */
+static void rest_upload_next(RestUpload *upload, RestUploadPart *part) {
+	if(upload->failed || upload->next >= upload->total) {
+		return;
+	}
+	part->offset = upload->next;
+	part->length = upload->total - upload->next;
+	if(part->length > upload->part_size) {
+		part->length = upload->part_size;
+	}
+	part->attempts = 0;
+	part->sent = 0;
+	upload->next += part->length;
+	rest_upload_start(upload, part);
+}
+
+static void rest_upload_complete(RestClient *rest, RestRequest *request,
+		RestResponse *response, void *ctx) {
+	RestUploadPart *part = ctx;
+	RestUpload *upload = part->upload;
+
+	upload->running--;
+	if(upload->failed) {
+		return;
+	}
+	if(response->curl_error || response->http_code < 200
+			|| response->http_code > 299) {
+		if(rest_part_retryable(response)
+				&& part->attempts < REST_UPLOAD_ATTEMPTS) {
+			rest_upload_start(upload, part);
+		} else {
+			upload->failed = 1;
+			rest_part_status(upload->response, response);
+		}
+		return;
+	}
+	rest_part_status(upload->response, response);
+	rest_upload_next(upload, part);
+}
+
+void RestClient_parallel_upload(RestClient *self, RestFilter *filters,
+		const char *uri, int fd, int64_t length, const char *content_type,
+		int64_t part_size, int parallelism, rest_upload_progress progress,
+		void *progress_ctx, RestResponse *response) {
+	RestUpload upload;
+	RestUploadPart *parts;
+	int i;
+
+	if(!filters) {
+		fprintf(stderr, "RestClient_parallel_upload called with no filters.");
+		abort();
+	}
+	if(part_size <= 0) {
+		part_size = REST_UPLOAD_PART_SIZE;
+	}
+	if(parallelism <= 0) {
+		parallelism = REST_UPLOAD_PARALLELISM;
+	}
+	if((length + part_size - 1) / part_size < parallelism) {
+		// An empty file is still sent, as one empty part.
+		parallelism = length > 0 ? (length + part_size - 1) / part_size : 1;
+	}
+
+	// The parts get their own engine, driven by the calling thread.
+	memset(&upload, 0, sizeof(RestUpload));
+	upload.client = self;
+	upload.engine = rest_engine_create(self->internal);
+	upload.filters = filters;
+	upload.uri = uri;
+	upload.content_type = content_type;
+	upload.fd = fd;
+	upload.part_size = part_size;
+	upload.total = length;
+	upload.progress = progress;
+	upload.progress_ctx = progress_ctx;
+	upload.response = response;
+	RestResponse_reset(response);
+
+	parts = calloc(parallelism, sizeof(RestUploadPart));
+	for(i=0; i<parallelism; i++) {
+		parts[i].upload = &upload;
+		RestRequest_init(&parts[i].request, uri, HTTP_PUT);
+		RestResponse_init(&parts[i].response);
+		rest_upload_next(&upload, &parts[i]);
+	}
+	if(length <= 0) {
+		rest_upload_start(&upload, &parts[0]);
+	}
+
+	while(upload.running > 0) {
+		rest_engine_run(upload.engine, REST_ENGINE_POLL_TIMEOUT);
+	}
+
+	for(i=0; i<parallelism; i++) {
+		RestRequest_destroy(&parts[i].request);
+		RestResponse_destroy(&parts[i].response);
+	}
+	free(parts);
+	rest_engine_free(upload.engine);
+}
+
+/**
+ * Negotiates HTTP/2 through ALPN for TLS.  Plain HTTP servers are assumed to
+ * speak it (prior knowledge) since upgrading doesn't allow multiplexing.
+ */
+static void rest_http2_config(CURL *curl, const char *url) {
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+			strncasecmp(url, "https://", 8) ?
+			CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE : CURL_HTTP_VERSION_2TLS);
+}
+
+/**
+ * Tells whether a finished transfer ran on the same connection as one of the
+ * given transfers, going by the local address of their connections.
+ */
+static int rest_connection_seen(CURL **seen, int count, CURL *curl) {
+	char *ip, *seen_ip;
+	long port, seen_port;
+	int i;
+
+	if(curl_easy_getinfo(curl, CURLINFO_LOCAL_IP, &ip) != CURLE_OK || !ip
+			|| curl_easy_getinfo(curl, CURLINFO_LOCAL_PORT, &port) != CURLE_OK) {
+		return 0;
+	}
+	for(i=0; i<count; i++) {
+		if(curl_easy_getinfo(seen[i], CURLINFO_LOCAL_IP, &seen_ip) == CURLE_OK
+				&& curl_easy_getinfo(seen[i], CURLINFO_LOCAL_PORT, &seen_port)
+						== CURLE_OK
+				&& seen_ip && port == seen_port && !strcmp(ip, seen_ip)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int RestClient_warmup(RestClient *self, int connections, int timeout_ms) {
+	RestPrivate *priv = self->internal;
+	RestHandle **handles;
+	CURL **warm;
+	CURLM *multi;
+	CURLMsg *msg;
+	char *url;
+	int i, j, msgs, still_running, warmed = 0;
+
+	// Connections beyond the cache size would just be closed again.
+	j = priv->max_connections > 0 ? priv->max_connections
+			: REST_DEFAULT_CONNECTION_CACHE;
+	if(connections > j) {
+		connections = j;
+	}
+	if(connections <= 0) {
+		return 0;
+	}
+
+	url = malloc(priv->url_prefix_len + 2);
+	memcpy(url, priv->url_prefix, priv->url_prefix_len);
+	strcpy(url + priv->url_prefix_len, "/");
+
+	// All handles run at once, so each needs a connection of its own.  Idle
+	// connections already in the pool are reused and count as warm.
+	multi = curl_multi_init();
+	handles = calloc(connections, sizeof(RestHandle*));
+	warm = calloc(connections, sizeof(CURL*));
+	for(i=0; i<connections; i++) {
+		RestHandle *handle = rest_handle_checkout(priv);
+		CURL *curl = handle->curl;
+
+		curl_easy_setopt(curl, CURLOPT_URL, url);
+		curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT);
+		if(timeout_ms > 0) {
+			curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)timeout_ms);
+		}
+		if(priv->http2) {
+			rest_http2_config(curl, url);
+		}
+		// The handlers set up proxies, TLS options and the shared state
+		// the connections are cached in.
+		for(j=0; j<priv->curl_config_handler_count; j++) {
+			if(priv->handlers[j](self, curl)) {
+				break;
+			}
+		}
+		if(j < priv->curl_config_handler_count
+				|| curl_multi_add_handle(multi, curl) != CURLM_OK) {
+			rest_handle_return(priv, handle);
+			continue;
+		}
+		handles[i] = handle;
+	}
+
+	do {
+		curl_multi_perform(multi, &still_running);
+		while((msg = curl_multi_info_read(multi, &msgs))) {
+			// Any response means the connection is up; the status of a
+			// HEAD of / doesn't matter.  HTTP/2 may multiplex several of the
+			// requests over one connection, which only counts once.
+			if(msg->msg == CURLMSG_DONE && msg->data.result == CURLE_OK
+					&& !rest_connection_seen(warm, warmed,
+							msg->easy_handle)) {
+				warm[warmed++] = msg->easy_handle;
+			}
+		}
+		if(still_running) {
+			curl_multi_poll(multi, NULL, 0, REST_ENGINE_POLL_TIMEOUT, NULL);
+		}
+	} while(still_running);
+
+	for(i=0; i<connections; i++) {
+		if(handles[i]) {
+			curl_multi_remove_handle(multi, handles[i]->curl);
+			rest_handle_return(priv, handles[i]);
+		}
+	}
+	free(handles);
+	free(warm);
+	curl_multi_cleanup(multi);
+	free(url);
+
+	return warmed;
+}
+
+#ifdef _PTHREADS
+static void *rest_engine_main(void *arg) {
+	RestEngine *engine = arg;
+
+	for(;;) {
+		int stop;
+
+		pthread_mutex_lock(&engine->lock);
+		stop = engine->stop && !engine->submitted;
+		pthread_mutex_unlock(&engine->lock);
+		if(stop && engine->running == 0) {
+			break;
+		}
+		rest_engine_run(engine, REST_ENGINE_POLL_TIMEOUT);
+	}
+
+	return NULL;
+}
+
+/**
+ * Starts the client's engine threads if they're not running yet.
+ * @return nonzero on failure.
+ */
+static int rest_engines_start(RestPrivate *priv) {
+	int i, rc = 0;
+
+	pthread_mutex_lock(&priv->engine_lock);
+	if(!priv->engines) {
+		if(priv->engine_count < 1) {
+			priv->engine_count = 1;
+		}
+		priv->engines = calloc(priv->engine_count, sizeof(RestEngine*));
+		for(i=0; i<priv->engine_count; i++) {
+			priv->engines[i] = rest_engine_create(priv);
+			if(pthread_create(&priv->engines[i]->thread, NULL,
+					rest_engine_main, priv->engines[i])) {
+				rest_engine_free(priv->engines[i]);
+				break;
+			}
+		}
+		// Make do with the engines that did start.
+		priv->engine_count = i;
+		if(i == 0) {
+			free(priv->engines);
+			priv->engines = NULL;
+			rc = -1;
+		}
+	}
+	pthread_mutex_unlock(&priv->engine_lock);
+
+	return rc;
+}
+
+/**
+ * Waits for all submitted requests to complete and stops the engine threads.
+ */
+static void rest_engines_stop(RestPrivate *priv) {
+	int i;
+
+	if(!priv->engines) {
+		return;
+	}
+	for(i=0; i<priv->engine_count; i++) {
+		RestEngine *engine = priv->engines[i];
+		pthread_mutex_lock(&engine->lock);
+		engine->stop = 1;
+		pthread_mutex_unlock(&engine->lock);
+		curl_multi_wakeup(engine->multi);
+		pthread_join(engine->thread, NULL);
+		rest_engine_free(engine);
+	}
+	free(priv->engines);
+	priv->engines = NULL;
+}
+
+static RestEngine *rest_engine_pick(RestPrivate *priv) {
+	return priv->engines[__atomic_fetch_add(&priv->next_engine, 1,
+			__ATOMIC_RELAXED) % priv->engine_count];
+}
+
+/**
+ * Performs a transfer for a blocking request on one of the client's engines
+ * so that it can share (multiplexed) connections with the requests of other
+ * threads.  Blocks until the transfer is complete.
+ * @param multi if not NULL, set to the multi handle running the transfer.
+ */
+static CURLcode rest_engine_transfer(RestPrivate *priv, CURL *curl,
+		CURLM **multi) {
+	RestEngine *engine;
+	RestTask task;
+	pthread_cond_t finished;
+
+	if(rest_engines_start(priv)) {
+		return curl_easy_perform(curl);
+	}
+	engine = rest_engine_pick(priv);
+	if(multi) {
+		__atomic_store_n(multi, engine->multi, __ATOMIC_RELEASE);
+	}
+
+	memset(&task, 0, sizeof(RestTask));
+	task.curl = curl;
+	task.finished = &finished;
+	pthread_cond_init(&finished, NULL);
+
+	rest_engine_enqueue(engine, &task);
+
+	pthread_mutex_lock(&engine->lock);
+	while(!task.done) {
+		pthread_cond_wait(&finished, &engine->lock);
+	}
+	pthread_mutex_unlock(&engine->lock);
+	pthread_cond_destroy(&finished);
+
+	return task.result;
+}
+
+void RestClient_set_async_file_io(RestClient *self, int enabled) {
+	RestPrivate *priv = self->internal;
+
+	priv->async_file_io = enabled;
+}
+
+void RestClient_set_engine_threads(RestClient *self, int threads) {
+	RestPrivate *priv = self->internal;
+
+	priv->engine_count = threads;
+}
+
+void RestClient_submit(RestClient *self, RestFilter *filters,
+		RestRequest *request, RestResponse *response,
+		rest_request_complete on_complete, void *ctx) {
+	RestPrivate *priv = self->internal;
+	RestEngine *engine;
+	RestTask *task;
+
+	if(!filters) {
+		fprintf(stderr, "RestClient_submit called with no filters.");
+		abort();
+	}
+
+	if(rest_engines_start(priv)) {
+		response->curl_error = CURLE_FAILED_INIT;
+		sprintf(response->curl_error_message,
+				"Unable to start request engine");
+		if(on_complete) {
+			on_complete(self, request, response, ctx);
+		}
+		return;
+	}
+
+	task = rest_task_create(self, filters, request, response, on_complete,
+			ctx);
+	engine = rest_engine_pick(priv);
+	rest_engine_enqueue(engine, task);
+}
+
+void RestClient_set_executor_threads(RestClient *self, int threads) {
+	RestPrivate *priv = self->internal;
+
+	priv->executor_threads = threads;
+}
+
+RestExecutor *RestClient_get_executor(RestClient *self) {
+	RestPrivate *priv = self->internal;
+	RestExecutor *executor;
+
+	executor = __atomic_load_n(&priv->executor, __ATOMIC_ACQUIRE);
+	if(executor) {
+		return executor;
+	}
+
+	pthread_mutex_lock(&priv->engine_lock);
+	if(!priv->executor) {
+		executor = RestExecutor_init(malloc(sizeof(RestExecutor)), self,
+				priv->executor_threads);
+		__atomic_store_n(&priv->executor, executor, __ATOMIC_RELEASE);
+	}
+	executor = priv->executor;
+	pthread_mutex_unlock(&priv->engine_lock);
+
+	return executor;
+}
+#endif
+
+/*
+ * Request scheduler
+ *
+ * When connection limits are set, each transfer needs a slot.  Requests that
+ * can't get one wait in a FIFO per priority class.  A finishing transfer
+ * hands its slot straight to the first waiter of the highest priority class,
+ * either by signalling the blocked thread or by resuming the suspended task
+ * on its engine.
+ */
+
+typedef struct RestWaiterTag {
+	struct RestWaiterTag *next;
+	enum rest_priority priority;
+	/** Set once the waiter has been handed a slot */
+	int granted;
+	/** When the waiter was queued */
+	struct timespec queued;
+	/** The suspended task, or NULL for a blocked thread */
+	RestTask *task;
+#ifdef _PTHREADS
+	pthread_cond_t wake;
+#endif
+} RestWaiter;
+
+/**
+ * All of a client's requests go to the same host, so the lower of the two
+ * limits applies.
+ */
+static int rest_scheduler_limit(RestPrivate *priv) {
+	int limit = priv->max_host_connections;
+
+	if(priv->max_connections > 0 && (limit <= 0 || priv->max_connections < limit)) {
+		limit = priv->max_connections;
+	}
+	return limit;
+}
+
+/**
+ * Records a dispatched request.  For requests that waited, called with the
+ * scheduler lock held.
+ */
+static void rest_scheduler_dispatched(RestPrivate *priv,
+		enum rest_priority priority, const struct timespec *queued) {
+	RestSchedulerStats *stats = &priv->scheduler_stats[priority];
+	struct timespec now;
+	int64_t wait;
+
+	__atomic_fetch_add(&stats->dispatched, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->active, 1, __ATOMIC_RELAXED);
+	if(!queued) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wait = (int64_t)(now.tv_sec - queued->tv_sec) * 1000000
+			+ (now.tv_nsec - queued->tv_nsec) / 1000;
+	stats->queue_depth--;
+	stats->total_wait_usec += wait;
+	if(wait > stats->max_wait_usec) {
+		stats->max_wait_usec = wait;
+	}
+}
+
+/**
+ * Waits until the scheduler dispatches the request.  Inside a task, the task
+ * is suspended instead of blocking the engine.  Every call must be paired
+ * with rest_scheduler_release().
+ */
+static void rest_scheduler_acquire(RestPrivate *priv,
+		enum rest_priority priority) {
+	int limit = rest_scheduler_limit(priv);
+	RestWaiter waiter;
+	int p;
+
+	if(limit <= 0) {
+		rest_scheduler_dispatched(priv, priority, NULL);
+		return;
+	}
+
+#ifdef _PTHREADS
+	pthread_mutex_lock(&priv->scheduler_lock);
+#endif
+	// Don't overtake waiters of the same or a higher priority.
+	for(p=0; p<=(int)priority && !priv->waiting[p]; p++);
+	if(priv->active_requests < limit && p > (int)priority) {
+		priv->active_requests++;
+		rest_scheduler_dispatched(priv, priority, NULL);
+#ifdef _PTHREADS
+		pthread_mutex_unlock(&priv->scheduler_lock);
+#endif
+		return;
+	}
+#ifndef _PTHREADS
+	if(!rest_current_task) {
+		// Without threads nothing could release a slot while this thread
+		// waits, so go over the limit rather than deadlock.
+		priv->active_requests++;
+		rest_scheduler_dispatched(priv, priority, NULL);
+		return;
+	}
+#endif
+
+	memset(&waiter, 0, sizeof(RestWaiter));
+	waiter.priority = priority;
+	waiter.task = rest_current_task;
+	clock_gettime(CLOCK_MONOTONIC, &waiter.queued);
+	if(priv->waiting_tail[priority]) {
+		priv->waiting_tail[priority]->next = &waiter;
+	} else {
+		priv->waiting[priority] = &waiter;
+	}
+	priv->waiting_tail[priority] = &waiter;
+	priv->scheduler_stats[priority].queue_depth++;
+
+	if(waiter.task) {
+#ifdef _PTHREADS
+		pthread_mutex_unlock(&priv->scheduler_lock);
+#endif
+		// Resumed by the engine once rest_scheduler_release() grants the
+		// slot.  The engine can't resume it before this switch since it's
+		// the engine running it.
+		rest_task_yield(waiter.task);
+#ifdef _PTHREADS
+	} else {
+		pthread_cond_init(&waiter.wake, NULL);
+		while(!waiter.granted) {
+			pthread_cond_wait(&waiter.wake, &priv->scheduler_lock);
+		}
+		pthread_mutex_unlock(&priv->scheduler_lock);
+		pthread_cond_destroy(&waiter.wake);
+#endif
+	}
+}
+
+/**
+ * Releases a request's slot, handing it to the highest priority waiter.
+ */
+static void rest_scheduler_release(RestPrivate *priv,
+		enum rest_priority priority) {
+	RestWaiter *waiter = NULL;
+	RestTask *task = NULL;
+	int p;
+
+	__atomic_fetch_sub(&priv->scheduler_stats[priority].active, 1,
+			__ATOMIC_RELAXED);
+	if(rest_scheduler_limit(priv) <= 0) {
+		return;
+	}
+
+#ifdef _PTHREADS
+	pthread_mutex_lock(&priv->scheduler_lock);
+#endif
+	for(p=0; p<REST_PRIORITY_COUNT && !waiter; p++) {
+		waiter = priv->waiting[p];
+	}
+	// If the limit was lowered, shrink rather than hand over.
+	if(waiter && priv->active_requests <= rest_scheduler_limit(priv)) {
+		priv->waiting[waiter->priority] = waiter->next;
+		if(!waiter->next) {
+			priv->waiting_tail[waiter->priority] = NULL;
+		}
+		waiter->granted = 1;
+		rest_scheduler_dispatched(priv, waiter->priority, &waiter->queued);
+		// The waiter may be gone as soon as the lock is released.
+		task = waiter->task;
+#ifdef _PTHREADS
+		if(!task) {
+			pthread_cond_signal(&waiter->wake);
+		}
+#endif
+	} else {
+		priv->active_requests--;
+	}
+#ifdef _PTHREADS
+	pthread_mutex_unlock(&priv->scheduler_lock);
+#endif
+
+	if(task) {
+		rest_engine_enqueue(task->engine, task);
+	}
+}
+
+void RestClient_get_scheduler_stats(RestClient *self,
+		enum rest_priority priority, RestSchedulerStats *stats) {
+	RestPrivate *priv = self->internal;
+
+#ifdef _PTHREADS
+	pthread_mutex_lock(&priv->scheduler_lock);
+#endif
+	*stats = priv->scheduler_stats[priority];
+#ifdef _PTHREADS
+	pthread_mutex_unlock(&priv->scheduler_lock);
+#endif
+}
+
+/*
+ * URI encoding
+ */
+
+/** rest_uri_chars values: escape the byte, copy it or stop at the query. */
+#define REST_URI_ESCAPE 0
+#define REST_URI_COPY 1
+#define REST_URI_QUERY 2
+
+/**
+ * Classifies every byte for rest_uri_encode().  The unreserved characters
+ * (ALPHA / DIGIT / "-" / "." / "_" / "~") and the path separator are copied.
+ */
+static const unsigned char rest_uri_chars[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x00 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x10 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, /* 0x20  -./ */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 2, /* 0x30 0-9 ? */
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 0x40 A-O */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, /* 0x50 P-Z _ */
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 0x60 a-o */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0, /* 0x70 p-z ~ */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x80 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0  /* 0xf0 */
+};
+
+#ifdef __SSE2__
+/**
+ * Returns the number of leading bytes of the 16 at src that can be copied
+ * as they are.
+ */
+static int rest_uri_safe_run(const char *src) {
+	__m128i c = _mm_loadu_si128((const __m128i*)src);
+	// Bytes >= 0x80 are negative and fail every range check.
+	__m128i safe = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(0x2c)),
+			_mm_cmplt_epi8(c, _mm_set1_epi8(0x3a)));
+	safe = _mm_or_si128(safe, _mm_and_si128(
+			_mm_cmpgt_epi8(c, _mm_set1_epi8(0x40)),
+			_mm_cmplt_epi8(c, _mm_set1_epi8(0x5b))));
+	safe = _mm_or_si128(safe, _mm_and_si128(
+			_mm_cmpgt_epi8(c, _mm_set1_epi8(0x60)),
+			_mm_cmplt_epi8(c, _mm_set1_epi8(0x7b))));
+	safe = _mm_or_si128(safe, _mm_cmpeq_epi8(c, _mm_set1_epi8('_')));
+	safe = _mm_or_si128(safe, _mm_cmpeq_epi8(c, _mm_set1_epi8('~')));
+
+	return __builtin_ctz(~_mm_movemask_epi8(safe));
+}
+#endif
+
+size_t rest_uri_encode(char *dest, const char *uri) {
+	static const char hex[] = "0123456789ABCDEF";
+	size_t len = strlen(uri);
+	size_t i = 0;
+	char *out = dest;
+
+	while(i < len) {
+		unsigned char c;
+
+#ifdef __SSE2__
+		while(i + 16 <= len) {
+			int run = rest_uri_safe_run(uri + i);
+			memcpy(out, uri + i, 16);
+			out += run;
+			i += run;
+			if(run < 16) {
+				break;
+			}
+		}
+		if(i >= len) {
+			break;
+		}
+#endif
+		c = uri[i];
+		switch(rest_uri_chars[c]) {
+		case REST_URI_COPY:
+			*out++ = c;
+			i++;
+			break;
+		case REST_URI_QUERY:
+			// The query string is passed through as is.
+			memcpy(out, uri + i, len - i);
+			out += len - i;
+			i = len;
+			break;
+		default:
+			*out++ = '%';
+			*out++ = hex[c >> 4];
+			*out++ = hex[c & 0xf];
+			i++;
+			break;
+		}
+	}
+	*out = '\0';
+
+	return out - dest;
+}
+
+#ifdef _PTHREADS
+/*
+ * Asynchronous file I/O
+ *
+ * The client's file I/O pool moves file data through two buffers while cURL
+ * consumes or fills the other one.  For uploads a pool thread reads ahead of
+ * the transfer; for downloads it writes behind it.  A transfer is queued on
+ * the pool whenever it has a buffer to fill or drain and is served by one
+ * pool thread at a time, so its file is accessed in order.  Finished
+ * transfers keep their buffers in the pool for the next one.
+ */
+
+/**
+ * Double buffer shared by a transfer and the file I/O pool.
+ */
+typedef struct RestFileIOTag {
+	/** The pool serving the transfer */
+	struct RestFileIOPoolTag *pool;
+	/** The file read from or written to */
+	FILE *file;
+	/** Nonzero for downloads (write-behind), zero for uploads */
+	int writing;
+	/** The request, for the filter of an upload */
+	RestRequest *request;
+	/** The two buffers */
+	char *buffers[2];
+	/** Bytes in each buffer; zero means the buffer is free */
+	size_t used[2];
+	/** Buffer the transfer uses next */
+	int current;
+	/** Buffer the pool fills or drains next */
+	int next;
+	/** Read offset in the current buffer of an upload */
+	size_t offset;
+	/** Bytes left for the pool to read for an upload */
+	int64_t remaining;
+	/** Set by the pool when it reached the end or failed */
+	int done;
+	/** Set by the pool if the file couldn't be read or written */
+	int error;
+	/** Set by the transfer when it no longer needs the pool */
+	int stop;
+	/** Nonzero while queued on or served by the pool */
+	int queued;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/** Next transfer in the pool's queue or idle list */
+	struct RestFileIOTag *link;
+} RestFileIO;
+
+/**
+ * Threads serving the asynchronous file I/O of a client.
+ */
+typedef struct RestFileIOPoolTag {
+	/** Transfers with work for the pool, oldest first */
+	RestFileIO *head;
+	RestFileIO *tail;
+	/** Finished transfers kept for their buffers */
+	RestFileIO *idle;
+	/** Number of transfers on the idle list */
+	int idle_count;
+	/** Set to make the threads exit */
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/** Number of threads started */
+	int thread_count;
+	pthread_t threads[REST_FILE_IO_THREADS];
+} RestFileIOPool;
+
+/**
+ * Tells whether the pool has a buffer to fill or drain for a transfer.
+ * Called with the transfer's lock held.
+ */
+static int rest_file_io_ready(RestFileIO *io) {
+	if(io->stop || io->done) {
+		return 0;
+	}
+	return io->writing ? io->used[io->next] != 0 : io->used[io->next] == 0;
+}
+
+/**
+ * Queues a transfer on the pool if it has work and isn't queued already.
+ * Called with the transfer's lock held.
+ */
+static void rest_file_io_schedule(RestFileIO *io) {
+	RestFileIOPool *pool = io->pool;
+
+	if(io->queued || !rest_file_io_ready(io)) {
+		return;
+	}
+	io->queued = 1;
+	io->link = NULL;
+	pthread_mutex_lock(&pool->lock);
+	if(pool->tail) {
+		pool->tail->link = io;
+	} else {
+		pool->head = io;
+	}
+	pool->tail = io;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Fills or drains the buffers of a transfer until there's nothing left to do
+ * for it.
+ */
+static void rest_file_io_serve(RestFileIO *io) {
+	pthread_mutex_lock(&io->lock);
+	while(rest_file_io_ready(io)) {
+		int index = io->next;
+		size_t n;
+
+		if(io->writing) {
+			n = io->used[index];
+			pthread_mutex_unlock(&io->lock);
+			n = n - fwrite(io->buffers[index], 1, n, io->file);
+			pthread_mutex_lock(&io->lock);
+			if(n) {
+				io->error = io->done = 1;
+			}
+		} else {
+			n = io->remaining > REST_FILE_IO_BUFFER_SIZE ?
+					REST_FILE_IO_BUFFER_SIZE : (size_t)io->remaining;
+			pthread_mutex_unlock(&io->lock);
+			n = n ? fread(io->buffers[index], 1, n, io->file) : 0;
+			pthread_mutex_lock(&io->lock);
+			io->remaining -= n;
+			if(!n || io->remaining == 0) {
+				io->done = 1;
+				io->error = ferror(io->file) != 0;
+			}
+			if(!n) {
+				break;
+			}
+		}
+		io->used[index] = io->writing ? 0 : n;
+		io->next = !index;
+		pthread_cond_broadcast(&io->cond);
+	}
+	io->queued = 0;
+	pthread_cond_broadcast(&io->cond);
+	pthread_mutex_unlock(&io->lock);
+}
+
+static void *rest_file_io_pool_main(void *arg) {
+	RestFileIOPool *pool = arg;
 
-    if(ws->response_header_count >= MAX_HEADERS) {
-    	fprintf(stderr, "MAX_HEADERS reached parsing response.");
-    	return 0; // Error
-    }
+	pthread_mutex_lock(&pool->lock);
+	for(;;) {
+		RestFileIO *io;
 
-    ws->response_headers[ws->response_header_count] = (char*)malloc(mem_required+1);//+1 for \0
-    memcpy(ws->response_headers[ws->response_header_count], ptr, mem_required);
-    ws->response_headers[ws->response_header_count][mem_required] = '\0';
-    ws->response_header_count++;
+		while(!pool->head && !pool->stop) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+		if(!pool->head) {
+			break;
+		}
+		io = pool->head;
+		pool->head = io->link;
+		if(!pool->head) {
+			pool->tail = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		rest_file_io_serve(io);
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
 
-    return size*nmemb;
+	return NULL;
 }
 
-void RestClient_execute_request(RestClient *self, RestFilter *filters,
-		RestRequest *request, RestResponse *response) {
+/**
+ * Returns the client's file I/O pool, starting it on first use.
+ * @return the pool or NULL if no thread could be started.
+ */
+static RestFileIOPool *rest_file_io_pool(RestPrivate *priv) {
+	RestFileIOPool *pool;
 
-	if(!filters) {
-		fprintf(stderr, "RestClient_execute_request called with no filters.");
-		abort();
-	} else {
-		// Simply invoke the head of the filter chain.
-		((rest_http_filter)filters->func)(filters, self, request, response);
+	pool = __atomic_load_n(&priv->file_io, __ATOMIC_ACQUIRE);
+	if(pool) {
+		return pool;
+	}
+
+	pthread_mutex_lock(&priv->engine_lock);
+	if(!priv->file_io && (pool = calloc(1, sizeof(RestFileIOPool)))) {
+		pthread_mutex_init(&pool->lock, NULL);
+		pthread_cond_init(&pool->cond, NULL);
+		while(pool->thread_count < REST_FILE_IO_THREADS
+				&& !pthread_create(&pool->threads[pool->thread_count], NULL,
+						rest_file_io_pool_main, pool)) {
+			pool->thread_count++;
+		}
+		if(pool->thread_count) {
+			__atomic_store_n(&priv->file_io, pool, __ATOMIC_RELEASE);
+		} else {
+			pthread_mutex_destroy(&pool->lock);
+			pthread_cond_destroy(&pool->cond);
+			free(pool);
+		}
 	}
+	pool = priv->file_io;
+	pthread_mutex_unlock(&priv->engine_lock);
+
+	return pool;
 }
 
-RestFilter *RestFilter_add(RestFilter *start, rest_http_filter next) {
-	RestFilter *newfilter = calloc(sizeof(RestFilter), 1);
+static void rest_file_io_free(RestFileIO *io) {
+	pthread_mutex_destroy(&io->lock);
+	pthread_cond_destroy(&io->cond);
+	free(io->buffers[0]);
+	free(io->buffers[1]);
+	free(io);
+}
 
-	newfilter->func = next;
-	if(start) {
-		newfilter->next = start;
+/**
+ * Stops the client's file I/O pool.  No transfer may be using it.
+ */
+static void rest_file_io_pool_stop(RestPrivate *priv) {
+	RestFileIOPool *pool = priv->file_io;
+	int i;
+
+	if(!pool) {
+		return;
 	}
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for(i=0; i<pool->thread_count; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	while(pool->idle) {
+		RestFileIO *io = pool->idle;
 
-	return newfilter;
+		pool->idle = io->link;
+		rest_file_io_free(io);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	free(pool);
+	priv->file_io = NULL;
 }
 
-void RestFilter_free(RestFilter *start) {
-	if(start->next) {
-		RestFilter_free(start->next);
+/**
+ * Starts moving the data of a file transfer on the client's pool, reusing
+ * the buffers of a finished transfer when there is one.
+ * @return the transfer's buffers or NULL if the pool couldn't be used.
+ */
+static RestFileIO *rest_file_io_start(RestPrivate *priv, FILE *file,
+		int writing, int64_t length) {
+	RestFileIOPool *pool = rest_file_io_pool(priv);
+	RestFileIO *io;
+
+	if(!pool) {
+		return NULL;
 	}
-	free(start);
+	pthread_mutex_lock(&pool->lock);
+	io = pool->idle;
+	if(io) {
+		pool->idle = io->link;
+		pool->idle_count--;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if(!io) {
+		io = calloc(1, sizeof(RestFileIO));
+		if(!io) {
+			return NULL;
+		}
+		io->buffers[0] = malloc(REST_FILE_IO_BUFFER_SIZE);
+		io->buffers[1] = malloc(REST_FILE_IO_BUFFER_SIZE);
+		pthread_mutex_init(&io->lock, NULL);
+		pthread_cond_init(&io->cond, NULL);
+		if(!io->buffers[0] || !io->buffers[1]) {
+			rest_file_io_free(io);
+			return NULL;
+		}
+	}
+	io->pool = pool;
+	io->file = file;
+	io->writing = writing;
+	io->request = NULL;
+	io->used[0] = io->used[1] = 0;
+	io->current = io->next = 0;
+	io->offset = 0;
+	io->remaining = length;
+	io->done = io->error = io->stop = io->queued = 0;
+
+	// Start reading ahead right away.
+	pthread_mutex_lock(&io->lock);
+	rest_file_io_schedule(io);
+	pthread_mutex_unlock(&io->lock);
+	return io;
 }
 
 /**
- * Sets the Content-Type and Content-Length headers
+ * Finishes a file transfer: flushes the last buffer of a download, waits
+ * for the pool to let go of the transfer and keeps its buffers for the next
+ * one.
+ * @return nonzero if the file couldn't be read or written.
  */
-void RestFilter_set_content_headers(RestFilter *self, RestClient *rest,
-		RestRequest *request, RestResponse *response) {
-	char headerbuf[MAX_HEADER_SIZE];
+static int rest_file_io_finish(RestFileIO *io) {
+	RestFileIOPool *pool = io->pool;
+	int error;
+
+	pthread_mutex_lock(&io->lock);
+	if(io->writing) {
+		// Hand over the partly filled buffer and wait for both to drain.
+		if(io->offset && !io->error) {
+			io->used[io->current] = io->offset;
+			rest_file_io_schedule(io);
+		}
+		while(!io->error && (io->used[0] || io->used[1])) {
+			pthread_cond_wait(&io->cond, &io->lock);
+		}
+	}
+	io->stop = 1;
+	while(io->queued) {
+		pthread_cond_wait(&io->cond, &io->lock);
+	}
+	error = io->error;
+	pthread_mutex_unlock(&io->lock);
 
-	if(request->request_body) {
-	    /** Curl should set this itself */
-		/* snprintf(headerbuf, MAX_HEADER_SIZE, "%s: %" PRId64,
-		        HTTP_HEADER_CONTENT_LENGTH,
-				(long long)request->request_body->data_size);
-		RestRequest_add_header(request, headerbuf); */
-		snprintf(headerbuf, MAX_HEADER_SIZE, "%s: %s", HTTP_HEADER_CONTENT_TYPE,
-				request->request_body->content_type);
-        RestRequest_add_header(request, headerbuf);
-	} else if(request->method == HTTP_POST || request->method == HTTP_PUT || request->method == HTTP_PATCH) {
-		// Zero-length body
-		RestRequest_add_header(request, HTTP_HEADER_CONTENT_LENGTH ":0");
+	if(io->writing && !error) {
+		error = fflush(io->file) != 0;
 	}
 
-	// Pass to the next filter
-	if(self->next) {
-		((rest_http_filter)self->next->func)(self->next, rest, request, response);
+	pthread_mutex_lock(&pool->lock);
+	if(pool->idle_count < REST_FILE_IO_THREADS) {
+		io->link = pool->idle;
+		pool->idle = io;
+		pool->idle_count++;
+		io = NULL;
 	}
+	pthread_mutex_unlock(&pool->lock);
+	if(io) {
+		rest_file_io_free(io);
+	}
+	return error;
+}
 
-	// Parse content-type from response
-	int count = response->response_header_count;
-	int i;
-	for(i=0; i<count; i++) {
-		char *header = response->response_headers[i];
-		if(header && strstr(header, HTTP_HEADER_CONTENT_TYPE) == header) {
-			char *content_type = header + strlen(HTTP_HEADER_CONTENT_TYPE);
-			content_type++; // skip ":"
-
-			// Might be leading spaces
-			while(*content_type == ' ') {
-				content_type++;
-			}
+/**
+ * Upload read callback served from the read-ahead buffers.
+ */
+static size_t readfunc_file_io(void *ptr, size_t size, size_t nmemb,
+		void *stream) {
+	RestFileIO *io = stream;
+	RestRequestBody *ud = io->request->request_body;
+	size_t c;
+	int error;
+
+	pthread_mutex_lock(&io->lock);
+	while(!io->used[io->current] && !io->done) {
+		pthread_cond_wait(&io->cond, &io->lock);
+	}
+	if(!io->used[io->current]) {
+		// The pool is done and everything was sent.
+		error = io->error;
+		pthread_mutex_unlock(&io->lock);
+		return error ? CURL_READFUNC_ABORT : 0;
+	}
+	pthread_mutex_unlock(&io->lock);
 
-            if(response->content_type) {
-                // If one was already set, free it.
-                free(response->content_type);
-            }
-			response->content_type = strdup(content_type);
-			break;
+	// Only this thread touches a full buffer.
+	c = io->used[io->current] - io->offset;
+	if(c > size*nmemb) {
+		c = size*nmemb;
+	}
+	memcpy(ptr, io->buffers[io->current] + io->offset, c);
+	io->offset += c;
+
+	if(io->offset == io->used[io->current]) {
+		pthread_mutex_lock(&io->lock);
+		io->used[io->current] = 0;
+		io->current = !io->current;
+		io->offset = 0;
+		rest_file_io_schedule(io);
+		pthread_mutex_unlock(&io->lock);
+	}
+
+	if(ud->filter) {
+		if(!((rest_file_data_filter)ud->filter)(io->request, ptr, c)) {
+			return CURL_READFUNC_ABORT;
 		}
 	}
+	ud->bytes_written += c;
+	ud->bytes_remaining -= c;
+	return c;
 }
 
+/**
+ * Download write callback filling the write-behind buffers.
+ */
+static size_t writefunc_file_io(void *ptr, size_t size, size_t nmemb,
+		void *stream) {
+	RestFileIO *io = stream;
+	size_t total = size*nmemb;
+	size_t done = 0;
+	int error;
+
+	while(done < total) {
+		size_t c;
+
+		if(io->offset == 0) {
+			// Wait for the pool to free the buffer.
+			pthread_mutex_lock(&io->lock);
+			while(io->used[io->current] && !io->error) {
+				pthread_cond_wait(&io->cond, &io->lock);
+			}
+			error = io->error;
+			pthread_mutex_unlock(&io->lock);
+			if(error) {
+				return 0;
+			}
+		}
 
+		c = REST_FILE_IO_BUFFER_SIZE - io->offset;
+		if(c > total - done) {
+			c = total - done;
+		}
+		memcpy(io->buffers[io->current] + io->offset, (char*)ptr + done, c);
+		io->offset += c;
+		done += c;
+
+		if(io->offset == REST_FILE_IO_BUFFER_SIZE) {
+			pthread_mutex_lock(&io->lock);
+			io->used[io->current] = io->offset;
+			io->current = !io->current;
+			io->offset = 0;
+			rest_file_io_schedule(io);
+			pthread_mutex_unlock(&io->lock);
+		}
+	}
+	return total;
+}
+#endif
 
 void RestFilter_execute_curl_request(RestFilter *self, RestClient *rest,
 		RestRequest *request, RestResponse *response) {
-	CURL *curl = curl_easy_init();
+    RestPrivate *priv = rest->internal;
+	RestHandle *handle = rest_handle_checkout(priv);
+	CURL *curl = handle->curl;
     struct curl_slist *chunk = NULL;
-    char *encoded_uri;
     char *endpoint_url;
     long http_code;
-    size_t endpoint_size;
-    size_t i,j;
-
-    RestPrivate *priv = rest->internal;
-
-	/* Encode the URI */
-	encoded_uri = (char*)malloc(strlen(request->uri)*3+1); /* Worst case if every char was encoded */
-	memset(encoded_uri, 0, strlen(request->uri)*3+1);
+    long num_connects = 0;
+    char *content_type = NULL;
+    enum rest_priority priority;
+    size_t uri_len = strlen(request->uri);
+#ifdef _PTHREADS
+    RestFileIO *upload_io = NULL, *download_io = NULL;
+#endif
+    size_t i;
+
+	/* Build the URL in the handle's buffer, worst case if every char was encoded */
+	endpoint_url = rest_handle_url(handle, priv->url_prefix_len + uri_len*3 + 1);
+	if(!endpoint_url) {
+		response->curl_error = CURLE_OUT_OF_MEMORY;
+		sprintf(response->curl_error_message, "Out of memory building URL");
+		rest_handle_return(priv, handle);
+		return;
+	}
+	memcpy(endpoint_url, priv->url_prefix, priv->url_prefix_len);
 
 	if(request->uri_encoded) {
 	    // URI is already encoded.
-	    strcpy(encoded_uri, request->uri);
+	    memcpy(endpoint_url + priv->url_prefix_len, request->uri, uri_len + 1);
 	} else {
-        for(i=0,j=0; i<strlen(request->uri); i++) {
-            if(request->uri[i] == '/') {
-                encoded_uri[j++] = request->uri[i];
-            } else if(request->uri[i] == '?') {
-                /* Do the rest */
-                strcat(encoded_uri, request->uri+i);
-                break;
-            } else {
-                /* Encode the data */
-                char *encoded;
-                encoded = curl_easy_escape(curl, request->uri+i, 1);
-                strcat(encoded_uri, encoded);
-                curl_free(encoded);
-                j = strlen(encoded_uri);
-            }
-        }
+		rest_uri_encode(endpoint_url + priv->url_prefix_len, request->uri);
 	}
 
-
-	endpoint_size = strlen(rest->host)+strlen(encoded_uri) +1;
-	endpoint_url = (char*)malloc(endpoint_size);
-
-	snprintf(endpoint_url, endpoint_size, "%s%s", rest->host, encoded_uri);
-
-	/* Done with encoded version */
-	free(encoded_uri);
-
 	curl_easy_setopt(curl, CURLOPT_URL, endpoint_url);
 	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 0);
 	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT);
@@ -487,6 +3764,13 @@ void RestFilter_execute_curl_request(RestFilter *self, RestClient *rest,
 	curl_easy_setopt(curl, CURLOPT_WRITEHEADER, response);
 	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, response->curl_error_message);
 
+	if(priv->http2) {
+		rest_http2_config(curl, endpoint_url);
+		// Wait for a stream on an existing connection instead of opening
+		// a new one.
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+	}
+
 	switch(request->method) {
 
 	case HTTP_POST:
@@ -531,6 +3815,24 @@ void RestFilter_execute_curl_request(RestFilter *self, RestClient *rest,
           request->request_body->bytes_remaining = request->request_body->data_size;
 		  curl_easy_setopt(curl, CURLOPT_READFUNCTION, readfunc_file);
 
+	  } else if(request->request_body->map) {
+		  curl_easy_setopt(curl, CURLOPT_READDATA, request);
+		  request->request_body->bytes_written = 0;
+		  request->request_body->bytes_remaining = request->request_body->data_size;
+		  curl_easy_setopt(curl, CURLOPT_READFUNCTION, readfunc_mmap);
+		  curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, REST_MMAP_UPLOAD_BUFFER);
+	  } else if(request->request_body->use_fd) {
+		  curl_easy_setopt(curl, CURLOPT_READDATA, request);
+		  request->request_body->bytes_written = 0;
+		  request->request_body->bytes_remaining = request->request_body->data_size;
+		  curl_easy_setopt(curl, CURLOPT_READFUNCTION, readfunc_fd);
+		  curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, REST_MMAP_UPLOAD_BUFFER);
+	  } else if(request->request_body->iov) {
+		  curl_easy_setopt(curl, CURLOPT_READDATA, request);
+		  request->request_body->bytes_remaining = request->request_body->data_size;
+		  request->request_body->iov_index = 0;
+		  request->request_body->iov_offset = 0;
+		  curl_easy_setopt(curl, CURLOPT_READFUNCTION, readfunc_iov);
 	  } else {
 		  curl_easy_setopt(curl, CURLOPT_READDATA, request);
 		  request->request_body->bytes_remaining = request->request_body->data_size;
@@ -538,7 +3840,14 @@ void RestFilter_execute_curl_request(RestFilter *self, RestClient *rest,
 	  }
 	}
 
-	if(response->file_body) {
+	if(response->sink) {
+		/* Hand the body to the sink, resuming it from the progress callback */
+		response->sink_state = REST_SINK_RUNNING;
+		response->sink_curl = curl;
+		curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+		curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, rest_sink_progress);
+		curl_easy_setopt(curl, CURLOPT_XFERINFODATA, response);
+	} else if(response->file_body) {
 		/* Write to the stream */
 		curl_easy_setopt(curl, CURLOPT_WRITEDATA, response->file_body);
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
@@ -572,48 +3881,87 @@ void RestFilter_execute_curl_request(RestFilter *self, RestClient *rest,
 			response->curl_error = CURLE_ABORTED_BY_CALLBACK;
 			sprintf(response->curl_error_message,
 					"Request aborted by request handler");
-			curl_easy_cleanup(curl);
+			rest_handle_return(priv, handle);
 			curl_slist_free_all(chunk);
-			free(endpoint_url);
 			return;
 		}
 	}
 
-	// Execute the request
-	response->curl_error = curl_easy_perform(curl);
+#ifdef _PTHREADS
+	// Move file data on the file I/O pool.  Not on an engine: the callbacks
+	// wait for the pool, which would stall every transfer of the engine.
+	if(priv->async_file_io && !rest_current_task) {
+		if(request->request_body && request->request_body->file_body
+				&& (request->method == HTTP_POST || request->method == HTTP_PUT
+						|| request->method == HTTP_PATCH)) {
+			upload_io = rest_file_io_start(priv,
+					request->request_body->file_body, 0,
+					request->request_body->data_size);
+			if(upload_io) {
+				upload_io->request = request;
+				curl_easy_setopt(curl, CURLOPT_READFUNCTION, readfunc_file_io);
+				curl_easy_setopt(curl, CURLOPT_READDATA, upload_io);
+			}
+		}
+		if(response->file_body && !response->sink && !response->use_fd) {
+			download_io = rest_file_io_start(priv, response->file_body, 1, 0);
+			if(download_io) {
+				curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc_file_io);
+				curl_easy_setopt(curl, CURLOPT_WRITEDATA, download_io);
+			}
+		}
+	}
+#endif
+
+	// Execute the request once the scheduler lets it through
+	priority = (unsigned)request->priority < REST_PRIORITY_COUNT ?
+			request->priority : REST_PRIORITY_NORMAL;
+	rest_scheduler_acquire(priv, priority);
+	if(rest_current_task) {
+		if(response->sink) {
+			__atomic_store_n(&response->sink_multi,
+					rest_current_task->engine->multi, __ATOMIC_RELEASE);
+		}
+		response->curl_error = rest_task_perform(rest_current_task, curl);
+#ifdef _PTHREADS
+	} else if(priv->http2) {
+		// Multiplex the requests of all threads over the engines'
+		// connections.
+		response->curl_error = rest_engine_transfer(priv, curl,
+				response->sink ? &response->sink_multi : NULL);
+#endif
+	} else if(response->sink) {
+		// Run on a multi handle so RestResponse_resume() can wake it.
+		response->curl_error = rest_handle_perform(handle,
+				&response->sink_multi);
+	} else {
+		response->curl_error = curl_easy_perform(curl);
+	}
+	__atomic_store_n(&response->sink_multi, NULL, __ATOMIC_RELEASE);
+	rest_scheduler_release(priv, priority);
+#ifdef _PTHREADS
+	if(upload_io && rest_file_io_finish(upload_io) && !response->curl_error) {
+		response->curl_error = CURLE_READ_ERROR;
+		sprintf(response->curl_error_message, "Error reading request body file");
+	}
+	if(download_io && rest_file_io_finish(download_io) && !response->curl_error) {
+		response->curl_error = CURLE_WRITE_ERROR;
+		sprintf(response->curl_error_message, "Error writing response body file");
+	}
+#endif
 
 	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
 	response->http_code = (int)http_code;
-	curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &response->content_type);
-
-	/* dup it so we can free later */
-	if(response->content_type) {
-		response->content_type = strdup(response->content_type);
-	} else {
-		response->content_type = NULL;
-	}
-
-    // First header should be the HTTP status line, e.g.
-    // HTTP/1.1 200 OK
-    // Capture the status message ("OK") since curl doesn't seem to do
-    // this for us.
-    if(response->response_header_count > 0) {
-
-        int space = 0;
-        char *line = response->response_headers[0];
-        while(*line && space < 2) {
-            if(*line == ' ') {
-                space++;
-            }
-            line++;
-        }
-        if(space == 2) {
-            // correctly found 2 spaces.
-            strncpy(response->http_status, line, ERROR_MESSAGE_SIZE);
-        }
-    }
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &num_connects);
+	response->num_connects = (int)num_connects;
+	curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
+
+	/* dup it since the handle's copy goes away with the handle */
+	if(content_type) {
+		rest_response_set_content_type(response, content_type,
+				strlen(content_type));
+	}
 
-    
     // If we read a file, record the number of bytes
     if(response->file_body) {
         // Do this by getting the current ptr.
@@ -622,9 +3970,8 @@ void RestFilter_execute_curl_request(RestFilter *self, RestClient *rest,
     }
 
 
-	curl_easy_cleanup(curl);
+	rest_handle_return(priv, handle);
 	curl_slist_free_all(chunk);
-	free(endpoint_url);
 }
 
 
@@ -637,20 +3984,15 @@ RestResponse *RestResponse_init(RestResponse *self) {
 }
 
 void RestResponse_destroy(RestResponse *self) {
-	int i;
-
     // Free the body only if we allocated it.
 	if(self->body && !self->use_buffer) {
 		free(self->body);
 	}
-	for(i=0; i<self->response_header_count; i++) {
-		if(self->response_headers[i]) {
-			free(self->response_headers[i]);
-		}
-	}
-	if(self->content_type) {
-		free(self->content_type);
-	}
+	free(self->header_block);
+	free(self->header_index);
+	free(self->header_table);
+	rest_response_clear_content_type(self);
+	free(self->content_type_storage);
 
 	// Clear all our fields.
 	memset(((void*)self)+sizeof(Object), 0, sizeof(RestResponse) - sizeof(Object));
@@ -658,51 +4000,202 @@ void RestResponse_destroy(RestResponse *self) {
 	Object_destroy((Object*)self);
 }
 
+void RestResponse_reset(RestResponse *self) {
+	char *header_block = self->header_block;
+	size_t header_block_capacity = self->header_block_capacity;
+	RestHeader *header_index = self->header_index;
+	int header_index_capacity = self->header_index_capacity;
+	uint32_t *header_table = self->header_table;
+	int header_table_size = self->header_table_size;
+	char *body = self->body;
+	size_t body_capacity = self->body_capacity;
+	size_t buffer_size = self->buffer_size;
+	int use_buffer = self->use_buffer;
+	FILE *file_body = self->file_body;
+	rest_response_sink sink = self->sink;
+	void *sink_ctx = self->sink_ctx;
+	int use_fd = self->use_fd;
+	int body_fd = self->body_fd;
+	off_t fd_offset = self->fd_offset;
+	char *content_type_storage;
+	size_t content_type_capacity;
+
+	rest_response_clear_content_type(self);
+	content_type_storage = self->content_type_storage;
+	content_type_capacity = self->content_type_capacity;
+
+	// Keep the memory and where the body goes; clear everything else.
+	memset(((void*)self)+sizeof(Object), 0, sizeof(RestResponse) - sizeof(Object));
+	self->header_block = header_block;
+	self->header_block_capacity = header_block_capacity;
+	self->header_index = header_index;
+	self->header_index_capacity = header_index_capacity;
+	self->header_table = header_table;
+	self->header_table_size = header_table_size;
+	if(header_table) {
+		memset(header_table, 0, header_table_size * sizeof(uint32_t));
+	}
+	self->body = body;
+	self->buffer_size = buffer_size;
+	self->use_buffer = use_buffer;
+	self->file_body = file_body;
+	self->sink = sink;
+	self->sink_ctx = sink_ctx;
+	self->use_fd = use_fd;
+	self->body_fd = body_fd;
+	self->fd_offset = fd_offset;
+	self->content_type_storage = content_type_storage;
+	self->content_type_capacity = content_type_capacity;
+	if(!use_buffer) {
+		self->body_capacity = body_capacity;
+		if(body) {
+			body[0] = '\0';
+		}
+	}
+}
+
 void RestResponse_use_buffer(RestResponse *self, char *buffer,
                              size_t buffer_size) {
     self->body = buffer;
     self->buffer_size = buffer_size;
     self->use_buffer = 1;
     self->file_body = NULL;
+    self->sink = NULL;
+    self->use_fd = 0;
     
 }
 void RestResponse_use_file(RestResponse *self, FILE *f) {
     self->body = NULL;
     self->use_buffer = 0;
     self->file_body = f;
+    self->sink = NULL;
+    self->use_fd = 0;
 }
 
+void RestResponse_use_fd(RestResponse *self, int fd, off_t offset) {
+	if(self->use_buffer) {
+		self->body = NULL;
+		self->use_buffer = 0;
+	}
+	self->file_body = NULL;
+	self->sink = NULL;
+	self->use_fd = 1;
+	self->body_fd = fd;
+	self->fd_offset = offset;
+}
 
-RestRequest *RestRequest_init(RestRequest *self, const char *uri, enum http_method method) {
-	Object_init_with_class_name((Object*)self, CLASS_REST_REQUEST);
-	OBJECT_ZERO(self, RestRequest, Object);
+void RestResponse_use_sink(RestResponse *self, rest_response_sink sink,
+		void *ctx) {
+	if(self->use_buffer) {
+		self->body = NULL;
+		self->use_buffer = 0;
+	}
+	self->file_body = NULL;
+	self->use_fd = 0;
+	self->sink = sink;
+	self->sink_ctx = ctx;
+}
 
-	self->uri = strdup(uri);
-	self->method = method;
+void RestResponse_resume(RestResponse *self) {
+	CURLM *multi;
 
-	return self;
+	__atomic_store_n(&self->sink_state, REST_SINK_RESUMING, __ATOMIC_RELEASE);
+	// Don't wait for the multi handle's poll to time out.
+	multi = __atomic_load_n(&self->sink_multi, __ATOMIC_ACQUIRE);
+	if(multi) {
+		curl_multi_wakeup(multi);
+	}
 }
 
-void RestRequest_destroy(RestRequest *self) {
-	int i;
 
-	// Free the body if set
-	if(self->request_body) {
-		free(self->request_body);
-		self->request_body = 0;
+/**
+ * Copies uri into the request's URI buffer, growing it if needed.
+ */
+static void rest_request_set_uri(RestRequest *self, const char *uri) {
+	size_t size = strlen(uri) + 1;
+
+	if(size > self->uri_capacity) {
+		free(self->uri);
+		self->uri = malloc(size);
+		self->uri_capacity = size;
+	}
+	memcpy(self->uri, uri, size);
+}
+
+/**
+ * Removes the request's body, releasing a file mapping.
+ */
+static void rest_request_clear_body(RestRequest *self) {
+	if(self->request_body && self->request_body->map) {
+		munmap(self->request_body->map, self->request_body->map_length);
 	}
+	self->request_body = NULL;
+	memset(&self->body_storage, 0, sizeof(RestRequestBody));
+}
+
+/**
+ * Frees or, if keep is set, keeps for reuse the buffers of the request's
+ * headers and empties the header list.
+ */
+static void rest_request_clear_headers(RestRequest *self, int keep) {
+	int i;
 
-	// Free the headers if set
 	for(i = 0; i<self->header_count; i++) {
-		if(self->headers[i]) {
+		if(self->headers[i] != self->header_storage[i]) {
+			// Replaced or freed (and set to NULL) by the caller, who owns
+			// the old buffer.
 			free(self->headers[i]);
-			self->headers[i] = NULL;
+			self->header_storage[i] = NULL;
+			self->header_capacity[i] = 0;
+		}
+		self->headers[i] = NULL;
+	}
+	if(!keep) {
+		for(i = 0; i<MAX_HEADERS; i++) {
+			free(self->header_storage[i]);
+			self->header_storage[i] = NULL;
+			self->header_capacity[i] = 0;
 		}
 	}
 
 	self->header_count = 0;
+	self->indexed_header_count = 0;
+	memset(self->header_table, 0, sizeof(self->header_table));
+}
+
+RestRequest *RestRequest_init(RestRequest *self, const char *uri, enum http_method method) {
+	Object_init_with_class_name((Object*)self, CLASS_REST_REQUEST);
+	OBJECT_ZERO(self, RestRequest, Object);
+
+	rest_request_set_uri(self, uri);
+	self->method = method;
+	self->priority = REST_PRIORITY_NORMAL;
+
+	return self;
+}
+
+RestRequest *RestRequest_reset(RestRequest *self, const char *uri,
+		enum http_method method) {
+	rest_request_clear_headers(self, 1);
+	rest_request_clear_body(self);
+	rest_request_set_uri(self, uri);
+	self->uri_encoded = 0;
+	self->method = method;
+	self->priority = REST_PRIORITY_NORMAL;
+
+	return self;
+}
+
+void RestRequest_destroy(RestRequest *self) {
+	// The body is embedded in the request
+	rest_request_clear_body(self);
+
+	// Free the headers if set
+	rest_request_clear_headers(self, 0);
+
 	free(self->uri);
 	self->uri = NULL;
+	self->uri_capacity = 0;
 	self->method = 0;
 
 
@@ -711,7 +4204,8 @@ void RestRequest_destroy(RestRequest *self) {
 
 void RestRequest_set_array_body(RestRequest *self, const char *data,
         int64_t data_size, const char *content_type) {
-	self->request_body = calloc(sizeof(RestRequestBody), 1);
+	rest_request_clear_body(self);
+	self->request_body = &self->body_storage;
 
 	self->request_body->body = data;
 	self->request_body->data_size = data_size;
@@ -720,16 +4214,98 @@ void RestRequest_set_array_body(RestRequest *self, const char *data,
 
 void RestRequest_set_file_body(RestRequest *self, FILE *data, int64_t data_size,
 		const char *content_type) {
-	self->request_body = calloc(sizeof(RestRequestBody), 1);
+	rest_request_clear_body(self);
+	self->request_body = &self->body_storage;
 
 	self->request_body->file_body = data;
 	self->request_body->data_size = data_size;
 	self->request_body->content_type = content_type;
 }
 
+int RestRequest_set_mmap_body(RestRequest *self, int fd, off_t offset,
+		int64_t length, const char *content_type) {
+	// mmap() wants a page aligned offset.
+	off_t map_offset = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	size_t map_length = (size_t)(offset - map_offset + length);
+	void *map = NULL;
+
+	rest_request_clear_body(self);
+	if(length < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(length > 0) {
+		map = mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fd, map_offset);
+		if(map == MAP_FAILED) {
+			return -1;
+		}
+		madvise(map, map_length, MADV_SEQUENTIAL);
+	}
+
+	self->request_body = &self->body_storage;
+	self->request_body->map = map;
+	self->request_body->map_length = map_length;
+	self->request_body->body = map ? (char*)map + (offset - map_offset) : "";
+	self->request_body->data_size = length;
+	self->request_body->content_type = content_type;
+	return 0;
+}
+
+void RestRequest_set_fd_body(RestRequest *self, int fd, off_t offset,
+		int64_t length, const char *content_type) {
+	rest_request_clear_body(self);
+	self->request_body = &self->body_storage;
+
+	self->request_body->use_fd = 1;
+	self->request_body->body_fd = fd;
+	self->request_body->fd_offset = offset;
+	self->request_body->data_size = length;
+	self->request_body->content_type = content_type;
+}
+
+void RestRequest_set_iov_body(RestRequest *self, const struct iovec *iov,
+		int iovcnt, const char *content_type) {
+	int i;
+
+	rest_request_clear_body(self);
+	self->request_body = &self->body_storage;
+
+	self->request_body->iov = iov;
+	self->request_body->iovcnt = iovcnt;
+	for(i=0; i<iovcnt; i++) {
+		self->request_body->data_size += iov[i].iov_len;
+	}
+	self->request_body->content_type = content_type;
+}
+
 void RestRequest_add_header(RestRequest *self, const char *header) {
-	// We strdup the header so we can free it in the destructor.
-	self->headers[self->header_count++] = strdup(header);
+	size_t size;
+	int i;
+
+	if(self->header_count >= MAX_HEADERS) {
+		fprintf(stderr, "MAX_HEADERS reached adding request header.\n");
+		return;
+	}
+	// We copy the header so we can free it in the destructor.  Buffers left
+	// by RestRequest_reset() are reused.
+	i = self->header_count;
+	size = strlen(header) + 1;
+	if(size > self->header_capacity[i]) {
+		uint32_t capacity = REST_REQUEST_HEADER_SIZE;
+
+		while(capacity < size) {
+			capacity *= 2;
+		}
+		free(self->header_storage[i]);
+		self->header_storage[i] = malloc(capacity);
+		self->header_capacity[i] = capacity;
+	}
+	memcpy(self->header_storage[i], header, size);
+	self->headers[self->header_count++] = self->header_storage[i];
+	if(self->indexed_header_count == self->header_count - 1) {
+		rest_request_table_insert(self, self->header_count - 1);
+		self->indexed_header_count++;
+	}
 }
 
 const char *RestRequest_strcsw(const char *haystack, const char *needle) {
@@ -775,21 +4351,24 @@ const char *RestRequest_strcasestr(const char *haystack, const char *needle) {
 }
 
 const char *RestRequest_get_header(RestRequest *self, const char *header_name) {
-    int i;
-    const char *header;
-
-    for(i=0; i<self->header_count; i++) {
-        header = RestRequest_strcasestr(self->headers[i], header_name);
-        if(header != NULL && header == self->headers[i]) {
-            // Just to make sure, the next character should be a colon.
-            if(header[strlen(header_name)] != ':') {
-                continue;
-            }
-
-            return self->headers[i];
-        }
-    }
-    return NULL;
+    int i = rest_request_find_header(self, header_name);
+
+    return i < 0 ? NULL : self->headers[i];
+}
+
+int RestRequest_get_header_values(RestRequest *self, const char *header_name,
+		const char **values, int max_values) {
+	int i = rest_request_find_header(self, header_name);
+	int count = 0;
+
+	while(i >= 0) {
+		if(count < max_values) {
+			values[count] = get_header_value(self->headers[i]);
+		}
+		count++;
+		i = self->header_next[i] - 1;
+	}
+	return count;
 }
 
 static const char *get_header_value(const char *header) {
@@ -822,22 +4401,44 @@ const char *RestRequest_get_header_value(RestRequest *self,
     return get_header_value(header);
 }
 
+const char *RestResponse_find_header(RestResponse *self,
+		const char *header_name, size_t name_len, size_t *value_len) {
+	RestHeader *header = rest_response_find_header(self, header_name,
+			name_len);
+
+	if(!header) {
+		return NULL;
+	}
+	if(value_len) {
+		*value_len = header->value_len;
+	}
+	return self->header_block + header->value_off;
+}
+
+int RestResponse_get_header_values(RestResponse *self,
+		const char *header_name, const char **values, int max_values) {
+	RestHeader *header = rest_response_find_header(self, header_name,
+			strlen(header_name));
+	int count = 0;
+
+	while(header) {
+		if(count < max_values) {
+			values[count] = self->header_block + header->value_off;
+		}
+		count++;
+		header = header->next ? &self->header_index[header->next - 1] : NULL;
+	}
+	return count;
+}
+
 const char *RestResponse_get_header(RestResponse *self, const char *header_name) {
-    int i;
-    const char *header;
-
-    for(i=0; i<self->response_header_count; i++) {
-        if((header = RestRequest_strcasestr(self->response_headers[i], header_name)) != NULL &&
-                header == self->response_headers[i]) {
-            // Just to make sure, the next character should be a colon.
-            if(header[strlen(header_name)] != ':') {
-                continue;
-            }
-
-            return self->response_headers[i];
-        }
+    RestHeader *header = rest_response_find_header(self, header_name,
+            strlen(header_name));
+
+    if(!header) {
+        return NULL;
     }
-    return NULL;
+    return self->header_block + header->name_off;
 }
 
 void
@@ -852,18 +4453,13 @@ RestRequest_set_file_filter(RestRequest *self, rest_file_data_filter filter) {
 
 const char *RestResponse_get_header_value(RestResponse *self,
         const char *header_name) {
-    const char *header = RestResponse_get_header(self, header_name);
-
-    if(!header) {
-        return NULL;
-    }
-
-    return get_header_value(header);
+    return RestResponse_find_header(self, header_name, strlen(header_name),
+            NULL);
 }
 
 void
 RestResponse_add_header(RestResponse *self, const char *header) {
-    self->response_headers[self->response_header_count++] = strdup(header);
+    rest_response_add_header_line(self, header, strlen(header));
 }
 
 
@@ -42,6 +42,8 @@
 #ifndef REST_CLIENT_H_
 #define REST_CLIENT_H_
 
+#include <stdint.h>
+#include <sys/uio.h>
 #include <curl/curl.h>
 #ifdef _PTHREADS
 #include <pthread.h>
@@ -51,13 +53,66 @@
 
 /**
  * Compile-time constant for the maximum number of HTTP headers to be passed
- * in a single RestRequest.
+ * in a single RestRequest.  Responses can have any number of headers.
  */
 #define MAX_HEADERS 64
+/**
+ * Number of slots in a RestRequest's header hash table.  Must be a power of
+ * two and at least twice MAX_HEADERS.
+ */
+#define REST_REQUEST_HEADER_TABLE_SIZE 128
 /**
  * Compile-time constant for the maximum size of an error message.
  */
 #define ERROR_MESSAGE_SIZE 255
+/**
+ * Compile-time constant for the maximum number of idle cURL handles a
+ * RestClient keeps for reuse between requests.
+ */
+#define REST_HANDLE_POOL_SIZE 32
+/**
+ * Compile-time constant for the size of each of the two buffers used by
+ * asynchronous file I/O, see RestClient_set_async_file_io().
+ */
+#define REST_FILE_IO_BUFFER_SIZE (1024 * 1024)
+/**
+ * Compile-time constant for the number of threads a client starts for
+ * asynchronous file I/O.  As many pairs of buffers are kept for reuse.
+ */
+#define REST_FILE_IO_THREADS 2
+/**
+ * Compile-time constants for the default part size and number of parts in
+ * flight of RestClient_parallel_download(), and the number of times it
+ * requests each part before giving up.
+ */
+#define REST_DOWNLOAD_PART_SIZE (8 * 1024 * 1024)
+#define REST_DOWNLOAD_PARALLELISM 4
+#define REST_DOWNLOAD_ATTEMPTS 3
+/**
+ * Compile-time constants for the default part size and number of parts in
+ * flight of RestClient_parallel_upload(), and the number of times it sends
+ * each part before giving up.
+ */
+#define REST_UPLOAD_PART_SIZE (8 * 1024 * 1024)
+#define REST_UPLOAD_PARALLELISM 4
+#define REST_UPLOAD_ATTEMPTS 3
+/**
+ * Compile-time constant for the number of times RestFilter_resume() repeats
+ * an interrupted transfer.
+ */
+#define REST_RESUME_ATTEMPTS 5
+/**
+ * Compile-time constant for the number of idle connections a RestClient
+ * keeps open when no connection limit is set.
+ */
+#define REST_DEFAULT_CONNECTION_CACHE 64
+/**
+ * Compile-time constant for the stack size of each request executing on the
+ * asynchronous engine.  Filters run on this stack, so it must be large enough
+ * for the deepest filter chain in use; overflowing it hits a guard page and
+ * crashes.
+ */
+#define REST_TASK_STACK_SIZE (256*1024)
 
 // Some standard HTTP headers
 /** MIME type of the object, e.g. image/jpeg */
@@ -87,9 +142,70 @@ enum http_method {
 	HTTP_PATCH
 };
 
+/**
+ * Priority classes for requests.  When the client's connection limits are
+ * reached, waiting requests are dispatched highest priority first, and in
+ * the order they arrived within a class.
+ */
+enum rest_priority {
+	/** Latency-sensitive requests, e.g. interactive reads */
+	REST_PRIORITY_HIGH,
+	/** The default priority */
+	REST_PRIORITY_NORMAL,
+	/** Bulk work that should only get connections nobody else is waiting for */
+	REST_PRIORITY_LOW
+};
+
+/** Number of request priority classes */
+#define REST_PRIORITY_COUNT 3
+
+/** Return values of a rest_response_sink */
+enum rest_sink_result {
+	/** The data was consumed, continue the transfer */
+	REST_SINK_CONTINUE,
+	/**
+	 * The data was not consumed.  The transfer is paused until
+	 * RestResponse_resume() is called and the same data is then passed to
+	 * the sink again.
+	 */
+	REST_SINK_PAUSE,
+	/** Stop the transfer, which fails with CURLE_WRITE_ERROR */
+	REST_SINK_ABORT
+};
+
+/**
+ * Callback receiving a response body as it arrives, see
+ * RestResponse_use_sink().
+ * @param ctx the context passed to RestResponse_use_sink().
+ * @param data the next chunk of the body.  Only valid during the call.
+ * @param size number of bytes in data.
+ * @return a rest_sink_result.
+ */
+typedef enum rest_sink_result (*rest_response_sink)(void *ctx,
+		const char *data, size_t size);
+
 /** Class name for RestResponse */
 #define CLASS_REST_RESPONSE "RestResponse"
 
+/**
+ * Location of a response header in RestResponse::header_block.  Offsets are
+ * used rather than pointers since the block moves when it grows.
+ */
+typedef struct {
+	/** Offset of the header's name */
+	uint32_t name_off;
+	/** Length of the name */
+	uint32_t name_len;
+	/** Offset of the header's value, past any leading whitespace */
+	uint32_t value_off;
+	/** Length of the value, without trailing whitespace */
+	uint32_t value_len;
+	/** Case-insensitive hash of the name */
+	uint32_t hash;
+	/** One plus the index of the next header with the same name, or zero */
+	uint32_t next;
+} RestHeader;
+
 
 /**
  * This is a standard response from REST operations.  Do not modify this object
@@ -124,15 +240,54 @@ typedef struct {
 	 * Contains a textual error message from libcurl
 	 */
 	char curl_error_message[CURL_ERROR_SIZE];
-	/** Response headers parsed from the HTTP response. */
-	char *response_headers[MAX_HEADERS];
-	/** Number of response headers present in the response_headers array */
+	/**
+	 * Number of new connections libcurl had to open to complete the request.
+	 * Zero means a pooled connection was reused.
+	 */
+	int num_connects;
+	/**
+	 * Raw response headers, stored one after another as "name: value" lines
+	 * each followed by a null.  Only the headers of the final response are
+	 * kept, e.g. not those of a "100 Continue" or a redirect.
+	 */
+	char *header_block;
+	/** Bytes used in header_block */
+	size_t header_block_size;
+	/** Bytes allocated for header_block */
+	size_t header_block_capacity;
+	/**
+	 * Index of the response headers in header_block, in the order they were
+	 * received.  header_block + header_index[i].name_off is the full
+	 * "name: value" line of header i.
+	 */
+	RestHeader *header_index;
+	/** Number of response headers present in the header_index array */
 	int response_header_count;
+	/** Number of entries allocated for header_index */
+	int header_index_capacity;
+	/**
+	 * Open-addressing hash table over the header names.  Each used slot
+	 * holds one plus the index of the first header with a name.
+	 */
+	uint32_t *header_table;
+	/** Number of slots in header_table, a power of two */
+	int header_table_size;
 	/**
 	 * Content type of the response.  On operations that have no response
 	 * body (e.g. DELETE and PUT), this will be NULL.
 	 */
 	char *content_type;
+	/**
+	 * Buffer content_type is copied into, kept by RestResponse_reset() for
+	 * the next response.  If the caller frees content_type (and sets it to
+	 * NULL) or replaces it, the buffer isn't reused.  Internal, do not
+	 * modify.
+	 */
+	char *content_type_storage;
+	/** Allocated size of content_type_storage */
+	size_t content_type_capacity;
+	/** Whether content_type was set to content_type_storage.  Internal. */
+	int content_type_lent;
 	/**
 	 * Bytes in the response.  When writing into memory, this will be the
 	 * actual number of bytes present in the body member.  When writing to a
@@ -143,6 +298,17 @@ typedef struct {
 	 * The buffer containing the response body.
 	 */
 	char *body;
+	/**
+	 * Number of bytes allocated for body, not counting room for the
+	 * terminating null.  Grows geometrically, so it's usually larger than
+	 * content_length.  Unused when the user provides the buffer.
+	 */
+	size_t body_capacity;
+	/**
+	 * Value of the response's Content-Length header, or zero if there was
+	 * none.  Used to allocate the whole body at once.
+	 */
+	int64_t expected_length;
 	/**
 	 * If use_buffer is nonzero, this is the maximum number of bytes that
 	 * can be written into the body buffer.  Used when the user passes in a
@@ -166,6 +332,37 @@ typedef struct {
 	 * operation in case we need to rewind.
 	 */
 	off_t file_body_start_pos;
+	/**
+	 * If nonzero, the response body is written to body_fd with pwrite().
+	 * See RestResponse_use_fd().
+	 */
+	int use_fd;
+	/** File descriptor the body is written to when use_fd is set */
+	int body_fd;
+	/** Offset in body_fd the first byte of the body is written at */
+	off_t fd_offset;
+	/**
+	 * If set, the response body is passed to this function instead of being
+	 * stored.  See RestResponse_use_sink().
+	 */
+	rest_response_sink sink;
+	/** Context passed to sink */
+	void *sink_ctx;
+	/** Whether a sink transfer is paused.  Internal, do not modify. */
+	int sink_state;
+	/** The cURL handle of a sink transfer.  Internal, do not modify. */
+	CURL *sink_curl;
+	/**
+	 * The multi handle running a sink transfer, woken by
+	 * RestResponse_resume().  Internal, do not modify.
+	 */
+	CURLM *sink_multi;
+	/**
+	 * Set while RestFilter_resume() continues a GET: a reply other than
+	 * 206 Partial Content is refused before its body is written.  Internal,
+	 * do not modify.
+	 */
+	int require_partial;
 } RestResponse;
 
 /**
@@ -179,6 +376,17 @@ RestResponse *RestResponse_init(RestResponse *self);
  * @param self the RestResponse object to destroy.
  */
 void RestResponse_destroy(RestResponse *self);
+/**
+ * Clears a RestResponse so it can receive another response.  Unlike
+ * destroying and initializing it again, the memory of the body, headers and
+ * content type is kept, so a response object reused for many requests stops
+ * allocating once it has seen its largest response.  A buffer, file,
+ * descriptor or sink set with RestResponse_use_buffer(),
+ * RestResponse_use_file(), RestResponse_use_fd() or RestResponse_use_sink()
+ * stays in use.
+ * @param self the RestResponse to reset.
+ */
+void RestResponse_reset(RestResponse *self);
 /**
  * Adds an HTTP response header to the object.
  * @param self the RestResponse to modify.
@@ -198,6 +406,33 @@ void RestResponse_add_header(RestResponse *self, const char *header);
  */
 const char *RestResponse_get_header(RestResponse *self, const char *header_name);
 
+/**
+ * Gets the values of all the response's headers with a name, e.g. every
+ * Set-Cookie header, in the order they were received.
+ * @param self the RestResponse to search.
+ * @param header_name the name (case-insensitive) of the header.
+ * @param values receives up to max_values values.  Do not modify them.
+ * @param max_values the size of the values array.
+ * @return the number of headers with the name, which may be more than
+ * max_values.
+ */
+int RestResponse_get_header_values(RestResponse *self,
+		const char *header_name, const char **values, int max_values);
+
+/**
+ * Finds a response header by name without copying or scanning for the end of
+ * the value.
+ * @param self the RestResponse to search.
+ * @param header_name the name (case-insensitive) of the header.  Doesn't need
+ * to be null-terminated.
+ * @param name_len the length of header_name.
+ * @param value_len if not NULL, receives the length of the value.
+ * @return the value of the first header with the name (null-terminated), or
+ * NULL if the response doesn't have one.  Do not modify this value.
+ */
+const char *RestResponse_find_header(RestResponse *self,
+		const char *header_name, size_t name_len, size_t *value_len);
+
 /**
  * Similar to RestResponse_get_header, but returns only the value portion of
  * the header (everything past the first colon).
@@ -230,6 +465,42 @@ void RestResponse_use_buffer(RestResponse *self, char *buffer,
  * @param f the file pointer to use to store the response.
  */
 void RestResponse_use_file(RestResponse *self, FILE *f);
+/**
+ * Configures the RestResponse to write the response body to a file
+ * descriptor at a given offset.  Writes use pwrite(), so the descriptor's
+ * file position isn't used or moved and several responses can fill
+ * different regions of one file at the same time.  When the response has a
+ * Content-Length, the region is preallocated first where the filesystem
+ * supports it, without changing the file size.  content_length is the number
+ * of bytes written.  The descriptor is not closed.
+ * @param self the RestResponse to modify.
+ * @param fd the file descriptor to write to, open for writing.
+ * @param offset the offset to write the first byte of the body at.
+ */
+void RestResponse_use_fd(RestResponse *self, int fd, off_t offset);
+/**
+ * Configures the RestResponse to pass the response body to a callback as it
+ * is received instead of storing it.  Each chunk is handed over straight
+ * from libcurl's buffer without a copy, and content_length counts the bytes
+ * the sink consumed.
+ *
+ * The sink runs on the thread performing the transfer.  It may block, but
+ * a transfer running in an engine (RestClient_submit() or HTTP/2) then
+ * holds up the others; return REST_SINK_PAUSE instead and call
+ * RestResponse_resume() when ready for more data.
+ * @param self the RestResponse to modify.
+ * @param sink the function receiving the body.
+ * @param ctx context passed to sink.
+ */
+void RestResponse_use_sink(RestResponse *self, rest_response_sink sink,
+		void *ctx);
+/**
+ * Resumes a transfer paused by its sink returning REST_SINK_PAUSE.  Can be
+ * called from any thread, including from within the sink.  The transfer
+ * picks up on its next progress callback.
+ * @param self the RestResponse whose transfer to resume.
+ */
+void RestResponse_resume(RestResponse *self);
 
 /**
  * Defines a RestRequestBody that is an optional component to a RestRequest.
@@ -247,6 +518,30 @@ typedef struct {
 	const char *body;
 	/** File pointiner containing the request data (NULL if using body) */
 	FILE *file_body;
+	/** Segments containing the request data (NULL if using body) */
+	const struct iovec *iov;
+	/** Number of segments in iov */
+	int iovcnt;
+	/** Segment the next byte is read from */
+	int iov_index;
+	/** Offset of the next byte in segment iov_index */
+	size_t iov_offset;
+	/**
+	 * Start of the file mapping body points into, or NULL.  Unmapped when
+	 * the body is replaced or the request is reset or destroyed.
+	 */
+	void *map;
+	/** Length of the mapping */
+	size_t map_length;
+	/**
+	 * If nonzero, the body is read from body_fd with pread().  See
+	 * RestRequest_set_fd_body().
+	 */
+	int use_fd;
+	/** File descriptor the body is read from when use_fd is set */
+	int body_fd;
+	/** Offset in body_fd of the first byte of the body */
+	off_t fd_offset;
 	/** Optional pointer to a function to filter a file_body */
 	void *filter;
 } RestRequestBody;
@@ -264,8 +559,13 @@ typedef struct {
 	Object parent;
 	/** The HTTP operation for the request (e.g. GET or PUT) */
 	enum http_method method;
-	/** The URI for the request (e.g. /service/version) */
+	/**
+	 * The URI for the request (e.g. /service/version).  Set it with
+	 * RestRequest_init() or RestRequest_reset().
+	 */
 	char *uri;
+	/** Allocated size of uri */
+	size_t uri_capacity;
 	/**
 	 * If nonzero, the URI is already properly encoded and should not be
 	 * escaped again.
@@ -275,11 +575,40 @@ typedef struct {
 	char *headers[MAX_HEADERS];
 	/** Number of request headers */
 	int header_count;
+	/**
+	 * Hash table over the header names, rebuilt when header_count changes.
+	 * Each used slot holds one plus the index of the first header with a
+	 * name.
+	 */
+	unsigned char header_table[REST_REQUEST_HEADER_TABLE_SIZE];
+	/** One plus the index of the next header with the same name, or zero */
+	unsigned char header_next[MAX_HEADERS];
+	/** Case-insensitive hash of each header's name */
+	uint32_t header_hash[MAX_HEADERS];
+	/** Number of headers in header_table */
+	int indexed_header_count;
+	/**
+	 * Buffers allocated by RestRequest_add_header(), kept across
+	 * RestRequest_reset() and reused for later headers.  A header that was
+	 * replaced in headers[] is freed as before but its buffer isn't reused;
+	 * neither is the buffer of one the caller freed and set to NULL.
+	 */
+	char *header_storage[MAX_HEADERS];
+	/** Allocated size of each header_storage buffer */
+	uint32_t header_capacity[MAX_HEADERS];
 	/**
 	 * Optional body for the request.  Will be NULL for requests that do not
-	 * contain a body (e.g. GET, HEAD, and DELETE requests).
+	 * contain a body (e.g. GET, HEAD, and DELETE requests).  Points to
+	 * body_storage when set.
 	 */
 	RestRequestBody *request_body;
+	/** Storage for request_body, so setting a body doesn't allocate */
+	RestRequestBody body_storage;
+	/**
+	 * Scheduling priority of the request, REST_PRIORITY_NORMAL by default.
+	 * See RestClient_set_connection_limits().
+	 */
+	enum rest_priority priority;
 } RestRequest;
 
 /**
@@ -307,6 +636,19 @@ RestRequest *RestRequest_init(RestRequest *self, const char *uri,
  * @param self the RestRequest to destroy.
  */
 void RestRequest_destroy(RestRequest *self);
+
+/**
+ * Clears a RestRequest for reuse with a new URI and method.  Headers, body
+ * and priority are cleared as if the request had been destroyed and
+ * initialized again, but the URI and header buffers are kept, so a request
+ * object reused in a loop stops allocating once its buffers are big enough.
+ * @param self the RestRequest to reset.
+ * @param uri the URI for the request (e.g. /service/version).
+ * @param method the HTTP method for the request (e.g. GET or PUT).
+ * @return the RestRequest object (same as self).
+ */
+RestRequest *RestRequest_reset(RestRequest *self, const char *uri,
+		enum http_method method);
 /**
  * Sets the RestRequest's body to an in-memory byte array.
  * @param self the RestRequest to configure.
@@ -328,7 +670,55 @@ void RestRequest_set_array_body(RestRequest *self, const char *data,
 void RestRequest_set_file_body(RestRequest *self, FILE *data, int64_t data_size,
 		const char *content_type);
 /**
- * Adds an HTTP header to the request.
+ * Sets the RestRequest's body to a region of a file, read through a memory
+ * mapping instead of stdio.  The data is copied once, from the page cache
+ * into cURL's upload buffer.  A filter set with RestRequest_set_file_filter()
+ * is called on each chunk as with RestRequest_set_file_body().  The mapping
+ * is released when the body is replaced or the request is reset or
+ * destroyed; the file descriptor isn't closed.
+ * @param self the RestRequest to configure.
+ * @param fd the file descriptor to map, open for reading.
+ * @param offset the offset of the body in the file.  Need not be page
+ * aligned.
+ * @param length the number of bytes to send.
+ * @param content_type the content type (MIME type) of the data, e.g.
+ * "text/plain" or "image/jpeg".
+ * @return zero on success or -1 if the file could not be mapped, with errno
+ * set.  The request has no body on failure.
+ */
+int RestRequest_set_mmap_body(RestRequest *self, int fd, off_t offset,
+		int64_t length, const char *content_type);
+/**
+ * Sets the RestRequest's body to a region of a file, read with pread().  The
+ * file position is neither used nor changed, so several requests can read
+ * different regions of one file descriptor at the same time.  A filter set
+ * with RestRequest_set_file_filter() is called on each chunk as with
+ * RestRequest_set_file_body().  The file descriptor isn't closed.
+ * @param self the RestRequest to configure.
+ * @param fd the file descriptor to read, open for reading.
+ * @param offset the offset of the body in the file.
+ * @param length the number of bytes to send.
+ * @param content_type the content type (MIME type) of the data, e.g.
+ * "text/plain" or "image/jpeg".
+ */
+void RestRequest_set_fd_body(RestRequest *self, int fd, off_t offset,
+		int64_t length, const char *content_type);
+/**
+ * Sets the RestRequest's body to the concatenation of several memory
+ * segments, e.g. a header block followed by payload fragments.  The segments
+ * are read in place, so neither they nor the iovec array are copied and both
+ * must remain valid until the request completes.
+ * @param self the RestRequest to configure.
+ * @param iov the segments of the body.
+ * @param iovcnt the number of segments.
+ * @param content_type the content type (MIME type) of the data, e.g.
+ * "text/plain" or "image/jpeg".
+ */
+void RestRequest_set_iov_body(RestRequest *self, const struct iovec *iov,
+		int iovcnt, const char *content_type);
+/**
+ * Adds an HTTP header to the request.  At most MAX_HEADERS headers can be
+ * added.
  * @param self the RestRequest to configure.
  * @param header the HTTP header to add.  The header should be in the format,
  * "name: value", e.g. "Accept: application/json"
@@ -358,9 +748,34 @@ const char *RestRequest_get_header(RestRequest *self, const char *header_name);
 const char *RestRequest_get_header_value(RestRequest *self,
         const char *header_name);
 
+/**
+ * Gets the values of all the request's headers with a name, in the order
+ * they were added.
+ * @param self the RestRequest to search.
+ * @param header_name the name (case-insensitive) of the header.
+ * @param values receives up to max_values values.  Do not modify them.
+ * @param max_values the size of the values array.
+ * @return the number of headers with the name, which may be more than
+ * max_values.
+ */
+int RestRequest_get_header_values(RestRequest *self, const char *header_name,
+		const char **values, int max_values);
+
+/**
+ * Percent-encodes a request URI the way RestFilter_execute_curl_request()
+ * does when uri_encoded is not set: '/' is kept, everything from the first
+ * '?' on is copied verbatim and every other character except the RFC 3986
+ * unreserved ones is escaped as with curl_easy_escape().
+ * @param dest receives the NUL-terminated result.  Must hold at least
+ * 3 * strlen(uri) + 1 bytes.
+ * @param uri the URI to encode.
+ * @return the length of the encoded URI.
+ */
+size_t rest_uri_encode(char *dest, const char *uri);
+
 /**
  * Sets the file filter for a request.  Only valid if the request has a body
- * and that body is reading from a file.
+ * and that body is reading from a file or a mapping.
  * @param self the RestRequest to modify.
  * @param filter the rest_file_data_filter to call when reading data.  Set to
  * NULL to turn off.
@@ -406,7 +821,9 @@ typedef struct {
  * Initializes a RestClient object.
  * @param self pointer to the RestClient.
  * @param host the host name or IP of the REST server.  You can prefix this
- * with http:// or https:// to force SSL on or off.
+ * with http:// or https:// to force SSL on or off; without a prefix, HTTPS is
+ * used if port is 443.  A port given in host (e.g. "http://host:8080") takes
+ * precedence over the port argument.
  * @param port the port of the REST server.  Generally, this is 80 for HTTP or
  * 443 for HTTPS.
  * @return the pointer to the RestClient (same as self)
@@ -434,6 +851,81 @@ void RestClient_destroy(RestClient *self);
 void RestClient_set_proxy(RestClient *self, const char *proxy_host,
 		int proxy_port, const char *proxy_user, const char *proxy_pass);
 
+/**
+ * Limits the number of connections a RestClient will use.  Connections are
+ * shared between all threads using the client.  Requests go through a
+ * scheduler that caps the number of transfers in flight at the lower of the
+ * two limits; once it's reached, further requests wait for a transfer to
+ * finish instead of opening a new connection.  Waiting requests are
+ * dispatched in order of RestRequest::priority, so bulk work can't starve
+ * latency-sensitive requests.  Blocked threads, RestClient_submit() and
+ * RestLoop requests all wait in the same queues.
+ * @param self the RestClient to configure.
+ * @param max_host_connections the maximum number of concurrent connections to
+ * the host.  Use zero for no limit (the default).
+ * @param max_connections the maximum number of connections to keep open,
+ * including idle ones in the connection cache.  Use zero for no limit; up to
+ * REST_DEFAULT_CONNECTION_CACHE idle connections are kept.
+ */
+void RestClient_set_connection_limits(RestClient *self,
+		int max_host_connections, int max_connections);
+
+/**
+ * Statistics of one priority class of the request scheduler.  See
+ * RestClient_get_scheduler_stats().
+ */
+typedef struct {
+	/** Number of requests currently waiting for a connection */
+	int queue_depth;
+	/** Number of requests currently transferring */
+	int active;
+	/** Number of requests dispatched so far */
+	int64_t dispatched;
+	/**
+	 * Total time dispatched requests spent waiting, in microseconds.
+	 * Divide by dispatched for the average wait.
+	 */
+	int64_t total_wait_usec;
+	/** Longest time a request spent waiting, in microseconds */
+	int64_t max_wait_usec;
+} RestSchedulerStats;
+
+/**
+ * Gets the scheduler statistics for a priority class.  Requests only wait
+ * when connection limits are set (see RestClient_set_connection_limits()).
+ * @param self the RestClient.
+ * @param priority the priority class.
+ * @param stats receives the statistics.
+ */
+void RestClient_get_scheduler_stats(RestClient *self,
+		enum rest_priority priority, RestSchedulerStats *stats);
+
+/**
+ * Enables or disables HTTP/2.  When enabled, HTTP/2 is negotiated with ALPN
+ * for https:// hosts, and assumed (prior knowledge) for http:// hosts, so
+ * only enable it for servers known to support HTTP/2.  Requests executed
+ * concurrently by multiple threads are multiplexed over a few connections
+ * by the client's engine threads (see RestClient_set_engine_threads()).
+ * Must be called before executing any requests.
+ * @param self the RestClient to configure.
+ * @param enabled nonzero to use HTTP/2, zero for HTTP/1.1 (the default).
+ */
+void RestClient_set_http2(RestClient *self, int enabled);
+
+/**
+ * Enables or disables sharing cookies between requests.  Cookies are shared
+ * by default; applications that don't use cookies can turn this off to avoid
+ * the locking overhead.  Cookies are only used if a curl config handler
+ * enables libcurl's cookie engine, e.g. by setting CURLOPT_COOKIEJAR.
+ * Turning sharing off discards the shared cookies.
+ * Can be called between requests, but not while requests are executing.
+ * @param self the RestClient to configure.
+ * @param share nonzero to share cookies, zero to disable.
+ * @return zero on success or -1 if the setting couldn't be changed, e.g.
+ * because requests are executing.
+ */
+int RestClient_set_cookie_sharing(RestClient *self, int share);
+
 /**
  * Handler callback to perform some sort of configuration on a cURL handle before
  * it's executed (e.g. set custom headers, verbose logging, etc).  Note that a
@@ -446,15 +938,96 @@ void RestClient_set_proxy(RestClient *self, const char *proxy_host,
 typedef int (*rest_curl_config_handler)(RestClient *rest, CURL *handle);
 
 
+/** Internal asynchronous engine, see RestClient_submit() */
+struct RestEngineTag;
+/** Worker pool, see rest_executor.h */
+struct RestExecutorTag;
+/** Request waiting for the scheduler */
+struct RestWaiterTag;
+
+/**
+ * A pooled cURL easy handle and the buffer its request URLs are built in.
+ */
+typedef struct {
+	/** The cURL easy handle */
+	CURL *curl;
+	/** URL of the handle's current request */
+	char *url;
+	/** Allocated size of url */
+	size_t url_capacity;
+	/** Multi handle for transfers that must be woken, created on demand */
+	CURLM *multi;
+} RestHandle;
+
 /**
  * Internal private state for RestClient.
  */
 typedef struct {
 	/** Shared-state information for CURL */
 	CURLSH *curl_shared;
+	/**
+	 * The scheme, host and port every request URI is appended to, e.g.
+	 * http://host:8080.  Built once from the client's host and port.
+	 */
+	char *url_prefix;
+	/** Length of url_prefix */
+	size_t url_prefix_len;
+#ifdef _PTHREADS
+	/**
+	 * Locks used by CURL for accessing the shared-state object, one per
+	 * kind of shared data so e.g. DNS lookups don't wait on the connection
+	 * cache.  Shared access takes the read side of the lock.
+	 */
+	pthread_rwlock_t curl_lock[CURL_LOCK_DATA_LAST];
+#endif
+	/**
+	 * Idle cURL easy handles available for reuse.  A NULL slot is empty.
+	 * Slots are claimed and released with atomic exchanges so checking out
+	 * a handle never blocks.  Reused handles keep their connection cache
+	 * and SSL state between requests.
+	 */
+	RestHandle *handle_pool[REST_HANDLE_POOL_SIZE];
+	/**
+	 * Maximum number of concurrent connections to the host, or zero for no
+	 * limit.
+	 */
+	int max_host_connections;
+	/**
+	 * Maximum number of connections the client keeps open, or zero for no
+	 * limit.
+	 */
+	int max_connections;
+	/** Nonzero to use HTTP/2, see RestClient_set_http2() */
+	int http2;
+	/** Number of transfers dispatched by the scheduler and not finished */
+	int active_requests;
+	/** Requests waiting for the scheduler, one FIFO per priority class */
+	struct RestWaiterTag *waiting[REST_PRIORITY_COUNT];
+	struct RestWaiterTag *waiting_tail[REST_PRIORITY_COUNT];
+	/** Scheduler statistics per priority class */
+	RestSchedulerStats scheduler_stats[REST_PRIORITY_COUNT];
 #ifdef _PTHREADS
-	/** Mutex used by CURL for accessing the shared-state object */
-	pthread_mutex_t curl_lock;
+	/** Protects the scheduler state */
+	pthread_mutex_t scheduler_lock;
+	/**
+	 * Engines executing requests passed to RestClient_submit().  Started on
+	 * the first submit.
+	 */
+	struct RestEngineTag **engines;
+	/** Number of engine threads to start */
+	int engine_count;
+	/** Round-robin counter used to pick an engine */
+	unsigned int next_engine;
+	/** Protects engines and executor while they're started */
+	pthread_mutex_t engine_lock;
+	/** The client's worker pool, see RestClient_get_executor() */
+	struct RestExecutorTag *executor;
+	/** Number of executor workers to start, or zero for one per CPU */
+	int executor_threads;
+	/** Nonzero to use asynchronous file I/O, see RestClient_set_async_file_io() */
+	int async_file_io;
+	/** Threads moving file data for async_file_io, started on first use */
+	struct RestFileIOPoolTag *file_io;
 #endif
 	/**
 	 * Array of functions implementing rest_curl_config_handler to configure
@@ -541,6 +1114,319 @@ typedef void (*rest_http_filter)(RestFilter *self, RestClient *rest,
 void RestClient_execute_request(RestClient *self, RestFilter *filters,
 		RestRequest *request, RestResponse *response);
 
+/**
+ * Callback invoked when a request submitted with RestClient_submit() has
+ * completed, i.e. after the whole filter chain has returned.  It's called on
+ * an engine thread, so it should not block.
+ * @param rest the RestClient that executed the request.
+ * @param request the request that completed.
+ * @param response the response to the request.  Check curl_error and
+ * http_code as you would after RestClient_execute_request().
+ * @param ctx the context pointer passed to RestClient_submit().
+ */
+typedef void (*rest_request_complete)(RestClient *rest, RestRequest *request,
+		RestResponse *response, void *ctx);
+
+#ifdef _PTHREADS
+/**
+ * Sets the number of engine threads used to execute requests passed to
+ * RestClient_submit().  The default is one, which is enough to keep thousands
+ * of requests in flight.  Must be called before the first submit.
+ * @param self the RestClient to configure.
+ * @param threads the number of engine threads.
+ */
+void RestClient_set_engine_threads(RestClient *self, int threads);
+
+/**
+ * Executes a REST request asynchronously.  The request is handed to one of
+ * the client's engine threads, which multiplexes all in-flight requests with
+ * curl_multi.  The filter chain runs just like it does for
+ * RestClient_execute_request(): each filter sees the request on the way down
+ * and the response on the way back up, but the filters run on the engine
+ * thread.  The request and response must stay valid until on_complete is
+ * called.  All submitted requests must complete before the client is
+ * destroyed.  On platforms without makecontext() and swapcontext(), the
+ * engine runs each filter chain to completion before starting the next, so
+ * requests execute one at a time.
+ * @param self the RestClient used to execute the request.
+ * @param filters the linked list of RestFilter objects to filter the request
+ * and the response.
+ * @param request the request to execute.
+ * @param response the object to capture the response.
+ * @param on_complete the function to call when the request completes.  May be
+ * NULL.
+ * @param ctx a context pointer passed to on_complete.
+ */
+void RestClient_submit(RestClient *self, RestFilter *filters,
+		RestRequest *request, RestResponse *response,
+		rest_request_complete on_complete, void *ctx);
+
+/**
+ * Sets the number of worker threads of the client's executor.  Must be called
+ * before the first call to RestClient_get_executor().
+ * @param self the RestClient to configure.
+ * @param threads the number of workers, or zero (the default) for one per
+ * online CPU.
+ */
+void RestClient_set_executor_threads(RestClient *self, int threads);
+
+/**
+ * Returns the client's executor, starting it on first use.  Use the executor
+ * to run blocking requests and CPU-heavy filters on a shared pool of worker
+ * threads (see rest_executor.h).  The executor is owned by the client and is
+ * destroyed with it, after its submitted requests have completed.
+ * @param self the RestClient.
+ * @return the client's executor.
+ */
+struct RestExecutorTag *RestClient_get_executor(RestClient *self);
+
+/**
+ * Turns asynchronous file I/O on or off for request bodies set with
+ * RestRequest_set_file_body() and responses written with
+ * RestResponse_use_file().  When on, a pool of REST_FILE_IO_THREADS threads
+ * owned by the client reads the file ahead of the upload or writes the
+ * download behind it through a pair of buffers, so a slow disk and the
+ * network overlap instead of stalling each other.  Each transfer in flight
+ * holds two REST_FILE_IO_BUFFER_SIZE buffers, which are kept for the next
+ * transfer once it finishes.  Worth it for large bodies on slow or networked
+ * disks.  Off by default.  Requests executed by an engine thread
+ * (RestClient_submit(), or HTTP/2 requests) don't use it, since waiting for
+ * the pool would block the engine's other transfers.
+ * @param self the RestClient to configure.
+ * @param enabled nonzero to turn asynchronous file I/O on.
+ */
+void RestClient_set_async_file_io(RestClient *self, int enabled);
+#endif
+
+/**
+ * Executes a batch of independent requests concurrently and returns when all
+ * of them have completed.  The requests are multiplexed over the client's
+ * shared connections by the calling thread; no additional threads are used.
+ * Each response is filled exactly as RestClient_execute_request() would fill
+ * it.
+ * @param self the RestClient used to execute the requests.
+ * @param filters the linked list of RestFilter objects to filter each request
+ * and response.
+ * @param requests the requests to execute.
+ * @param responses the objects to capture the responses.  responses[i]
+ * receives the response to requests[i].
+ * @param count the number of requests.
+ * @param max_parallel the maximum number of requests in flight at once.  Use
+ * zero to start all of them at once.
+ */
+void RestClient_execute_batch(RestClient *self, RestFilter *filters,
+		RestRequest **requests, RestResponse **responses, int count,
+		int max_parallel);
+
+/**
+ * Downloads an object with concurrent Range requests, writing each part at
+ * its offset in a file.  The first part is fetched on its own to learn the
+ * size of the object; the rest are multiplexed over the client's shared
+ * connections by the calling thread, like RestClient_execute_batch().  A
+ * part that fails with a transport or server (5xx) error is requested again,
+ * up to REST_DOWNLOAD_ATTEMPTS times.  If the object has a strong ETag, the
+ * later parts are sent with If-Match so a changed object fails the download
+ * instead of corrupting the file.
+ * @param self the RestClient used to execute the requests.
+ * @param filters the linked list of RestFilter objects to filter each part's
+ * request and response.
+ * @param uri the URI of the object.
+ * @param fd the file descriptor to write the object to, starting at offset
+ * zero.  It's truncated to the size of the object.  The file position is not
+ * used or changed.
+ * @param part_size the number of bytes requested at once.  Use zero for
+ * REST_DOWNLOAD_PART_SIZE.
+ * @param parallelism the maximum number of parts in flight at once.  Use zero
+ * for REST_DOWNLOAD_PARALLELISM.
+ * @param response receives the outcome.  On success, it holds the headers of
+ * the first part and content_length is the size of the object.  On failure,
+ * http_code, curl_error and curl_error_message describe the part that
+ * failed; a server that ignores the Range header or sends the wrong number
+ * of bytes is reported as a cURL error.  The body of the first part goes to
+ * fd; where the response put its body before the call (see
+ * RestResponse_use_buffer(), RestResponse_use_file(), RestResponse_use_fd()
+ * and RestResponse_use_sink()) is restored before returning.
+ */
+void RestClient_parallel_download(RestClient *self, RestFilter *filters,
+		const char *uri, int fd, int64_t part_size, int parallelism,
+		RestResponse *response);
+
+/**
+ * Callback reporting the progress of a RestClient_parallel_upload() call.
+ * @param ctx the context passed to RestClient_parallel_upload().
+ * @param sent the number of bytes sent so far, summed over all parts.  It
+ * goes back when a part is sent again.
+ * @param total the size of the upload.
+ */
+typedef void (*rest_upload_progress)(void *ctx, int64_t sent, int64_t total);
+
+/**
+ * Uploads a file as concurrent PUT requests of byte ranges, for object
+ * stores that accept ranged writes.  Each part carries a
+ * "Content-Range: bytes first-last/total" header and is read from the file
+ * with pread(), see RestRequest_set_fd_body().  Parts are multiplexed over
+ * the client's shared connections by the calling thread, like
+ * RestClient_execute_batch().  A part that fails with a transport or server
+ * (5xx) error is sent again, up to REST_UPLOAD_ATTEMPTS times.  A filter in
+ * the chain can rename or rewrite the Content-Range header for stores that
+ * expect something else.
+ * @param self the RestClient used to execute the requests.
+ * @param filters the linked list of RestFilter objects to filter each part's
+ * request and response.  Include RestFilter_set_content_headers to send the
+ * content type.
+ * @param uri the URI of the object.
+ * @param fd the file descriptor to read, starting at offset zero.  The file
+ * position is not used or changed.
+ * @param length the number of bytes to upload.
+ * @param content_type the content type (MIME type) of the data.
+ * @param part_size the number of bytes sent in each request.  Use zero for
+ * REST_UPLOAD_PART_SIZE.
+ * @param parallelism the maximum number of parts in flight at once.  Use zero
+ * for REST_UPLOAD_PARALLELISM.
+ * @param progress if not NULL, called on the calling thread as data is sent.
+ * @param progress_ctx the context passed to progress.
+ * @param response receives the outcome: the http_code and http_status of
+ * the last part to complete or, on failure, the http_code, curl_error and
+ * curl_error_message of the part that failed.
+ */
+void RestClient_parallel_upload(RestClient *self, RestFilter *filters,
+		const char *uri, int fd, int64_t length, const char *content_type,
+		int64_t part_size, int parallelism, rest_upload_progress progress,
+		void *progress_ctx, RestResponse *response);
+
+/**
+ * Opens connections to the host ahead of time.  Sends a HEAD request for "/"
+ * on each of up to connections connections at once, which resolves the host,
+ * performs the TCP and TLS handshakes and fills the client's DNS and SSL
+ * session caches.  The connections are left open in the client's shared
+ * pool, so the first requests don't pay for the handshakes.  Idle
+ * connections already in the pool count towards the number.
+ * @param self the RestClient to warm up.
+ * @param connections the number of connections to open.  Limited to the size
+ * of the connection cache (see RestClient_set_connection_limits()).
+ * @param timeout_ms the maximum time to spend, in milliseconds.  Use zero for
+ * no limit beyond the connect timeout.
+ * @return the number of distinct connections the requests completed on.
+ * Requests that reuse the same idle connection, or that HTTP/2 multiplexes
+ * over one connection, count once, so this can be less than connections.
+ */
+int RestClient_warmup(RestClient *self, int connections, int timeout_ms);
+
+/** Class name for RestLoop */
+#define CLASS_REST_LOOP "RestLoop"
+
+struct RestLoopTag;
+
+/**
+ * Callback telling the application which events to watch for on a socket.
+ * @param loop the RestLoop that owns the socket.
+ * @param fd the socket.
+ * @param what CURL_POLL_IN, CURL_POLL_OUT or CURL_POLL_INOUT to watch the
+ * socket for reading and/or writing, or CURL_POLL_REMOVE to stop watching it.
+ * @param userdata the userdata pointer passed to RestLoop_init().
+ */
+typedef void (*rest_loop_socket_callback)(struct RestLoopTag *loop, int fd,
+		int what, void *userdata);
+
+/**
+ * Callback telling the application when to call RestLoop_timeout().  Replaces
+ * any previously requested timeout.
+ * @param loop the RestLoop requesting the timeout.
+ * @param timeout_ms milliseconds until RestLoop_timeout() should be called.
+ * Zero means as soon as possible (but not from within this callback) and -1
+ * cancels the timeout.
+ * @param userdata the userdata pointer passed to RestLoop_init().
+ */
+typedef void (*rest_loop_timer_callback)(struct RestLoopTag *loop,
+		long timeout_ms, void *userdata);
+
+/**
+ * Executes requests from an application's own event loop (e.g. epoll) instead
+ * of from library threads.  The RestLoop reports the sockets and timeout it
+ * needs watched through callbacks, and the application calls
+ * RestLoop_socket_action() and RestLoop_timeout() when they fire.  Filter
+ * chains and responses work exactly as with RestClient_execute_request();
+ * filters and completion callbacks run on the thread driving the loop.  A
+ * RestLoop is not thread-safe; use it only from the loop's thread.  The
+ * callbacks are only invoked on that thread too: when another thread frees
+ * a connection slot a queued request was waiting for, the loop is woken
+ * through a pipe it watches like any other socket.
+ */
+typedef struct RestLoopTag {
+	/** Parent class's fields */
+	Object parent;
+	/** The client used to execute the requests */
+	RestClient *client;
+	/** Called to watch or unwatch a socket */
+	rest_loop_socket_callback socket_callback;
+	/** Called to set the timeout */
+	rest_loop_timer_callback timer_callback;
+	/** Passed to the callbacks */
+	void *userdata;
+	/** Internal data, do not modify */
+	void *internal;
+} RestLoop;
+
+/**
+ * Initializes a RestLoop.
+ * @param self the RestLoop to initialize.
+ * @param client the client used to execute requests.  Its connections are
+ * shared with the loop.
+ * @param socket_callback called when a socket needs to be watched.
+ * @param timer_callback called when the timeout changes.
+ * @param userdata passed to the callbacks.  The socket callback is invoked
+ * before this returns, to watch the loop's wakeup pipe for reading.
+ * @return the RestLoop (same as self).
+ */
+RestLoop *RestLoop_init(RestLoop *self, RestClient *client,
+		rest_loop_socket_callback socket_callback,
+		rest_loop_timer_callback timer_callback, void *userdata);
+
+/**
+ * Destroys a RestLoop.  All submitted requests must have completed.
+ * @param self the RestLoop to destroy.
+ */
+void RestLoop_destroy(RestLoop *self);
+
+/**
+ * Submits a request to the loop.  The request starts on the next call to
+ * RestLoop_socket_action() or RestLoop_timeout(); the timer callback is
+ * invoked with a zero timeout to prompt that.
+ * @param self the RestLoop executing the request.
+ * @param filters the linked list of RestFilter objects to filter the request
+ * and the response.
+ * @param request the request to execute.
+ * @param response the object to capture the response.
+ * @param on_complete the function to call when the request completes.  May be
+ * NULL.
+ * @param ctx a context pointer passed to on_complete.
+ */
+void RestLoop_submit(RestLoop *self, RestFilter *filters,
+		RestRequest *request, RestResponse *response,
+		rest_request_complete on_complete, void *ctx);
+
+/**
+ * Call when a socket reported through the socket callback is ready.
+ * @param self the RestLoop owning the socket.
+ * @param fd the socket.
+ * @param events CURL_CSELECT_IN, CURL_CSELECT_OUT and/or CURL_CSELECT_ERR,
+ * or zero to let the loop find out.
+ */
+void RestLoop_socket_action(RestLoop *self, int fd, int events);
+
+/**
+ * Call when the timeout requested through the timer callback expires.
+ * @param self the RestLoop.
+ */
+void RestLoop_timeout(RestLoop *self);
+
+/**
+ * Returns the number of requests submitted to the loop that have not yet
+ * completed.
+ * @param self the RestLoop.
+ */
+int RestLoop_get_request_count(RestLoop *self);
+
 /**
  * Adds a curl config handler to the client.  Handlers are executed in the order
  * they are added.
@@ -579,6 +1465,40 @@ void RestFilter_free(RestFilter *chain);
 void RestFilter_set_content_headers(RestFilter *self, RestClient *rest,
 		RestRequest *request, RestResponse *response);
 
+/**
+ * This RestFilter function continues interrupted transfers from where they
+ * stopped instead of starting over.  When a GET or PUT fails partway with a
+ * transport error (e.g. the connection drops), the missing part is requested
+ * again, up to REST_RESUME_ATTEMPTS times:
+ *  - a GET is repeated with a Range header starting past the bytes already
+ *    received, which are kept in the response's destination (memory, file,
+ *    file descriptor or sink).  The offset comes from the Content-Range of
+ *    a 206 reply, so suffix ranges work; multipart replies aren't resumed.
+ *    A repeat answered with anything but 206 is cut off before its body is
+ *    written; a 2xx reply then fails with CURLE_RANGE_ERROR.
+ *  - a PUT is preceded by a HEAD request whose Content-Length tells how much
+ *    of the body the server stored, and the rest of the body is sent with a
+ *    Content-Range header.  This needs a server that accepts ranged writes
+ *    and keeps partial uploads.  Bodies set with RestRequest_set_iov_body()
+ *    and requests that already have a Content-Range are not resumed.
+ *
+ * Each repeat carries If-Match with the object's strong ETag or, failing
+ * that, If-Unmodified-Since with its Last-Modified date, so nothing is added
+ * to an object that changed in between; the server answers 412 instead.
+ * Transfers without a validator are not resumed.  A resumed GET reports the
+ * status code of the original request, while its headers are those of the
+ * last repeat.  Add this filter to the chain after the filters that set up
+ * the request (so it runs before them): a repeat copies the request's
+ * headers as they were when it reached this filter and passes the copy
+ * through the rest of the chain.
+ * @param self the RestFilter that's executing.
+ * @param rest the RestClient processing the request.
+ * @param request the REST request object.
+ * @param response the object receiving the REST response.
+ */
+void RestFilter_resume(RestFilter *self, RestClient *rest,
+		RestRequest *request, RestResponse *response);
+
 /**
  * This is usually the last filter in the chain and executes the HTTP request
  * using cURL.
@@ -0,0 +1,426 @@
+/*
+
+ Copyright (c) 2012, EMC Corporation
+
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+ * Neither the name of the EMC Corporation nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "rest_executor.h"
+
+#ifdef _PTHREADS
+
+#define REST_DEQUE_INITIAL_SIZE 64
+
+/**
+ * A request queued on a worker.
+ */
+typedef struct {
+	RestFilter *filters;
+	RestRequest *request;
+	RestResponse *response;
+	RestFuture *future;
+	rest_request_complete on_complete;
+	void *ctx;
+} RestJob;
+
+typedef struct RestWorkerTag {
+	struct RestExecutorPrivateTag *executor;
+	/** Index of this worker in the executor's array */
+	int index;
+	pthread_t thread;
+	/**
+	 * Ring buffer of queued jobs.  The owning worker pushes and pops at the
+	 * tail (newest first, while its data is still in cache); thieves take
+	 * from the head (oldest first).
+	 */
+	RestJob **jobs;
+	int capacity;
+	int head;
+	int count;
+	/** Protects the ring buffer */
+	pthread_mutex_t lock;
+} RestWorker;
+
+typedef struct RestExecutorPrivateTag {
+	RestExecutor *self;
+	RestWorker *workers;
+	int worker_count;
+	/** Jobs queued but not yet taken by a worker */
+	int pending;
+	/** Round-robin counter for jobs submitted from outside the workers */
+	unsigned int next_worker;
+	/** Protects idle and stop */
+	pthread_mutex_t lock;
+	/** Signalled when a job is queued while workers are idle */
+	pthread_cond_t work_available;
+	/** Number of workers waiting on work_available */
+	int idle;
+	/** Nonzero when the workers should exit once all jobs are done */
+	int stop;
+} RestExecutorPrivate;
+
+/** The worker running on this thread, if any. */
+static __thread RestWorker *rest_current_worker = NULL;
+
+RestFuture *RestFuture_init(RestFuture *self) {
+	Object_init_with_class_name((Object*)self, CLASS_REST_FUTURE);
+	OBJECT_ZERO(self, RestFuture, Object);
+
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->completed, NULL);
+
+	return self;
+}
+
+void RestFuture_destroy(RestFuture *self) {
+	pthread_mutex_destroy(&self->lock);
+	pthread_cond_destroy(&self->completed);
+	OBJECT_ZERO(self, RestFuture, Object);
+	Object_destroy((Object*)self);
+}
+
+int RestFuture_is_done(RestFuture *self) {
+	int done;
+
+	pthread_mutex_lock(&self->lock);
+	done = self->done;
+	pthread_mutex_unlock(&self->lock);
+
+	return done;
+}
+
+static void rest_future_complete(RestFuture *future) {
+	// The waiter may destroy the future as soon as it sees done, so it's
+	// only set and signalled while holding the lock.
+	pthread_mutex_lock(&future->lock);
+	future->done = 1;
+	pthread_cond_broadcast(&future->completed);
+	pthread_mutex_unlock(&future->lock);
+}
+
+static void rest_worker_push(RestWorker *worker, RestJob *job) {
+	pthread_mutex_lock(&worker->lock);
+	if(worker->count == worker->capacity) {
+		int capacity = worker->capacity ? worker->capacity * 2
+				: REST_DEQUE_INITIAL_SIZE;
+		RestJob **jobs = malloc(capacity * sizeof(RestJob*));
+		int i;
+
+		for(i=0; i<worker->count; i++) {
+			jobs[i] = worker->jobs[(worker->head + i) % worker->capacity];
+		}
+		free(worker->jobs);
+		worker->jobs = jobs;
+		worker->capacity = capacity;
+		worker->head = 0;
+	}
+	worker->jobs[(worker->head + worker->count) % worker->capacity] = job;
+	worker->count++;
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/**
+ * Takes the newest job from the worker's own queue.
+ */
+static RestJob *rest_worker_pop(RestWorker *worker) {
+	RestJob *job = NULL;
+
+	pthread_mutex_lock(&worker->lock);
+	if(worker->count > 0) {
+		worker->count--;
+		job = worker->jobs[(worker->head + worker->count) % worker->capacity];
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return job;
+}
+
+/**
+ * Takes the oldest job from another worker's queue.
+ */
+static RestJob *rest_worker_steal(RestWorker *victim) {
+	RestJob *job = NULL;
+
+	// Don't wait behind the owner or another thief.
+	if(pthread_mutex_trylock(&victim->lock)) {
+		return NULL;
+	}
+	if(victim->count > 0) {
+		job = victim->jobs[victim->head];
+		victim->head = (victim->head + 1) % victim->capacity;
+		victim->count--;
+	}
+	pthread_mutex_unlock(&victim->lock);
+
+	return job;
+}
+
+/**
+ * Finds a job for the worker, from its own queue or by stealing.
+ */
+static RestJob *rest_worker_find_job(RestWorker *worker) {
+	RestExecutorPrivate *priv = worker->executor;
+	RestJob *job;
+	int i;
+
+	if(__atomic_load_n(&priv->pending, __ATOMIC_ACQUIRE) <= 0) {
+		return NULL;
+	}
+
+	job = rest_worker_pop(worker);
+	for(i=1; !job && i<priv->worker_count; i++) {
+		job = rest_worker_steal(
+				&priv->workers[(worker->index + i) % priv->worker_count]);
+	}
+	if(job) {
+		__atomic_fetch_sub(&priv->pending, 1, __ATOMIC_RELAXED);
+	}
+
+	return job;
+}
+
+static void rest_job_run(RestExecutorPrivate *priv, RestJob *job) {
+	RestClient *client = priv->self->client;
+
+	RestClient_execute_request(client, job->filters, job->request,
+			job->response);
+	if(job->on_complete) {
+		job->on_complete(client, job->request, job->response, job->ctx);
+	}
+	if(job->future) {
+		rest_future_complete(job->future);
+	}
+	free(job);
+}
+
+static void *rest_worker_main(void *arg) {
+	RestWorker *worker = arg;
+	RestExecutorPrivate *priv = worker->executor;
+	RestJob *job;
+	int stop;
+
+	rest_current_worker = worker;
+	for(;;) {
+		if((job = rest_worker_find_job(worker))) {
+			rest_job_run(priv, job);
+			continue;
+		}
+
+		pthread_mutex_lock(&priv->lock);
+		while(__atomic_load_n(&priv->pending, __ATOMIC_ACQUIRE) <= 0
+				&& !priv->stop) {
+			priv->idle++;
+			pthread_cond_wait(&priv->work_available, &priv->lock);
+			priv->idle--;
+		}
+		stop = priv->stop
+				&& __atomic_load_n(&priv->pending, __ATOMIC_ACQUIRE) <= 0;
+		pthread_mutex_unlock(&priv->lock);
+
+		if(stop) {
+			break;
+		}
+	}
+	rest_current_worker = NULL;
+
+	return NULL;
+}
+
+RestResponse *RestFuture_wait(RestFuture *self) {
+	RestWorker *worker = rest_current_worker;
+	RestJob *job;
+
+	while(!RestFuture_is_done(self)) {
+		// Keep a worker busy rather than tying it up while it waits.
+		if(worker && (job = rest_worker_find_job(worker))) {
+			rest_job_run(worker->executor, job);
+			continue;
+		}
+
+		pthread_mutex_lock(&self->lock);
+		if(!self->done) {
+			if(worker) {
+				// Wake up now and then to look for new work.
+				struct timespec deadline;
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				deadline.tv_nsec += 1000000;
+				if(deadline.tv_nsec >= 1000000000) {
+					deadline.tv_sec++;
+					deadline.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&self->completed, &self->lock,
+						&deadline);
+			} else {
+				pthread_cond_wait(&self->completed, &self->lock);
+			}
+		}
+		pthread_mutex_unlock(&self->lock);
+	}
+
+	return self->response;
+}
+
+RestExecutor *RestExecutor_init(RestExecutor *self, RestClient *client,
+		int workers) {
+	RestExecutorPrivate *priv;
+	int i;
+
+	Object_init_with_class_name((Object*)self, CLASS_REST_EXECUTOR);
+	OBJECT_ZERO(self, RestExecutor, Object);
+
+	if(workers < 1) {
+		workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if(workers < 1) {
+			workers = 1;
+		}
+	}
+
+	priv = calloc(1, sizeof(RestExecutorPrivate));
+	priv->self = self;
+	priv->workers = calloc(workers, sizeof(RestWorker));
+	pthread_mutex_init(&priv->lock, NULL);
+	pthread_cond_init(&priv->work_available, NULL);
+	self->client = client;
+	self->internal = priv;
+
+	// Every worker must be set up before any of them can steal from it.
+	for(i=0; i<workers; i++) {
+		priv->workers[i].executor = priv;
+		priv->workers[i].index = i;
+		pthread_mutex_init(&priv->workers[i].lock, NULL);
+	}
+	priv->worker_count = workers;
+	for(i=0; i<workers; i++) {
+		if(pthread_create(&priv->workers[i].thread, NULL, rest_worker_main,
+				&priv->workers[i])) {
+			break;
+		}
+	}
+	if(i < workers) {
+		// Make do with the workers that did start.  None have jobs yet,
+		// so nothing is lost by shrinking the array.
+		pthread_mutex_lock(&priv->lock);
+		priv->worker_count = i;
+		pthread_mutex_unlock(&priv->lock);
+		for(; i<workers; i++) {
+			pthread_mutex_destroy(&priv->workers[i].lock);
+		}
+	}
+	self->worker_count = priv->worker_count;
+
+	return self;
+}
+
+void RestExecutor_destroy(RestExecutor *self) {
+	RestExecutorPrivate *priv = self->internal;
+	int i;
+
+	if(priv) {
+		pthread_mutex_lock(&priv->lock);
+		priv->stop = 1;
+		pthread_cond_broadcast(&priv->work_available);
+		pthread_mutex_unlock(&priv->lock);
+
+		for(i=0; i<priv->worker_count; i++) {
+			pthread_join(priv->workers[i].thread, NULL);
+		}
+		for(i=0; i<priv->worker_count; i++) {
+			pthread_mutex_destroy(&priv->workers[i].lock);
+			free(priv->workers[i].jobs);
+		}
+		free(priv->workers);
+		pthread_mutex_destroy(&priv->lock);
+		pthread_cond_destroy(&priv->work_available);
+		free(priv);
+	}
+
+	OBJECT_ZERO(self, RestExecutor, Object);
+	Object_destroy((Object*)self);
+}
+
+void RestExecutor_submit(RestExecutor *self, RestFilter *filters,
+		RestRequest *request, RestResponse *response, RestFuture *future,
+		rest_request_complete on_complete, void *ctx) {
+	RestExecutorPrivate *priv = self->internal;
+	RestWorker *worker = rest_current_worker;
+	RestJob *job;
+
+	if(!filters) {
+		fprintf(stderr, "RestExecutor_submit called with no filters.");
+		abort();
+	}
+
+	if(future) {
+		future->response = response;
+		future->done = 0;
+	}
+
+	if(priv->worker_count < 1) {
+		response->curl_error = CURLE_FAILED_INIT;
+		sprintf(response->curl_error_message,
+				"Unable to start executor workers");
+		if(on_complete) {
+			on_complete(self->client, request, response, ctx);
+		}
+		if(future) {
+			rest_future_complete(future);
+		}
+		return;
+	}
+
+	job = malloc(sizeof(RestJob));
+	job->filters = filters;
+	job->request = request;
+	job->response = response;
+	job->future = future;
+	job->on_complete = on_complete;
+	job->ctx = ctx;
+
+	// Jobs submitted by a filter stay with its worker unless stolen.
+	if(!worker || worker->executor != priv) {
+		worker = &priv->workers[__atomic_fetch_add(&priv->next_worker, 1,
+				__ATOMIC_RELAXED) % priv->worker_count];
+	}
+	// Counted before it's visible so pending never goes negative.
+	__atomic_fetch_add(&priv->pending, 1, __ATOMIC_RELEASE);
+	rest_worker_push(worker, job);
+
+	pthread_mutex_lock(&priv->lock);
+	if(priv->idle > 0) {
+		pthread_cond_signal(&priv->work_available);
+	}
+	pthread_mutex_unlock(&priv->lock);
+}
+
+#endif /* _PTHREADS */
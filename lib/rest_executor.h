@@ -0,0 +1,161 @@
+/*
+
+ Copyright (c) 2012, EMC Corporation
+
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+ * Neither the name of the EMC Corporation nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file rest_executor.h
+ * @brief This module contains a pool of worker threads for executing
+ * requests and their filter chains in parallel.
+ * @defgroup REST_EXECUTOR_API REST Executor
+ * @brief Work-stealing worker pool for executing REST requests.
+ * @{
+ */
+
+#ifndef REST_EXECUTOR_H_
+#define REST_EXECUTOR_H_
+
+#include "rest_client.h"
+
+#ifdef _PTHREADS
+
+/** Class name for RestExecutor */
+#define CLASS_REST_EXECUTOR "RestExecutor"
+/** Class name for RestFuture */
+#define CLASS_REST_FUTURE "RestFuture"
+
+/**
+ * A handle on the result of a request submitted to a RestExecutor.  Wait on
+ * it with RestFuture_wait() to get the response.  The same RestFuture can be
+ * reused for another request once it is done.
+ */
+typedef struct {
+	/** Parent class's fields */
+	Object parent;
+	/** The response of the request, valid once done is set */
+	RestResponse *response;
+	/** Nonzero once the request and its callback have completed */
+	int done;
+	/** Protects done */
+	pthread_mutex_t lock;
+	/** Signalled when done is set */
+	pthread_cond_t completed;
+} RestFuture;
+
+/**
+ * A fixed set of worker threads that execute requests for a RestClient.
+ * Each worker has its own queue of requests.  Requests submitted from a
+ * worker (e.g. by a filter) go to that worker's queue and idle workers steal
+ * from the others, so filter work like parsing or checksumming responses is
+ * spread over all the workers.
+ */
+typedef struct RestExecutorTag {
+	/** Parent class's fields */
+	Object parent;
+	/** The client executing the requests */
+	RestClient *client;
+	/** Number of worker threads */
+	int worker_count;
+	/** Internal data, do not modify */
+	void *internal;
+} RestExecutor;
+
+/**
+ * Initializes a RestFuture.
+ * @param self the RestFuture to initialize.
+ * @return the RestFuture (same as self).
+ */
+RestFuture *RestFuture_init(RestFuture *self);
+
+/**
+ * Destroys a RestFuture.  Its request must be done.
+ * @param self the RestFuture to destroy.
+ */
+void RestFuture_destroy(RestFuture *self);
+
+/**
+ * Checks whether the request of a RestFuture is done.
+ * @param self the RestFuture to check.
+ * @return nonzero if the request is done.
+ */
+int RestFuture_is_done(RestFuture *self);
+
+/**
+ * Waits for the request of a RestFuture to complete.  When called from one of
+ * the executor's workers, the worker executes other queued requests while it
+ * waits instead of blocking.
+ * @param self the RestFuture to wait on.
+ * @return the response of the request.
+ */
+RestResponse *RestFuture_wait(RestFuture *self);
+
+/**
+ * Initializes a RestExecutor and starts its workers.
+ * @param self the RestExecutor to initialize.
+ * @param client the client used to execute requests.
+ * @param workers the number of worker threads.  Zero or less starts one per
+ * online CPU.
+ * @return the RestExecutor (same as self).
+ */
+RestExecutor *RestExecutor_init(RestExecutor *self, RestClient *client,
+		int workers);
+
+/**
+ * Destroys a RestExecutor.  Waits for all submitted requests to complete
+ * before stopping the workers.
+ * @param self the RestExecutor to destroy.
+ */
+void RestExecutor_destroy(RestExecutor *self);
+
+/**
+ * Submits a request to be executed by one of the executor's workers.  If the
+ * request can't be queued, the error is reported in the response and the
+ * request completes immediately.
+ * @param self the RestExecutor.
+ * @param filters the linked list of RestFilter objects to filter the request
+ * and the response.
+ * @param request the request to execute.
+ * @param response the object to capture the response.
+ * @param future the RestFuture to complete when the request is done.  May be
+ * NULL.
+ * @param on_complete the function to call on the worker when the request
+ * completes.  Called before the future is completed.  May be NULL.
+ * @param ctx a context pointer passed to on_complete.
+ */
+void RestExecutor_submit(RestExecutor *self, RestFilter *filters,
+		RestRequest *request, RestResponse *response, RestFuture *future,
+		rest_request_complete on_complete, void *ctx);
+
+#endif /* _PTHREADS */
+
+/**
+ * @}
+ */
+#endif /* REST_EXECUTOR_H_ */
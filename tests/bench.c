@@ -0,0 +1,465 @@
+/*
+
+ Copyright (c) 2012, EMC Corporation
+
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+ * Neither the name of the EMC Corporation nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Benchmarks for the REST client.  These are built with "make check" but not
+ * run by it; run ./bench_rest without arguments for the list of benchmarks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "rest_client.h"
+#ifdef _PTHREADS
+#include "test_server.h"
+#endif
+
+typedef struct {
+	const char *name;
+	const char *usage;
+	int (*run)(int argc, char **argv);
+} Benchmark;
+
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#ifdef _PTHREADS
+typedef struct {
+	RestClient *client;
+	const char *uri;
+	int64_t size;
+	int requests;
+	int errors;
+	int connects;
+} Http2Worker;
+
+static void *http2_worker(void *arg) {
+	Http2Worker *worker = arg;
+	RestFilter *chain = RestFilter_add(NULL, &RestFilter_execute_curl_request);
+	int i;
+
+	for(i=0; i<worker->requests; i++) {
+		RestRequest req;
+		RestResponse res;
+
+		RestRequest_init(&req, worker->uri, HTTP_GET);
+		RestResponse_init(&res);
+		RestClient_execute_request(worker->client, chain, &req, &res);
+		if(res.curl_error || res.http_code != 200
+				|| res.content_length != worker->size) {
+			worker->errors++;
+		}
+		worker->connects += res.num_connects;
+		RestResponse_destroy(&res);
+		RestRequest_destroy(&req);
+	}
+	RestFilter_free(chain);
+
+	return NULL;
+}
+
+static void http2_run_mode(TestServer *server, const char *uri, int64_t size,
+		int requests, int threads, int http2) {
+	RestClient c;
+	pthread_t *tids = calloc(threads, sizeof(pthread_t));
+	Http2Worker *workers = calloc(threads, sizeof(Http2Worker));
+	int errors = 0, connects = 0;
+	double start, elapsed;
+	int t;
+
+	RestClient_init(&c, server->url, server->port);
+	RestClient_set_http2(&c, http2);
+
+	start = now();
+	for(t=0; t<threads; t++) {
+		workers[t].client = &c;
+		workers[t].uri = uri;
+		workers[t].size = size;
+		workers[t].requests = requests / threads;
+		pthread_create(&tids[t], NULL, http2_worker, &workers[t]);
+	}
+	for(t=0; t<threads; t++) {
+		pthread_join(tids[t], NULL);
+		errors += workers[t].errors;
+		connects += workers[t].connects;
+	}
+	elapsed = now() - start;
+
+	printf("%-9s %8d requests %4d threads %8.3f s %10.0f req/s %5d connections %d errors\n",
+			http2 ? "HTTP/2" : "HTTP/1.1", (requests / threads) * threads,
+			threads, elapsed, (requests / threads) * threads / elapsed,
+			connects, errors);
+
+	RestClient_destroy(&c);
+	free(tids);
+	free(workers);
+}
+
+/**
+ * Compares HTTP/1.1 with HTTP/2 multiplexing for small requests from many
+ * threads against the local test server, which serves both on the same port.
+ * Each request downloads size bytes, 1 KB by default.  Some libcurl releases
+ * (e.g. 7.88.1) fail every stream after the first on an HTTP/2 connection
+ * opened with prior knowledge; those show up as errors.
+ */
+static int bench_http2(int argc, char **argv) {
+	TestServer server;
+	int64_t size = 1024;
+	int requests = 10000, threads = 32;
+	char uri[64];
+
+	if(argc > 0) {
+		size = strtoll(argv[0], NULL, 10);
+	}
+	if(argc > 1) {
+		requests = atoi(argv[1]);
+	}
+	if(argc > 2) {
+		threads = atoi(argv[2]);
+	}
+	if(size < 0 || requests <= 0 || threads <= 0) {
+		return -1;
+	}
+
+	if(test_server_start(&server)) {
+		perror("test_server_start");
+		return 1;
+	}
+	server.h2_body_size = size;
+	snprintf(uri, sizeof(uri), "/data/%lld", (long long)size);
+
+	http2_run_mode(&server, uri, size, requests, threads, 0);
+	http2_run_mode(&server, uri, size, requests, threads, 1);
+
+	test_server_stop(&server);
+
+	return 0;
+}
+
+/**
+ * Downloads bodies of various sizes into memory from the local test server.
+ * With no arguments, runs 1 KB, 1 MB and 100 MB bodies.
+ */
+static int bench_download(int argc, char **argv) {
+	static const int64_t default_sizes[] = { 1024, 1024 * 1024,
+			100 * 1024 * 1024 };
+	TestServer server;
+	RestClient c;
+	RestFilter *chain;
+	int i;
+
+	if(test_server_start(&server)) {
+		perror("test_server_start");
+		return 1;
+	}
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(NULL, &RestFilter_execute_curl_request);
+
+	for(i=0; i < (argc ? argc : 3); i++) {
+		int64_t size = argc ? strtoll(argv[i], NULL, 10) : default_sizes[i];
+		// Move about 1 GB per size, but do at least a few requests.
+		int requests = size < 1024 * 1024 * 1024 / 3 ?
+				(int)(1024 * 1024 * 1024 / size) : 3;
+		char uri[64];
+		double start, elapsed, cpu;
+		clock_t cpu_start;
+		int errors = 0, r;
+
+		if(requests > 20000) {
+			requests = 20000;
+		}
+		snprintf(uri, sizeof(uri), "/data/%lld", (long long)size);
+
+		start = now();
+		cpu_start = clock();
+		for(r=0; r<requests; r++) {
+			RestRequest req;
+			RestResponse res;
+
+			RestRequest_init(&req, uri, HTTP_GET);
+			RestResponse_init(&res);
+			RestClient_execute_request(&c, chain, &req, &res);
+			if(res.curl_error || res.content_length != size) {
+				errors++;
+			}
+			RestResponse_destroy(&res);
+			RestRequest_destroy(&req);
+		}
+		elapsed = now() - start;
+		// Includes the server threads, which do the same work either way.
+		cpu = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+
+		printf("%10lld bytes %6d requests %8.3f s %9.1f MB/s %8.3f s cpu %d errors\n",
+				(long long)size, requests, elapsed,
+				size * (double)requests / elapsed / (1024 * 1024), cpu, errors);
+	}
+
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+
+	return 0;
+}
+
+/**
+ * Uploads a file of each size to the local test server, reading it through
+ * stdio and through a mapping.  With no arguments, runs 1 MB and 100 MB
+ * files.
+ */
+static int bench_upload(int argc, char **argv) {
+	static const int64_t default_sizes[] = { 1024 * 1024, 100 * 1024 * 1024 };
+	static const char *modes[] = { "file", "mmap" };
+	TestServer server;
+	RestClient c;
+	RestFilter *chain;
+	char block[65536];
+	int i, m;
+
+	if(test_server_start(&server)) {
+		perror("test_server_start");
+		return 1;
+	}
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(NULL, &RestFilter_execute_curl_request);
+	chain = RestFilter_add(chain, &RestFilter_set_content_headers);
+	memset(block, 'x', sizeof(block));
+
+	for(i=0; i < (argc ? argc : 2); i++) {
+		int64_t size = argc ? strtoll(argv[i], NULL, 10) : default_sizes[i];
+		int requests = size < 1024 * 1024 * 1024 / 3 ?
+				(int)(1024 * 1024 * 1024 / size) : 3;
+		FILE *f = tmpfile();
+		int64_t written;
+
+		if(requests > 20000) {
+			requests = 20000;
+		}
+		for(written=0; written<size; written+=sizeof(block)) {
+			fwrite(block, 1, size - written < (int64_t)sizeof(block) ?
+					size - written : (int64_t)sizeof(block), f);
+		}
+		fflush(f);
+
+		for(m=0; m<2; m++) {
+			double start, elapsed;
+			int errors = 0, r;
+
+			start = now();
+			for(r=0; r<requests; r++) {
+				RestRequest req;
+				RestResponse res;
+
+				RestRequest_init(&req, "/discard", HTTP_PUT);
+				if(m == 0) {
+					fseeko(f, 0, SEEK_SET);
+					RestRequest_set_file_body(&req, f, size,
+							"application/octet-stream");
+				} else {
+					RestRequest_set_mmap_body(&req, fileno(f), 0, size,
+							"application/octet-stream");
+				}
+				RestResponse_init(&res);
+				RestClient_execute_request(&c, chain, &req, &res);
+				if(res.curl_error || res.http_code != 200) {
+					errors++;
+				}
+				RestResponse_destroy(&res);
+				RestRequest_destroy(&req);
+			}
+			elapsed = now() - start;
+
+			printf("%10lld bytes %s %6d requests %8.3f s %9.1f MB/s %d errors\n",
+					(long long)size, modes[m], requests, elapsed,
+					size * (double)requests / elapsed / (1024 * 1024), errors);
+		}
+		fclose(f);
+	}
+
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+
+	return 0;
+}
+
+/**
+ * Runs the test server until killed, for use as a benchmark backend.
+ */
+static int bench_serve(int argc, char **argv) {
+	TestServer server;
+
+	if(test_server_start(&server)) {
+		perror("test_server_start");
+		return 1;
+	}
+	printf("%d\n", server.port);
+	fflush(stdout);
+	for(;;) {
+		pause();
+	}
+
+	return 0;
+}
+#endif
+
+/**
+ * The per-character encoder rest_uri_encode() replaced, for comparison.
+ */
+static size_t curl_encode_uri(CURL *curl, char *encoded_uri, const char *uri) {
+	size_t i;
+
+	encoded_uri[0] = '\0';
+	for(i=0; i<strlen(uri); i++) {
+		if(uri[i] == '/') {
+			strcat(encoded_uri, "/");
+		} else if(uri[i] == '?') {
+			strcat(encoded_uri, uri+i);
+			break;
+		} else {
+			char *encoded = curl_easy_escape(curl, uri+i, 1);
+			strcat(encoded_uri, encoded);
+			curl_free(encoded);
+		}
+	}
+	return strlen(encoded_uri);
+}
+
+/**
+ * Encodes object-store style URIs of various lengths with the per-character
+ * curl_easy_escape() encoder and with rest_uri_encode().  With no arguments,
+ * runs 32, 256 and 2048 byte URIs.
+ */
+static int bench_uri(int argc, char **argv) {
+	static const int default_lengths[] = { 32, 256, 2048 };
+	static const char key_chars[] = "abcdefghijklmnopqrstuvwxyz0123456789-_./ ";
+	CURL *curl = curl_easy_init();
+	int i;
+
+	for(i=0; i < (argc ? argc : 3); i++) {
+		int length = argc ? atoi(argv[i]) : default_lengths[i];
+		// Encode about 64 MB of URI per encoder.
+		int iterations = length > 0 ? 64 * 1024 * 1024 / length : 0;
+		char *uri, *encoded;
+		double start, old_time, new_time;
+		size_t total = 0;
+		int j;
+
+		if(length <= 0) {
+			return 1;
+		}
+		uri = malloc(length + 1);
+		encoded = malloc(length * 3 + 1);
+		strcpy(uri, "/rest/namespace/");
+		for(j=strlen(uri); j<length; j++) {
+			uri[j] = key_chars[j % (sizeof(key_chars) - 1)];
+		}
+		uri[length] = '\0';
+
+		// The old encoder is too slow for long URIs to run as many times.
+		start = now();
+		for(j=0; j<iterations / 16; j++) {
+			total += curl_encode_uri(curl, encoded, uri);
+		}
+		old_time = (now() - start) * 16;
+		start = now();
+		for(j=0; j<iterations; j++) {
+			total += rest_uri_encode(encoded, uri);
+		}
+		new_time = now() - start;
+
+		printf("%6d bytes %8d uris curl_easy_escape %9.1f MB/s rest_uri_encode %9.1f MB/s (%zu)\n",
+				length, iterations,
+				(double)length * iterations / old_time / (1024 * 1024),
+				(double)length * iterations / new_time / (1024 * 1024),
+				total);
+		free(encoded);
+		free(uri);
+	}
+	curl_easy_cleanup(curl);
+
+	return 0;
+}
+
+static Benchmark benchmarks[] = {
+#ifdef _PTHREADS
+	{ "http2", "[size] [requests] [threads]", bench_http2 },
+	{ "download", "[size...]", bench_download },
+	{ "upload", "[size...]", bench_upload },
+	{ "serve", "", bench_serve },
+#endif
+	{ "uri", "[length...]", bench_uri },
+	{ NULL, NULL, NULL }
+};
+
+static void usage() {
+	Benchmark *b;
+
+	fprintf(stderr, "usage: bench_rest <benchmark> [args]\n");
+	for(b=benchmarks; b->name; b++) {
+		fprintf(stderr, "  %s %s\n", b->name, b->usage);
+	}
+}
+
+int main(int argc, char **argv) {
+	Benchmark *b;
+	int rc = 1;
+
+	if(argc < 2) {
+		usage();
+		return 1;
+	}
+
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+	for(b=benchmarks; b->name; b++) {
+		if(!strcmp(b->name, argv[1])) {
+			rc = b->run(argc - 2, argv + 2);
+			if(rc) {
+				usage();
+			}
+			break;
+		}
+	}
+	if(!b->name) {
+		usage();
+	}
+	curl_global_cleanup();
+
+	return rc ? 1 : 0;
+}
@@ -35,6 +35,7 @@
 #include "seatest.h"
 #include "test_object.h"
 #include "test_rest_client.h"
+#include "test_rest_executor.h"
 
 
 void start_test_msg(const char *test_name) {
@@ -48,6 +49,7 @@ int main() {
 	// Run tests
 	run_tests(test_object_suite);
 	run_tests(test_rest_client_suite);
+	run_tests(test_rest_executor_suite);
 
 	return 0;
 }
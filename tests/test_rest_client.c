@@ -31,12 +31,18 @@
 */
 #include <string.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "seatest.h"
 #include "test.h"
 #include "test_rest_client.h"
 #include "rest_client.h"
+#ifdef _PTHREADS
+#include "test_server.h"
+#endif
 
 #define TEST_HOST "http://www.google.com"
 #define TEST_PORT 80
@@ -152,115 +158,2085 @@ void test_rest_client_threads() {
 
 	RestClient_destroy(&c);
 }
-#endif
 
-void test_rest_client_execute_with_buffer() {
-	// Load the root of the server. Use a predefined buffer to fill.
-    size_t buffer_size = 1024*1024;
-    char *buffer = NULL;
+#define REUSE_REQUESTS 5
+#define REUSE_THREADS 8
+
+void test_rest_client_connection_reuse() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	int i;
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+
+	for(i=0; i<REUSE_REQUESTS; i++) {
+		RestRequest req;
+		RestResponse res;
+
+		RestRequest_init(&req, "/data/100", HTTP_GET);
+		RestResponse_init(&res);
+		RestClient_execute_request(&c, chain, &req, &res);
+
+		assert_int_equal(0, res.curl_error);
+		assert_int_equal(200, res.http_code);
+		assert_int_equal(100, (int)res.content_length);
+		// Only the first request should need to connect.
+		assert_int_equal(i == 0 ? 1 : 0, res.num_connects);
+
+		RestResponse_destroy(&res);
+		RestRequest_destroy(&req);
+	}
+	assert_int_equal(1, test_server_connections(&server));
+
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+}
+
+void *exec_reuse_requests(void *private) {
+	TestData *data = (TestData*)private;
+	RestFilter* chain = NULL;
+	int i;
+
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	for(i=0; i<REUSE_REQUESTS; i++) {
+		RestRequest req;
+		RestResponse res;
+
+		RestRequest_init(&req, "/data/1000", HTTP_GET);
+		RestResponse_init(&res);
+		RestClient_execute_request(data->c, chain, &req, &res);
+		if(res.curl_error == 0) {
+			data->status = res.http_code;
+		} else {
+			data->status = 0;
+		}
+		RestResponse_destroy(&res);
+		RestRequest_destroy(&req);
+	}
+	RestFilter_free(chain);
+
+	return private;
+}
+
+void test_rest_client_connection_reuse_threads() {
+	// Connections are shared between threads and capped by the limit.
+	TestServer server;
+	pthread_t thread[REUSE_THREADS];
+	TestData data[REUSE_THREADS];
 	RestClient c;
+	int t;
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	RestClient_set_connection_limits(&c, 2, 4);
+
+	for(t=0; t<REUSE_THREADS; t++) {
+		data[t].c = &c;
+		data[t].status = 0;
+		assert_int_equal(0, pthread_create(&thread[t], NULL,
+				exec_reuse_requests, &data[t]));
+	}
+	for(t=0; t<REUSE_THREADS; t++) {
+		pthread_join(thread[t], NULL);
+		assert_int_equal(200, data[t].status);
+	}
+	assert_true(test_server_connections(&server) <= 2);
+
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+}
+
+void test_rest_client_threads_without_cookies() {
+	TestServer server;
+	pthread_t thread[REUSE_THREADS];
+	TestData data[REUSE_THREADS];
+	RestClient c;
+	int t;
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	RestClient_set_cookie_sharing(&c, 0);
+
+	for(t=0; t<REUSE_THREADS; t++) {
+		data[t].c = &c;
+		data[t].status = 0;
+		assert_int_equal(0, pthread_create(&thread[t], NULL,
+				exec_reuse_requests, &data[t]));
+	}
+	for(t=0; t<REUSE_THREADS; t++) {
+		pthread_join(thread[t], NULL);
+		assert_int_equal(200, data[t].status);
+	}
+
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+}
+
+/**
+ * Whether libcurl can send a second request on an HTTP/2 connection opened
+ * with prior knowledge.  Some releases (e.g. 7.88.1) fail it with
+ * CURLE_HTTP2.
+ */
+static int http2_reuse_works(TestServer *server) {
+	CURL *curl = curl_easy_init();
+	char url[128];
+	int works;
+
+	snprintf(url, sizeof(url), "%s/", server->url);
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+			(long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+	works = curl_easy_perform(curl) == CURLE_OK
+			&& curl_easy_perform(curl) == CURLE_OK;
+	curl_easy_cleanup(curl);
+
+	return works;
+}
+
+void test_rest_client_http2() {
+	TestServer server;
+	pthread_t thread[REUSE_THREADS];
+	TestData data[REUSE_THREADS];
+	RestClient c;
+	RestFilter *chain;
 	RestRequest req;
 	RestResponse res;
-	RestFilter* chain = NULL;
-    
-    
-	RestClient_init(&c, "www.google.com", 80);
-	RestRequest_init(&req, "/", HTTP_GET);
+	int reuse_works, connections, requests;
+	int t;
+
+	if(!(curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2)) {
+		// libcurl was built without nghttp2.
+		return;
+	}
+	assert_int_equal(0, test_server_start(&server));
+	reuse_works = http2_reuse_works(&server);
+	connections = test_server_connections(&server);
+	requests = server.requests;
+	RestClient_init(&c, server.url, server.port);
+	RestClient_set_http2(&c, 1);
+	RestClient_set_engine_threads(&c, 1);
+
+	// The blocking requests of all threads are handed to the one engine and
+	// multiplexed over its connection.
+	for(t=0; t<REUSE_THREADS; t++) {
+		data[t].c = &c;
+		data[t].status = 0;
+		assert_int_equal(0, pthread_create(&thread[t], NULL,
+				exec_reuse_requests, &data[t]));
+	}
+	for(t=0; t<REUSE_THREADS; t++) {
+		pthread_join(thread[t], NULL);
+		if(reuse_works) {
+			assert_int_equal(200, data[t].status);
+		}
+	}
+	assert_int_equal(1, test_server_connections(&server) - connections);
+	if(reuse_works) {
+		assert_int_equal(REUSE_THREADS * REUSE_REQUESTS,
+				server.requests - requests);
+	} else {
+		// Only the first stream on the connection gets through.
+		assert_true(server.requests > requests);
+	}
+	RestClient_destroy(&c);
+
+	// Bodies span several DATA frames.  A new client opens a new
+	// connection, so this works even where reuse doesn't.
+	server.h2_body_size = 100000;
+	RestClient_init(&c, server.url, server.port);
+	RestClient_set_http2(&c, 1);
+	chain = RestFilter_add(NULL, &RestFilter_execute_curl_request);
+	RestRequest_init(&req, "/data/100000", HTTP_GET);
 	RestResponse_init(&res);
-    
-    // Init the buffer.
-    buffer = malloc(buffer_size);
-    RestResponse_use_buffer(&res, buffer, buffer_size);
-    
-	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
 	RestClient_execute_request(&c, chain, &req, &res);
-	RestFilter_free(chain);
-    
 	assert_int_equal(0, res.curl_error);
 	assert_int_equal(200, res.http_code);
-    
+	assert_int_equal(100000, (int)res.content_length);
+	for(t=0; t<100000; t++) {
+		if(res.body[t] != TEST_SERVER_BYTE(t)) {
+			break;
+		}
+	}
+	assert_int_equal(100000, t);
 	RestResponse_destroy(&res);
 	RestRequest_destroy(&req);
+	RestFilter_free(chain);
+
 	RestClient_destroy(&c);
-    free(buffer);
+	test_server_stop(&server);
 }
 
-void test_rest_client_execute_with_too_small_buffer() {
-	// Load the root of the server. Use a predefined buffer to fill.
-    // This buffer will be too small, so the request should fail!
-    size_t buffer_size = 1;
-    char *buffer = NULL;
-	RestClient c;
+/**
+ * Requests /cookies and returns nonzero if the request carried a cookie.
+ */
+static int sent_cookie(RestClient *c, RestFilter *chain) {
 	RestRequest req;
 	RestResponse res;
-	RestFilter* chain = NULL;
-    
-    
-	RestClient_init(&c, "www.google.com", 80);
-	RestRequest_init(&req, "/", HTTP_GET);
+	int sent;
+
+	RestRequest_init(&req, "/cookies", HTTP_GET);
 	RestResponse_init(&res);
-    
-    // Init the buffer.
-    buffer = malloc(buffer_size);
-    RestResponse_use_buffer(&res, buffer, buffer_size);
-    
+	RestClient_execute_request(c, chain, &req, &res);
+	assert_int_equal(200, res.http_code);
+	sent = res.content_length > 0 && strstr(res.body, "test=1") != NULL;
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	return sent;
+}
+
+/**
+ * Turns on the cookie engine.  CURLOPT_COOKIEFILE would do the same, but
+ * older libcurl loses its file list when the pooled handle is reset.
+ */
+static int enable_cookies(RestClient *rest, CURL *handle) {
+	curl_easy_setopt(handle, CURLOPT_COOKIEJAR, "/dev/null");
+	return 0;
+}
+
+void test_rest_client_cookie_sharing() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	RestClient_add_curl_config_handler(&c, &enable_cookies);
 	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
-	RestClient_execute_request(&c, chain, &req, &res);
+
+	// Shared by default.
+	assert_false(sent_cookie(&c, chain));
+	assert_true(sent_cookie(&c, chain));
+
+	// The pooled handle is attached to the share; it must still change.
+	assert_int_equal(0, RestClient_set_cookie_sharing(&c, 0));
+	assert_false(sent_cookie(&c, chain));
+
+	assert_int_equal(0, RestClient_set_cookie_sharing(&c, 1));
+	assert_false(sent_cookie(&c, chain));
+	assert_true(sent_cookie(&c, chain));
+
 	RestFilter_free(chain);
-    
-	assert_int_equal(CURLE_WRITE_ERROR, res.curl_error);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+}
+
+#define SUBMIT_REQUESTS 200
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int completed;
+	int succeeded;
+} SubmitData;
+
+static int response_filter_calls = 0;
+
+/**
+ * Counts the responses that made it back up through the chain.
+ */
+void count_response_filter(RestFilter *self, RestClient *rest,
+		RestRequest *request, RestResponse *response) {
+	if(self->next) {
+		((rest_http_filter)self->next->func)(self->next, rest, request, response);
+	}
+	__atomic_fetch_add(&response_filter_calls, 1, __ATOMIC_RELAXED);
+}
+
+void submit_complete(RestClient *rest, RestRequest *request,
+		RestResponse *response, void *ctx) {
+	SubmitData *data = ctx;
+
+	pthread_mutex_lock(&data->lock);
+	data->completed++;
+	if(response->curl_error == 0 && response->http_code == 200
+			&& response->content_length == 1000) {
+		data->succeeded++;
+	}
+	pthread_cond_signal(&data->done);
+	pthread_mutex_unlock(&data->lock);
+}
+
+void test_rest_client_submit() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestRequest *req;
+	RestResponse *res;
+	SubmitData data;
+	int i;
+
+	memset(&data, 0, sizeof(data));
+	pthread_mutex_init(&data.lock, NULL);
+	pthread_cond_init(&data.done, NULL);
+	response_filter_calls = 0;
+
+	req = calloc(SUBMIT_REQUESTS, sizeof(RestRequest));
+	res = calloc(SUBMIT_REQUESTS, sizeof(RestResponse));
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	RestClient_set_connection_limits(&c, 8, 8);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	chain = RestFilter_add(chain, &count_response_filter);
+
+	for(i=0; i<SUBMIT_REQUESTS; i++) {
+		RestRequest_init(&req[i], "/data/1000", HTTP_GET);
+		RestResponse_init(&res[i]);
+		RestClient_submit(&c, chain, &req[i], &res[i], submit_complete, &data);
+	}
+
+	pthread_mutex_lock(&data.lock);
+	while(data.completed < SUBMIT_REQUESTS) {
+		pthread_cond_wait(&data.done, &data.lock);
+	}
+	pthread_mutex_unlock(&data.lock);
+
+	assert_int_equal(SUBMIT_REQUESTS, data.succeeded);
+	assert_int_equal(SUBMIT_REQUESTS, response_filter_calls);
+	// All requests were multiplexed over a handful of connections.
+	assert_true(test_server_connections(&server) <= 8);
+
+	for(i=0; i<SUBMIT_REQUESTS; i++) {
+		RestResponse_destroy(&res[i]);
+		RestRequest_destroy(&req[i]);
+	}
+	free(req);
+	free(res);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+	pthread_mutex_destroy(&data.lock);
+	pthread_cond_destroy(&data.done);
+}
+
+#define BATCH_REQUESTS 100
+#define BATCH_PARALLEL 10
+
+void test_rest_client_execute_batch() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestRequest *req[BATCH_REQUESTS];
+	RestResponse *res[BATCH_REQUESTS];
+	char uri[64];
+	int i;
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+
+	for(i=0; i<BATCH_REQUESTS; i++) {
+		req[i] = malloc(sizeof(RestRequest));
+		res[i] = malloc(sizeof(RestResponse));
+		snprintf(uri, sizeof(uri), "/data/%d", i + 1);
+		RestRequest_init(req[i], uri, HTTP_GET);
+		RestResponse_init(res[i]);
+	}
+
+	RestClient_execute_batch(&c, chain, req, res, BATCH_REQUESTS,
+			BATCH_PARALLEL);
+
+	for(i=0; i<BATCH_REQUESTS; i++) {
+		assert_int_equal(0, res[i]->curl_error);
+		assert_int_equal(200, res[i]->http_code);
+		assert_int_equal(i + 1, (int)res[i]->content_length);
+		assert_true(res[i]->body[i] == TEST_SERVER_BYTE(i));
+		RestResponse_destroy(res[i]);
+		RestRequest_destroy(req[i]);
+		free(res[i]);
+		free(req[i]);
+	}
+	assert_true(test_server_connections(&server) <= BATCH_PARALLEL);
+
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+}
+
+void test_rest_client_body_prealloc() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestRequest req;
+	RestResponse res;
+	int i;
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+
+	// The Content-Length is known, so the body is allocated exactly once.
+	RestRequest_init(&req, "/data/3000000", HTTP_GET);
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
 	assert_int_equal(200, res.http_code);
-    
+	assert_int_equal(3000000, (int)res.content_length);
+	assert_int_equal(3000000, (int)res.expected_length);
+	assert_int_equal(3000000, (int)res.body_capacity);
+	for(i=0; i<3000000 && res.body[i] == TEST_SERVER_BYTE(i); i++);
+	assert_int_equal(3000000, i);
+	assert_int_equal(0, res.body[3000000]);
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	// Nothing is allocated for the body of a HEAD.
+	RestRequest_init(&req, "/data/3000000", HTTP_HEAD);
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(0, (int)res.body_capacity);
 	RestResponse_destroy(&res);
 	RestRequest_destroy(&req);
+
+	RestFilter_free(chain);
 	RestClient_destroy(&c);
-    free(buffer);
+	test_server_stop(&server);
 }
 
+void test_rest_response_reset() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestRequest req;
+	RestResponse res;
+	char *body, *content_type;
+	int i;
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	chain = RestFilter_add(chain, &RestFilter_set_content_headers);
+	RestRequest_init(&req, "/data/5000", HTTP_GET);
+	RestResponse_init(&res);
 
-#define TEST_HEADER "THIS IS A HEADER"
-#define TEST_CONTENT_TYPE "text/plain"
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(200, res.http_code);
+	body = res.body;
+	content_type = res.content_type;
 
-void test_rest_request() {
+	// The same memory is reused for every response.
+	for(i=0; i<10; i++) {
+		RestResponse_reset(&res);
+		assert_int_equal(0, res.http_code);
+		assert_int_equal(0, res.response_header_count);
+		assert_int_equal(0, (int)res.content_length);
+		assert_true(res.content_type == NULL);
+
+		RestClient_execute_request(&c, chain, &req, &res);
+		assert_int_equal(200, res.http_code);
+		assert_int_equal(5000, (int)res.content_length);
+		assert_true(res.body[4999] == TEST_SERVER_BYTE(4999));
+		assert_string_equal("5000",
+				RestResponse_get_header_value(&res, "Content-Length"));
+		assert_string_equal("application/octet-stream", res.content_type);
+		assert_string_equal("OK", res.http_status);
+		assert_true(res.body == body);
+		assert_true(res.content_type == content_type);
+	}
+
+	// The content type is allocated separately and may be freed early.
+	free(res.content_type);
+	res.content_type = NULL;
+	RestResponse_reset(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_string_equal("application/octet-stream", res.content_type);
+
+	// Or replaced with the caller's own copy, which is then freed for it.
+	free(res.content_type);
+	res.content_type = strdup("text/plain");
+	RestResponse_reset(&res);
+	assert_true(res.content_type == NULL);
+
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+}
+
+#define MANY_HEADERS 500
+
+void test_rest_response_many_headers() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
 	RestRequest req;
+	RestResponse res;
+	const char *value;
+	size_t value_len;
+	char name[32], expected[32];
+	int i;
 
-	RestRequest_init(&req, "/", HTTP_GET);
-	assert_string_equal(CLASS_REST_REQUEST, Object_get_class_name((Object*)&req));
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	RestRequest_init(&req, "/headers/500", HTTP_GET);
+	RestResponse_init(&res);
 
-	RestRequest_add_header(&req, TEST_HEADER);
-	assert_int_equal(1, req.header_count);
-	assert_string_equal(TEST_HEADER, req.headers[0]);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	assert_string_equal("OK", res.http_status);
+	// The status line isn't a header.
+	assert_int_equal(MANY_HEADERS + 1, res.response_header_count);
 
-	RestRequest_set_array_body(&req, TEST_HEADER, strlen(TEST_HEADER), TEST_CONTENT_TYPE);
-	assert_string_equal(TEST_HEADER, req.request_body->body);
-	assert_int_equal(strlen(TEST_HEADER), (int)req.request_body->data_size);
-	assert_string_equal(TEST_CONTENT_TYPE, req.request_body->content_type);
+	for(i=0; i<MANY_HEADERS; i++) {
+		snprintf(name, sizeof(name), "x-test-%d", i);
+		snprintf(expected, sizeof(expected), "value %d", i);
+		value = RestResponse_find_header(&res, name, strlen(name), &value_len);
+		assert_true(value != NULL);
+		assert_int_equal((int)strlen(expected), (int)value_len);
+		assert_string_equal(expected, value);
+	}
+	assert_string_equal("X-Test-7:  value 7",
+			RestResponse_get_header(&res, "X-TEST-7"));
+	assert_string_equal("value 7",
+			RestResponse_get_header_value(&res, "X-TEST-7"));
+	assert_true(RestResponse_get_header(&res, "X-Test") == NULL);
+	assert_true(RestResponse_find_header(&res, "X-Test-7", 6, NULL) == NULL);
 
+	RestResponse_destroy(&res);
 	RestRequest_destroy(&req);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+}
 
-	assert_true(req.request_body == NULL);
-	assert_true(req.header_count == 0);
-	assert_true(req.uri == NULL);
+typedef struct {
+	RestResponse *res;
+	int64_t received;
+	int errors;
+	int calls;
+	int pause_at;
+	int abort_at;
+} SinkState;
+
+static enum rest_sink_result check_sink(void *ctx, const char *data,
+		size_t size) {
+	SinkState *state = ctx;
+	size_t i;
+
+	if(state->calls++ == state->abort_at) {
+		return REST_SINK_ABORT;
+	}
+	if(state->calls == state->pause_at) {
+		return REST_SINK_PAUSE;
+	}
+	for(i=0; i<size; i++) {
+		if(data[i] != TEST_SERVER_BYTE(state->received + i)) {
+			state->errors++;
+		}
+	}
+	state->received += size;
+	return REST_SINK_CONTINUE;
 }
 
-void test_rest_client_suite() {
-	test_fixture_start();
-	curl_global_init(CURL_GLOBAL_DEFAULT);
+static void *resume_later(void *arg) {
+	usleep(100000);
+	RestResponse_resume(arg);
+	return NULL;
+}
 
+void test_rest_response_sink() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestRequest req;
+	RestResponse res;
+	SinkState state;
+	pthread_t thread;
+	struct timespec start, end;
+	double elapsed;
 
-	start_test_msg("test_rest_client_init");
-	run_test(test_rest_client_init);
-	start_test_msg("test_rest_client_destroy");
-	run_test(test_rest_client_destroy);
-	start_test_msg("test_rest_client_execute");
-	run_test(test_rest_client_execute);
-	start_test_msg("test_rest_client_execute_with_buffer");
-	run_test(test_rest_client_execute_with_buffer);
-	start_test_msg("test_rest_client_execute_with_too_small_buffer");
-	run_test(test_rest_client_execute_with_too_small_buffer);
-#ifdef _PTHREADS
-	start_test_msg("test_rest_client_threads");
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	RestRequest_init(&req, "/data/10000000", HTTP_GET);
+
+	// The body goes to the sink and isn't stored.
+	memset(&state, 0, sizeof(state));
+	state.pause_at = state.abort_at = -1;
+	RestResponse_init(&res);
+	RestResponse_use_sink(&res, check_sink, &state);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(10000000, (int)state.received);
+	assert_int_equal(10000000, (int)res.content_length);
+	assert_int_equal(0, state.errors);
+	assert_true(res.body == NULL);
+
+	// Pausing redelivers the same data after RestResponse_resume().
+	memset(&state, 0, sizeof(state));
+	state.pause_at = 3;
+	state.abort_at = -1;
+	RestResponse_reset(&res);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&thread, NULL, resume_later, &res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	pthread_join(thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(10000000, (int)state.received);
+	assert_int_equal(10000000, (int)res.content_length);
+	assert_int_equal(0, state.errors);
+	assert_true(elapsed >= 0.1);
+	assert_true(elapsed < 3);
+
+	// Aborting fails the request.
+	memset(&state, 0, sizeof(state));
+	state.pause_at = -1;
+	state.abort_at = 1;
+	RestResponse_reset(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(CURLE_WRITE_ERROR, res.curl_error);
+	assert_true(state.received > 0);
+	assert_true(state.received < 10000000);
+
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+}
+
+void test_rest_request_iov_body() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestRequest req;
+	RestResponse res;
+	struct iovec iov[4];
+	char *payload;
+	size_t i;
+
+	// A small header segment, an empty one and two large fragments that
+	// span many of cURL's upload buffers.
+	payload = malloc(300000);
+	for(i=0; i<300000; i++) {
+		payload[i] = TEST_SERVER_BYTE(i);
+	}
+	iov[0].iov_base = "header:";
+	iov[0].iov_len = 7;
+	iov[1].iov_base = payload;
+	iov[1].iov_len = 0;
+	iov[2].iov_base = payload;
+	iov[2].iov_len = 100000;
+	iov[3].iov_base = payload + 100000;
+	iov[3].iov_len = 200000;
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	chain = RestFilter_add(chain, &RestFilter_set_content_headers);
+
+	RestRequest_init(&req, "/echo", HTTP_POST);
+	RestRequest_set_iov_body(&req, iov, 4, "application/octet-stream");
+	assert_int_equal(300007, (int)req.request_body->data_size);
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(300007, (int)res.content_length);
+	assert_true(!memcmp("header:", res.body, 7));
+	assert_true(!memcmp(payload, res.body + 7, 300000));
+	RestResponse_destroy(&res);
+
+	// The segments are read from the start again for a second request.
+	RestRequest_reset(&req, "/echo", HTTP_PUT);
+	RestRequest_set_iov_body(&req, iov + 2, 1, "application/octet-stream");
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(100000, (int)res.content_length);
+	assert_true(!memcmp(payload, res.body, 100000));
+	RestResponse_destroy(&res);
+
+	RestRequest_destroy(&req);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+	free(payload);
+}
+
+static int64_t filtered_bytes;
+
+static int count_filter(RestRequest *request, char *data, size_t data_size) {
+	filtered_bytes += data_size;
+	return 1;
+}
+
+void test_rest_request_mmap_body() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestRequest req;
+	RestResponse res;
+	FILE *f = tmpfile();
+	int i;
+
+	// Several pages, so the body starts and ends mid-page.
+	for(i=0; i<100000; i++) {
+		fputc(TEST_SERVER_BYTE(i), f);
+	}
+	fflush(f);
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	chain = RestFilter_add(chain, &RestFilter_set_content_headers);
+
+	RestRequest_init(&req, "/echo", HTTP_PUT);
+	assert_int_equal(0, RestRequest_set_mmap_body(&req, fileno(f), 5000,
+			90000, "application/octet-stream"));
+	RestRequest_set_file_filter(&req, count_filter);
+	filtered_bytes = 0;
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(90000, (int)res.content_length);
+	assert_int_equal(90000, (int)filtered_bytes);
+	for(i=0; i<90000; i++) {
+		if(res.body[i] != TEST_SERVER_BYTE(5000 + i)) {
+			break;
+		}
+	}
+	assert_int_equal(90000, i);
+	RestResponse_destroy(&res);
+
+	// Empty bodies need no mapping; bad descriptors fail.
+	RestRequest_reset(&req, "/echo", HTTP_PUT);
+	assert_int_equal(0, RestRequest_set_mmap_body(&req, fileno(f), 0, 0,
+			"application/octet-stream"));
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(0, (int)res.content_length);
+	RestResponse_destroy(&res);
+	assert_int_equal(-1, RestRequest_set_mmap_body(&req, -1, 0, 10,
+			"application/octet-stream"));
+	assert_true(req.request_body == NULL);
+
+	RestRequest_destroy(&req);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+	fclose(f);
+}
+
+void test_rest_response_use_fd() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestRequest req;
+	RestResponse res;
+	FILE *f = tmpfile();
+	char *data;
+	int i;
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+
+	// Fill the second half of the file first; the file position isn't used.
+	RestRequest_init(&req, "/data/300000", HTTP_GET);
+	RestRequest_add_header(&req, "Range: bytes=150000-299999");
+	RestResponse_init(&res);
+	RestResponse_use_fd(&res, fileno(f), 150000);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(206, res.http_code);
+	assert_int_equal(150000, (int)res.content_length);
+	assert_true(res.body == NULL);
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	RestRequest_init(&req, "/data/300000", HTTP_GET);
+	RestRequest_add_header(&req, "Range: bytes=0-149999");
+	RestResponse_init(&res);
+	RestResponse_use_fd(&res, fileno(f), 0);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(150000, (int)res.content_length);
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	assert_int_equal(0, (int)ftello(f));
+	assert_int_equal(0, fseeko(f, 0, SEEK_END));
+	assert_int_equal(300000, (int)ftello(f));
+	data = malloc(300000);
+	rewind(f);
+	assert_int_equal(300000, (int)fread(data, 1, 300000, f));
+	for(i=0; i<300000; i++) {
+		if(data[i] != TEST_SERVER_BYTE(i)) {
+			break;
+		}
+	}
+	assert_int_equal(300000, i);
+
+	free(data);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+	fclose(f);
+}
+
+/**
+ * Returns nonzero if f holds exactly size bytes of the test server's content.
+ */
+static int download_matches(FILE *f, int64_t size) {
+	char buffer[65536];
+	int64_t offset = 0;
+	size_t c, i;
+
+	if(fseeko(f, 0, SEEK_END) || ftello(f) != size) {
+		return 0;
+	}
+	rewind(f);
+	while((c = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		for(i=0; i<c; i++) {
+			if(buffer[i] != TEST_SERVER_BYTE(offset + i)) {
+				return 0;
+			}
+		}
+		offset += c;
+	}
+	return offset == size;
+}
+
+#define DOWNLOAD_SIZE (10 * 1024 * 1024 + 12345)
+#define DOWNLOAD_PART_SIZE (1024 * 1024)
+
+void test_rest_client_parallel_download() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestRequest req;
+	RestResponse res;
+	FILE *f = tmpfile();
+	char uri[64];
+	char buffer[256];
+	int requests;
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	RestResponse_init(&res);
+
+	// Eleven parts, the last one short.
+	sprintf(uri, "/data/%d", DOWNLOAD_SIZE);
+	RestClient_parallel_download(&c, chain, uri, fileno(f), DOWNLOAD_PART_SIZE,
+			4, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(206, res.http_code);
+	assert_int_equal(DOWNLOAD_SIZE, (int)res.content_length);
+	assert_int_equal(11, server.requests);
+	assert_true(download_matches(f, DOWNLOAD_SIZE));
+
+	// Every part fails once and is requested again.
+	requests = server.requests;
+	assert_int_equal(0, ftruncate(fileno(f), 0));
+	sprintf(uri, "/flaky/%d", DOWNLOAD_SIZE);
+	RestClient_parallel_download(&c, chain, uri, fileno(f), DOWNLOAD_PART_SIZE,
+			4, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(DOWNLOAD_SIZE, (int)res.content_length);
+	assert_int_equal(22, server.requests - requests);
+	assert_true(download_matches(f, DOWNLOAD_SIZE));
+
+	// Smaller than one part; the file is truncated to the object.
+	RestClient_parallel_download(&c, chain, "/data/1000", fileno(f), 0, 0,
+			&res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(206, res.http_code);
+	assert_int_equal(1000, (int)res.content_length);
+	assert_true(download_matches(f, 1000));
+
+	RestClient_parallel_download(&c, chain, "/data/0", fileno(f), 0, 0, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(0, (int)res.content_length);
+	assert_true(download_matches(f, 0));
+
+	RestClient_parallel_download(&c, chain, "/missing", fileno(f), 0, 0, &res);
+	assert_int_equal(404, res.http_code);
+
+	// The response goes back to writing into its caller's buffer.
+	RestResponse_use_buffer(&res, buffer, sizeof(buffer));
+	RestClient_parallel_download(&c, chain, "/data/1000", fileno(f), 0, 0,
+			&res);
+	assert_int_equal(0, res.curl_error);
+	assert_true(buffer == res.body);
+	assert_int_equal(sizeof(buffer), (int)res.buffer_size);
+	assert_int_equal(1, res.use_buffer);
+	assert_int_equal(0, res.use_fd);
+	RestResponse_reset(&res);
+	RestRequest_init(&req, "/data/100", HTTP_GET);
+	RestClient_execute_request(&c, chain, &req, &res);
+	RestRequest_destroy(&req);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(100, (int)res.content_length);
+	assert_int_equal(TEST_SERVER_BYTE(99), buffer[99]);
+
+	RestResponse_destroy(&res);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+	fclose(f);
+}
+
+typedef struct {
+	int64_t sent;
+	int64_t total;
+	int calls;
+} UploadProgress;
+
+static void upload_progress(void *ctx, int64_t sent, int64_t total) {
+	UploadProgress *progress = ctx;
+
+	progress->sent = sent;
+	progress->total = total;
+	progress->calls++;
+}
+
+/**
+ * Returns nonzero if the test server received size bytes of its own content.
+ */
+static int upload_matches(TestServer *server, int64_t size) {
+	int64_t i;
+
+	if(!server->upload || server->upload_size != size) {
+		return 0;
+	}
+	for(i=0; i<size; i++) {
+		if(server->upload[i] != TEST_SERVER_BYTE(i)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void test_rest_client_parallel_upload() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestResponse res;
+	UploadProgress progress;
+	FILE *f = tmpfile();
+	char uri[64];
+	char buffer[4096];
+	int requests;
+	int i, j;
+
+	for(i=0; i<DOWNLOAD_SIZE; i+=sizeof(buffer)) {
+		for(j=0; j<(int)sizeof(buffer); j++) {
+			buffer[j] = TEST_SERVER_BYTE(i + j);
+		}
+		fwrite(buffer, 1, DOWNLOAD_SIZE - i < (int)sizeof(buffer) ?
+				DOWNLOAD_SIZE - i : sizeof(buffer), f);
+	}
+	fflush(f);
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	chain = RestFilter_add(chain, &RestFilter_set_content_headers);
+	RestResponse_init(&res);
+
+	// Eleven parts, the last one short.
+	memset(&progress, 0, sizeof(progress));
+	sprintf(uri, "/data/%d", DOWNLOAD_SIZE);
+	RestClient_parallel_upload(&c, chain, uri, fileno(f), DOWNLOAD_SIZE,
+			"application/octet-stream", DOWNLOAD_PART_SIZE, 4, upload_progress,
+			&progress, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(11, server.requests);
+	assert_true(upload_matches(&server, DOWNLOAD_SIZE));
+	assert_true(progress.calls >= 11);
+	assert_int_equal(DOWNLOAD_SIZE, (int)progress.sent);
+	assert_int_equal(DOWNLOAD_SIZE, (int)progress.total);
+
+	// Every part fails once and is sent again.
+	free(server.upload);
+	server.upload = NULL;
+	requests = server.requests;
+	memset(&progress, 0, sizeof(progress));
+	sprintf(uri, "/flaky/%d", DOWNLOAD_SIZE);
+	RestClient_parallel_upload(&c, chain, uri, fileno(f), DOWNLOAD_SIZE,
+			"application/octet-stream", DOWNLOAD_PART_SIZE, 4, upload_progress,
+			&progress, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(22, server.requests - requests);
+	assert_true(upload_matches(&server, DOWNLOAD_SIZE));
+	assert_int_equal(DOWNLOAD_SIZE, (int)progress.sent);
+
+	RestClient_parallel_upload(&c, chain, "/missing", fileno(f), DOWNLOAD_SIZE,
+			"application/octet-stream", 0, 0, NULL, NULL, &res);
+	assert_int_equal(404, res.http_code);
+
+	RestResponse_destroy(&res);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+	fclose(f);
+}
+
+#define RESUME_SIZE 300000
+
+void test_rest_filter_resume() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestRequest req;
+	RestResponse res;
+	FILE *f = tmpfile();
+	char uri[64];
+	char *data = malloc(RESUME_SIZE);
+	int i;
+
+	for(i=0; i<RESUME_SIZE; i++) {
+		data[i] = TEST_SERVER_BYTE(i);
+	}
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	chain = RestFilter_add(chain, &RestFilter_set_content_headers);
+	chain = RestFilter_add(chain, &RestFilter_resume);
+
+	// The first half arrives, then the rest with a Range request.
+	sprintf(uri, "/drop/%d", RESUME_SIZE);
+	RestRequest_init(&req, uri, HTTP_GET);
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(RESUME_SIZE, (int)res.content_length);
+	assert_int_equal(0, memcmp(data, res.body, RESUME_SIZE));
+	assert_int_equal(2, server.requests);
+	RestResponse_destroy(&res);
+
+	// Same into a file.
+	server.get_dropped = 0;
+	RestResponse_init(&res);
+	RestResponse_use_file(&res, f);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(RESUME_SIZE, (int)res.content_length);
+	fflush(f);
+	assert_true(download_matches(f, RESUME_SIZE));
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	// The object changes before the rest is requested.
+	server.get_dropped = 0;
+	sprintf(uri, "/drop/%d?changed", RESUME_SIZE);
+	RestRequest_init(&req, uri, HTTP_GET);
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(412, res.http_code);
+	assert_int_equal(RESUME_SIZE / 2, (int)res.content_length);
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	// A repeat answered with the whole object isn't appended.
+	server.get_dropped = 0;
+	sprintf(uri, "/drop/%d?norange", RESUME_SIZE);
+	RestRequest_init(&req, uri, HTTP_GET);
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(CURLE_RANGE_ERROR, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(RESUME_SIZE / 2, (int)res.content_length);
+	assert_int_equal(0, memcmp(data, res.body, RESUME_SIZE / 2));
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	// A suffix range continues from where the server said it starts.
+	server.get_dropped = 0;
+	sprintf(uri, "/drop/%d", RESUME_SIZE);
+	RestRequest_init(&req, uri, HTTP_GET);
+	RestRequest_add_header(&req, "Range: bytes=-100000");
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(206, res.http_code);
+	assert_int_equal(100000, (int)res.content_length);
+	assert_int_equal(0, memcmp(data + RESUME_SIZE - 100000, res.body, 100000));
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	// Half the body is stored, then the rest is sent with Content-Range.
+	server.requests = 0;
+	sprintf(uri, "/partial/%d", RESUME_SIZE);
+	RestRequest_init(&req, uri, HTTP_PUT);
+	RestRequest_set_array_body(&req, data, RESUME_SIZE,
+			"application/octet-stream");
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(3, server.requests);
+	assert_int_equal(RESUME_SIZE, (int)server.upload_length);
+	assert_true(upload_matches(&server, RESUME_SIZE));
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	free(data);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+	fclose(f);
+}
+
+#define ASYNC_FILE_SIZE (5 * REST_FILE_IO_BUFFER_SIZE / 2)
+
+typedef struct {
+	RestClient *client;
+	RestFilter *chain;
+	FILE *file;
+	int curl_error;
+} AsyncDownload;
+
+static void *exec_async_download(void *arg) {
+	AsyncDownload *d = arg;
+	RestRequest req;
+	RestResponse res;
+
+	RestRequest_init(&req, "/data/2621440", HTTP_GET);
+	RestResponse_init(&res);
+	RestResponse_use_file(&res, d->file);
+	RestClient_execute_request(d->client, d->chain, &req, &res);
+	d->curl_error = res.curl_error;
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+	return NULL;
+}
+
+void test_rest_client_async_file_io() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestRequest req;
+	RestResponse res;
+	FILE *in = tmpfile(), *out = tmpfile(), *read_only;
+	AsyncDownload downloads[2*REST_FILE_IO_THREADS];
+	pthread_t threads[2*REST_FILE_IO_THREADS];
+	char *data;
+	int i;
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	RestClient_set_async_file_io(&c, 1);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	chain = RestFilter_add(chain, &RestFilter_set_content_headers);
+
+	// Download into a file, spanning both buffers more than once.
+	RestRequest_init(&req, "/data/2621440", HTTP_GET);
+	RestResponse_init(&res);
+	RestResponse_use_file(&res, out);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(ASYNC_FILE_SIZE, (int)res.content_length);
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	data = malloc(ASYNC_FILE_SIZE);
+	rewind(out);
+	assert_int_equal(ASYNC_FILE_SIZE, (int)fread(data, 1, ASYNC_FILE_SIZE, out));
+	for(i=0; i<ASYNC_FILE_SIZE; i++) {
+		if(data[i] != TEST_SERVER_BYTE(i)) {
+			break;
+		}
+	}
+	assert_int_equal(ASYNC_FILE_SIZE, i);
+
+	// Upload it again from a file, through the filter.
+	fwrite(data, 1, ASYNC_FILE_SIZE, in);
+	rewind(in);
+	RestRequest_init(&req, "/echo", HTTP_PUT);
+	RestRequest_set_file_body(&req, in, ASYNC_FILE_SIZE, "application/octet-stream");
+	RestRequest_set_file_filter(&req, count_filter);
+	filtered_bytes = 0;
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(ASYNC_FILE_SIZE, (int)res.content_length);
+	assert_int_equal(ASYNC_FILE_SIZE, (int)filtered_bytes);
+	assert_true(!memcmp(data, res.body, ASYNC_FILE_SIZE));
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	// More transfers than pool threads still all complete.
+	for(i=0; i<2*REST_FILE_IO_THREADS; i++) {
+		downloads[i].client = &c;
+		downloads[i].chain = chain;
+		downloads[i].file = tmpfile();
+		downloads[i].curl_error = -1;
+		assert_int_equal(0, pthread_create(&threads[i], NULL,
+				exec_async_download, &downloads[i]));
+	}
+	for(i=0; i<2*REST_FILE_IO_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		assert_int_equal(0, downloads[i].curl_error);
+		assert_int_equal(ASYNC_FILE_SIZE, (int)ftell(downloads[i].file));
+		fclose(downloads[i].file);
+	}
+
+	// A file that can't be written fails the request.
+	read_only = fdopen(dup(fileno(out)), "r");
+	RestRequest_init(&req, "/data/2621440", HTTP_GET);
+	RestResponse_init(&res);
+	RestResponse_use_file(&res, read_only);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(CURLE_WRITE_ERROR, res.curl_error);
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+	fclose(read_only);
+
+	free(data);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+	fclose(in);
+	fclose(out);
+}
+
+#define WARMUP_CONNECTIONS 4
+
+void test_rest_client_warmup() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestRequest *req[WARMUP_CONNECTIONS];
+	RestResponse *res[WARMUP_CONNECTIONS];
+	int i;
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+
+	assert_int_equal(WARMUP_CONNECTIONS,
+			RestClient_warmup(&c, WARMUP_CONNECTIONS, 5000));
+	assert_int_equal(WARMUP_CONNECTIONS, test_server_connections(&server));
+
+	// Warming up again reuses the idle connections, one or more of them
+	// depending on how the requests overlap, and opens no more.
+	i = RestClient_warmup(&c, WARMUP_CONNECTIONS, 5000);
+	assert_true(i >= 1 && i <= WARMUP_CONNECTIONS);
+	assert_int_equal(WARMUP_CONNECTIONS, test_server_connections(&server));
+
+	// Concurrent requests find their connections ready.
+	for(i=0; i<WARMUP_CONNECTIONS; i++) {
+		req[i] = malloc(sizeof(RestRequest));
+		res[i] = malloc(sizeof(RestResponse));
+		RestRequest_init(req[i], "/data/100", HTTP_GET);
+		RestResponse_init(res[i]);
+	}
+	RestClient_execute_batch(&c, chain, req, res, WARMUP_CONNECTIONS, 0);
+	for(i=0; i<WARMUP_CONNECTIONS; i++) {
+		assert_int_equal(200, res[i]->http_code);
+		assert_int_equal(0, res[i]->num_connects);
+		RestResponse_destroy(res[i]);
+		RestRequest_destroy(req[i]);
+		free(res[i]);
+		free(req[i]);
+	}
+	assert_int_equal(WARMUP_CONNECTIONS, test_server_connections(&server));
+
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+}
+
+#define PRIORITY_REQUESTS 4
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	RestRequest *order[1 + 2 * PRIORITY_REQUESTS];
+	int completed;
+} PriorityData;
+
+void priority_complete(RestClient *rest, RestRequest *request,
+		RestResponse *response, void *ctx) {
+	PriorityData *data = ctx;
+
+	pthread_mutex_lock(&data->lock);
+	data->order[data->completed++] = request;
+	pthread_cond_signal(&data->done);
+	pthread_mutex_unlock(&data->lock);
+}
+
+void test_rest_client_priorities() {
+	TestServer server;
+	RestClient c;
+	RestFilter* chain = NULL;
+	RestRequest slow, low[PRIORITY_REQUESTS], high[PRIORITY_REQUESTS];
+	RestResponse slow_res, low_res[PRIORITY_REQUESTS], high_res[PRIORITY_REQUESTS];
+	RestSchedulerStats high_stats, low_stats;
+	PriorityData data;
+	int i;
+
+	memset(&data, 0, sizeof(data));
+	pthread_mutex_init(&data.lock, NULL);
+	pthread_cond_init(&data.done, NULL);
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	RestClient_set_connection_limits(&c, 1, 1);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+
+	// Hold the only connection while low, then high priority requests queue.
+	RestRequest_init(&slow, "/delay/300", HTTP_GET);
+	RestResponse_init(&slow_res);
+	RestClient_submit(&c, chain, &slow, &slow_res, priority_complete, &data);
+	for(i=0; i<PRIORITY_REQUESTS; i++) {
+		RestRequest_init(&low[i], "/data/10", HTTP_GET);
+		low[i].priority = REST_PRIORITY_LOW;
+		RestResponse_init(&low_res[i]);
+		RestClient_submit(&c, chain, &low[i], &low_res[i], priority_complete,
+				&data);
+	}
+	for(i=0; i<PRIORITY_REQUESTS; i++) {
+		RestRequest_init(&high[i], "/data/10", HTTP_GET);
+		high[i].priority = REST_PRIORITY_HIGH;
+		RestResponse_init(&high_res[i]);
+		RestClient_submit(&c, chain, &high[i], &high_res[i], priority_complete,
+				&data);
+	}
+
+	pthread_mutex_lock(&data.lock);
+	while(data.completed < 1 + 2 * PRIORITY_REQUESTS) {
+		pthread_cond_wait(&data.done, &data.lock);
+	}
+	pthread_mutex_unlock(&data.lock);
+
+	// Each class is dispatched in order, high before low.
+	assert_true(data.order[0] == &slow);
+	for(i=0; i<PRIORITY_REQUESTS; i++) {
+		assert_true(data.order[1 + i] == &high[i]);
+		assert_true(data.order[1 + PRIORITY_REQUESTS + i] == &low[i]);
+		assert_int_equal(200, high_res[i].http_code);
+		assert_int_equal(200, low_res[i].http_code);
+	}
+
+	RestClient_get_scheduler_stats(&c, REST_PRIORITY_HIGH, &high_stats);
+	RestClient_get_scheduler_stats(&c, REST_PRIORITY_LOW, &low_stats);
+	assert_int_equal(0, high_stats.queue_depth);
+	assert_int_equal(0, high_stats.active);
+	assert_int_equal(PRIORITY_REQUESTS, (int)high_stats.dispatched);
+	assert_int_equal(PRIORITY_REQUESTS, (int)low_stats.dispatched);
+	assert_true(high_stats.total_wait_usec > 0);
+	assert_true(low_stats.max_wait_usec > high_stats.max_wait_usec);
+
+	for(i=0; i<PRIORITY_REQUESTS; i++) {
+		RestResponse_destroy(&low_res[i]);
+		RestRequest_destroy(&low[i]);
+		RestResponse_destroy(&high_res[i]);
+		RestRequest_destroy(&high[i]);
+	}
+	RestResponse_destroy(&slow_res);
+	RestRequest_destroy(&slow);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+	pthread_mutex_destroy(&data.lock);
+	pthread_cond_destroy(&data.done);
+}
+
+#define LOOP_REQUESTS 20
+#define LOOP_MAX_FDS 64
+
+/**
+ * A minimal poll() based event loop for driving a RestLoop.
+ */
+typedef struct {
+	struct pollfd fds[LOOP_MAX_FDS];
+	int nfds;
+	/** Milliseconds until the timeout fires, or -1 */
+	long timeout_ms;
+	int completed;
+	/** The thread driving the loop */
+	pthread_t thread;
+	/** Callbacks invoked on any other thread */
+	int foreign_calls;
+} PollLoop;
+
+void poll_loop_socket(RestLoop *loop, int fd, int what, void *userdata) {
+	PollLoop *p = userdata;
+	int i;
+
+	if(!pthread_equal(p->thread, pthread_self())) {
+		p->foreign_calls++;
+	}
+
+	for(i=0; i<p->nfds && p->fds[i].fd != fd; i++);
+	if(what == CURL_POLL_REMOVE) {
+		if(i < p->nfds) {
+			p->fds[i] = p->fds[--p->nfds];
+		}
+		return;
+	}
+	if(i == p->nfds) {
+		p->nfds++;
+	}
+	p->fds[i].fd = fd;
+	p->fds[i].events = ((what & CURL_POLL_IN) ? POLLIN : 0)
+			| ((what & CURL_POLL_OUT) ? POLLOUT : 0);
+}
+
+void poll_loop_timer(RestLoop *loop, long timeout_ms, void *userdata) {
+	PollLoop *p = userdata;
+
+	if(!pthread_equal(p->thread, pthread_self())) {
+		p->foreign_calls++;
+	}
+	p->timeout_ms = timeout_ms;
+}
+
+void poll_loop_complete(RestClient *rest, RestRequest *request,
+		RestResponse *response, void *ctx) {
+	((PollLoop*)ctx)->completed++;
+}
+
+/**
+ * Drives the loop until count requests have completed.
+ */
+static void poll_loop_run(RestLoop *loop, PollLoop *p, int count) {
+	int i, ready, events;
+
+	while(p->completed < count) {
+		ready = poll(p->fds, p->nfds, p->timeout_ms < 0 ? 1000 : p->timeout_ms);
+		if(ready == 0) {
+			p->timeout_ms = -1;
+			RestLoop_timeout(loop);
+			continue;
+		}
+		for(i=p->nfds-1; i>=0; i--) {
+			if(i >= p->nfds || !p->fds[i].revents) {
+				continue;
+			}
+			events = ((p->fds[i].revents & POLLIN) ? CURL_CSELECT_IN : 0)
+					| ((p->fds[i].revents & POLLOUT) ? CURL_CSELECT_OUT : 0)
+					| ((p->fds[i].revents & (POLLERR|POLLHUP))
+							? CURL_CSELECT_ERR : 0);
+			p->fds[i].revents = 0;
+			RestLoop_socket_action(loop, p->fds[i].fd, events);
+		}
+	}
+}
+
+void test_rest_loop() {
+	TestServer server;
+	RestClient c;
+	RestLoop loop;
+	PollLoop p;
+	RestFilter* chain = NULL;
+	RestRequest req[LOOP_REQUESTS];
+	RestResponse res[LOOP_REQUESTS];
+	char uri[64];
+	int i;
+
+	memset(&p, 0, sizeof(p));
+	p.timeout_ms = -1;
+	p.thread = pthread_self();
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	RestLoop_init(&loop, &c, poll_loop_socket, poll_loop_timer, &p);
+
+	for(i=0; i<LOOP_REQUESTS; i++) {
+		snprintf(uri, sizeof(uri), "/data/%d", (i + 1) * 100);
+		RestRequest_init(&req[i], uri, HTTP_GET);
+		RestResponse_init(&res[i]);
+		RestLoop_submit(&loop, chain, &req[i], &res[i], poll_loop_complete, &p);
+	}
+	assert_int_equal(LOOP_REQUESTS, RestLoop_get_request_count(&loop));
+	assert_int_equal(0, p.timeout_ms);
+
+	poll_loop_run(&loop, &p, LOOP_REQUESTS);
+	assert_int_equal(0, RestLoop_get_request_count(&loop));
+	assert_int_equal(0, p.foreign_calls);
+
+	for(i=0; i<LOOP_REQUESTS; i++) {
+		assert_int_equal(0, res[i].curl_error);
+		assert_int_equal(200, res[i].http_code);
+		assert_int_equal((i + 1) * 100, (int)res[i].content_length);
+		RestResponse_destroy(&res[i]);
+		RestRequest_destroy(&req[i]);
+	}
+
+	RestLoop_destroy(&loop);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+}
+
+static void *exec_slow_request(void *arg) {
+	RestClient *c = arg;
+	RestFilter *chain = RestFilter_add(NULL, &RestFilter_execute_curl_request);
+	RestRequest req;
+	RestResponse res;
+
+	RestRequest_init(&req, "/delay/300", HTTP_GET);
+	RestResponse_init(&res);
+	RestClient_execute_request(c, chain, &req, &res);
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+	RestFilter_free(chain);
+
+	return NULL;
+}
+
+void test_rest_loop_wakeup() {
+	TestServer server;
+	RestClient c;
+	RestLoop loop;
+	PollLoop p;
+	RestFilter* chain = NULL;
+	RestRequest req;
+	RestResponse res;
+	RestSchedulerStats stats;
+	pthread_t thread;
+
+	memset(&p, 0, sizeof(p));
+	p.timeout_ms = -1;
+	p.thread = pthread_self();
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	RestClient_set_connection_limits(&c, 1, 1);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	RestLoop_init(&loop, &c, poll_loop_socket, poll_loop_timer, &p);
+
+	// A blocking request on another thread holds the only slot.
+	assert_int_equal(0, pthread_create(&thread, NULL, exec_slow_request, &c));
+	do {
+		usleep(1000);
+		RestClient_get_scheduler_stats(&c, REST_PRIORITY_NORMAL, &stats);
+	} while(stats.active == 0);
+
+	// The loop's request waits for it and is handed the slot from that
+	// thread, which must not invoke the loop's callbacks.
+	RestRequest_init(&req, "/data/100", HTTP_GET);
+	RestResponse_init(&res);
+	RestLoop_submit(&loop, chain, &req, &res, poll_loop_complete, &p);
+	poll_loop_run(&loop, &p, 1);
+	pthread_join(thread, NULL);
+
+	assert_int_equal(0, p.foreign_calls);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	RestLoop_destroy(&loop);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+}
+#endif
+
+void test_rest_client_execute_with_buffer() {
+	// Load the root of the server. Use a predefined buffer to fill.
+    size_t buffer_size = 1024*1024;
+    char *buffer = NULL;
+	RestClient c;
+	RestRequest req;
+	RestResponse res;
+	RestFilter* chain = NULL;
+    
+    
+	RestClient_init(&c, "www.google.com", 80);
+	RestRequest_init(&req, "/", HTTP_GET);
+	RestResponse_init(&res);
+    
+    // Init the buffer.
+    buffer = malloc(buffer_size);
+    RestResponse_use_buffer(&res, buffer, buffer_size);
+    
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	RestClient_execute_request(&c, chain, &req, &res);
+	RestFilter_free(chain);
+    
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+    
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+	RestClient_destroy(&c);
+    free(buffer);
+}
+
+void test_rest_client_execute_with_too_small_buffer() {
+	// Load the root of the server. Use a predefined buffer to fill.
+    // This buffer will be too small, so the request should fail!
+    size_t buffer_size = 1;
+    char *buffer = NULL;
+	RestClient c;
+	RestRequest req;
+	RestResponse res;
+	RestFilter* chain = NULL;
+    
+    
+	RestClient_init(&c, "www.google.com", 80);
+	RestRequest_init(&req, "/", HTTP_GET);
+	RestResponse_init(&res);
+    
+    // Init the buffer.
+    buffer = malloc(buffer_size);
+    RestResponse_use_buffer(&res, buffer, buffer_size);
+    
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	RestClient_execute_request(&c, chain, &req, &res);
+	RestFilter_free(chain);
+    
+	assert_int_equal(CURLE_WRITE_ERROR, res.curl_error);
+	assert_int_equal(200, res.http_code);
+    
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+	RestClient_destroy(&c);
+    free(buffer);
+}
+
+
+void test_rest_client_handle_pool() {
+	// Handles should be recycled even when the request fails.
+	RestClient c;
+	RestRequest req;
+	RestResponse res;
+	RestFilter* chain = NULL;
+	RestPrivate *priv;
+	RestHandle *pooled;
+
+	RestClient_init(&c, "http://127.0.0.1:1", 1);
+	priv = c.internal;
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+
+	RestRequest_init(&req, "/", HTTP_GET);
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_true(res.curl_error != 0);
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	pooled = priv->handle_pool[0];
+	assert_true(pooled != NULL);
+
+	// Second request should check out the same handle.
+	RestRequest_init(&req, "/", HTTP_GET);
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+
+	assert_true(pooled == priv->handle_pool[0]);
+	assert_true(priv->handle_pool[1] == NULL);
+
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+}
+
+void test_rest_client_connection_limit() {
+	// Requests must release their slot, with or without threads.
+	RestClient c;
+	RestRequest req[3];
+	RestResponse res[3];
+	RestRequest *reqs[3];
+	RestResponse *ress[3];
+	RestFilter* chain = NULL;
+	RestSchedulerStats stats;
+	int i;
+
+	RestClient_init(&c, "http://127.0.0.1:1", 1);
+	RestClient_set_connection_limits(&c, 1, 1);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+
+	for(i=0; i<3; i++) {
+		RestRequest_init(&req[i], "/", HTTP_GET);
+		RestResponse_init(&res[i]);
+		RestClient_execute_request(&c, chain, &req[i], &res[i]);
+		assert_true(res[i].curl_error != 0);
+		RestResponse_reset(&res[i]);
+		reqs[i] = &req[i];
+		ress[i] = &res[i];
+	}
+	RestClient_get_scheduler_stats(&c, REST_PRIORITY_NORMAL, &stats);
+	assert_int_equal(0, stats.active);
+	assert_int_equal(0, stats.queue_depth);
+	assert_int_equal(3, (int)stats.dispatched);
+
+	// Batched requests wait for the one slot in turn.
+	RestClient_execute_batch(&c, chain, reqs, ress, 3, 0);
+	for(i=0; i<3; i++) {
+		assert_true(res[i].curl_error != 0);
+		RestResponse_destroy(&res[i]);
+		RestRequest_destroy(&req[i]);
+	}
+	RestClient_get_scheduler_stats(&c, REST_PRIORITY_NORMAL, &stats);
+	assert_int_equal(0, stats.active);
+	assert_int_equal(0, stats.queue_depth);
+	assert_int_equal(6, (int)stats.dispatched);
+
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+}
+
+static void check_url_prefix(const char *host, int port, const char *expected) {
+	RestClient c;
+
+	RestClient_init(&c, host, port);
+	assert_string_equal(expected, ((RestPrivate*)c.internal)->url_prefix);
+	RestClient_destroy(&c);
+}
+
+void test_rest_client_url_prefix() {
+#ifdef _PTHREADS
+	TestServer server;
+	RestClient c;
+	RestRequest req;
+	RestResponse res;
+	RestFilter* chain;
+#endif
+
+	check_url_prefix("example.com", 80, "http://example.com");
+	check_url_prefix("example.com", 443, "https://example.com");
+	check_url_prefix("example.com", 8080, "http://example.com:8080");
+	check_url_prefix("http://example.com", 443, "http://example.com:443");
+	check_url_prefix("https://example.com", 443, "https://example.com");
+	check_url_prefix("https://example.com:9443", 443, "https://example.com:9443");
+	check_url_prefix("http://example.com:81/base", 80, "http://example.com:81/base");
+	check_url_prefix("http://example.com/base", 8080, "http://example.com:8080/base");
+	check_url_prefix("[::1]", 8080, "http://[::1]:8080");
+	check_url_prefix("http://[::1]:81", 8080, "http://[::1]:81");
+	check_url_prefix("example.com", 0, "http://example.com");
+
+#ifdef _PTHREADS
+	// The port argument used to be ignored.
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, "127.0.0.1", server.port);
+	chain = RestFilter_add(NULL, &RestFilter_execute_curl_request);
+	RestRequest_init(&req, "/data/10", HTTP_GET);
+	RestResponse_init(&res);
+	RestClient_execute_request(&c, chain, &req, &res);
+	assert_int_equal(0, res.curl_error);
+	assert_int_equal(200, res.http_code);
+	assert_int_equal(10, (int)res.content_length);
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+#endif
+}
+
+#define TEST_HEADER "THIS IS A HEADER"
+#define TEST_CONTENT_TYPE "text/plain"
+
+void test_rest_request() {
+	RestRequest req;
+
+	RestRequest_init(&req, "/", HTTP_GET);
+	assert_string_equal(CLASS_REST_REQUEST, Object_get_class_name((Object*)&req));
+
+	RestRequest_add_header(&req, TEST_HEADER);
+	assert_int_equal(1, req.header_count);
+	assert_string_equal(TEST_HEADER, req.headers[0]);
+
+	RestRequest_set_array_body(&req, TEST_HEADER, strlen(TEST_HEADER), TEST_CONTENT_TYPE);
+	assert_string_equal(TEST_HEADER, req.request_body->body);
+	assert_int_equal(strlen(TEST_HEADER), (int)req.request_body->data_size);
+	assert_string_equal(TEST_CONTENT_TYPE, req.request_body->content_type);
+
+	RestRequest_destroy(&req);
+
+	assert_true(req.request_body == NULL);
+	assert_true(req.header_count == 0);
+	assert_true(req.uri == NULL);
+}
+
+void test_rest_request_reset() {
+	RestRequest req;
+	char *uri, *header;
+	int i;
+
+	RestRequest_init(&req, "/a/longer/uri/to/start/with", HTTP_PUT);
+	RestRequest_add_header(&req, TEST_HEADER);
+	RestRequest_add_header(&req, "X-Extra: 1");
+	RestRequest_set_array_body(&req, TEST_HEADER, strlen(TEST_HEADER), TEST_CONTENT_TYPE);
+	req.priority = REST_PRIORITY_HIGH;
+	req.uri_encoded = 1;
+	uri = req.uri;
+	header = req.headers[0];
+
+	for(i=0; i<3; i++) {
+		RestRequest_reset(&req, "/short", HTTP_GET);
+		assert_string_equal("/short", req.uri);
+		assert_int_equal(HTTP_GET, req.method);
+		assert_int_equal(0, req.header_count);
+		assert_true(req.headers[0] == NULL);
+		assert_true(req.request_body == NULL);
+		assert_int_equal(REST_PRIORITY_NORMAL, req.priority);
+		assert_int_equal(0, req.uri_encoded);
+		assert_true(RestRequest_get_header(&req, "X-Extra") == NULL);
+
+		// The buffers are reused.
+		RestRequest_add_header(&req, "X-Extra: 2");
+		RestRequest_set_file_body(&req, stdin, 10, TEST_CONTENT_TYPE);
+		assert_true(req.uri == uri);
+		assert_true(req.headers[0] == header);
+		assert_string_equal("2", RestRequest_get_header_value(&req, "x-extra"));
+		assert_true(req.request_body->file_body == stdin);
+		assert_true(req.request_body->body == NULL);
+	}
+
+	// A header replaced by the caller is freed, not reused.
+	free(req.headers[0]);
+	req.headers[0] = strdup("X-Replaced: 3");
+	RestRequest_reset(&req, "/a/uri/longer/than/the/first/one", HTTP_DELETE);
+	assert_string_equal("/a/uri/longer/than/the/first/one", req.uri);
+	RestRequest_add_header(&req, "X-Extra: 4");
+	assert_string_equal("4", RestRequest_get_header_value(&req, "X-Extra"));
+
+	// So is one the caller freed and cleared.
+	free(req.headers[0]);
+	req.headers[0] = NULL;
+	RestRequest_reset(&req, "/cleared", HTTP_GET);
+	assert_true(req.header_storage[0] == NULL);
+	RestRequest_add_header(&req, "X-Extra: 5");
+	assert_string_equal("5", RestRequest_get_header_value(&req, "X-Extra"));
+	free(req.headers[0]);
+	req.headers[0] = NULL;
+
+	RestRequest_destroy(&req);
+	assert_true(req.uri == NULL);
+}
+
+void test_rest_header_values() {
+	RestRequest req;
+	RestResponse res;
+	const char *values[4];
+	char header[32];
+	int i;
+
+	RestRequest_init(&req, "/", HTTP_GET);
+	RestRequest_add_header(&req, "Accept: text/plain");
+	RestRequest_add_header(&req, "X-Tag: one");
+	RestRequest_add_header(&req, "x-tag : two");
+	RestRequest_add_header(&req, "Content-Type: text/plain");
+	RestRequest_add_header(&req, "X-TAG: three");
+
+	assert_string_equal("Accept: text/plain",
+			RestRequest_get_header(&req, "ACCEPT"));
+	assert_string_equal("one", RestRequest_get_header_value(&req, "x-tag"));
+	assert_true(RestRequest_get_header(&req, "X-Ta") == NULL);
+	assert_int_equal(3, RestRequest_get_header_values(&req, "X-Tag", values, 4));
+	assert_string_equal("one", values[0]);
+	assert_string_equal("two", values[1]);
+	assert_string_equal("three", values[2]);
+	// Only max_values are stored but all are counted.
+	assert_int_equal(3, RestRequest_get_header_values(&req, "X-Tag", values, 1));
+	assert_int_equal(0, RestRequest_get_header_values(&req, "Host", values, 4));
+
+	// Up to MAX_HEADERS headers are kept.
+	for(i=0; i<MAX_HEADERS; i++) {
+		snprintf(header, sizeof(header), "X-Extra-%d: %d", i, i);
+		RestRequest_add_header(&req, header);
+	}
+	assert_int_equal(MAX_HEADERS, req.header_count);
+	assert_string_equal("10", RestRequest_get_header_value(&req, "x-extra-10"));
+	assert_int_equal(3, RestRequest_get_header_values(&req, "X-Tag", values, 4));
+	RestRequest_destroy(&req);
+
+	RestResponse_init(&res);
+	RestResponse_add_header(&res, "HTTP/1.1 200 OK\r\n");
+	RestResponse_add_header(&res, "Set-Cookie: a=1\r\n");
+	RestResponse_add_header(&res, "Content-Type: text/plain\r\n");
+	RestResponse_add_header(&res, "set-cookie: b=2\r\n");
+	assert_int_equal(2, RestResponse_get_header_values(&res, "SET-COOKIE",
+			values, 4));
+	assert_string_equal("a=1", values[0]);
+	assert_string_equal("b=2", values[1]);
+	assert_string_equal("text/plain",
+			RestResponse_get_header_value(&res, "content-type"));
+
+	// A new status line starts a new set of headers.
+	RestResponse_add_header(&res, "HTTP/1.1 200 OK\r\n");
+	assert_int_equal(0, RestResponse_get_header_values(&res, "Set-Cookie",
+			values, 4));
+	RestResponse_add_header(&res, "Set-Cookie: c=3\r\n");
+	assert_int_equal(1, RestResponse_get_header_values(&res, "Set-Cookie",
+			values, 4));
+	assert_string_equal("c=3", values[0]);
+	RestResponse_destroy(&res);
+}
+
+/**
+ * The original per-character encoder, used as the reference for
+ * rest_uri_encode().
+ */
+static char *curl_encode_uri(CURL *curl, const char *uri) {
+	char *encoded_uri = calloc(strlen(uri)*3+1, 1);
+	size_t i;
+
+	for(i=0; i<strlen(uri); i++) {
+		if(uri[i] == '/') {
+			encoded_uri[strlen(encoded_uri)] = '/';
+		} else if(uri[i] == '?') {
+			strcat(encoded_uri, uri+i);
+			break;
+		} else {
+			char *encoded = curl_easy_escape(curl, uri+i, 1);
+			strcat(encoded_uri, encoded);
+			curl_free(encoded);
+		}
+	}
+	return encoded_uri;
+}
+
+void test_rest_uri_encode() {
+	static const char *uris[] = {
+		"",
+		"/",
+		"/service/1/objects",
+		"/a b/c%d/\xc3\xa9t\xc3\xa9",
+		"/rest/namespace/dir/file?query=a b&x=/y",
+		"?only=query",
+		"/-._~!$&'()*+,;=:@[]#",
+		"/abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789/x y",
+		"/0123456789abcdef0123456789abcdef\x7f\x80\xff/0123456789abcdef",
+		NULL
+	};
+	CURL *curl = curl_easy_init();
+	char uri[300], encoded[sizeof(uri)*3];
+	char *expected;
+	size_t len;
+	int i, j;
+
+	for(i=0; uris[i]; i++) {
+		expected = curl_encode_uri(curl, uris[i]);
+		len = rest_uri_encode(encoded, uris[i]);
+		assert_string_equal(expected, encoded);
+		assert_int_equal((int)strlen(expected), (int)len);
+		free(expected);
+	}
+
+	// Every byte value, at every alignment and with runs of safe
+	// characters long enough for the vector path.
+	srand(1);
+	for(i=0; i<2000; i++) {
+		int n = rand() % (sizeof(uri) - 1);
+		for(j=0; j<n; j++) {
+			int r = rand() % 4;
+			uri[j] = r == 0 ? (char)(1 + rand() % 255) : r == 1 ? '/'
+					: "abcXYZ09-._~"[rand() % 12];
+			if(uri[j] == '?' && rand() % 4) {
+				uri[j] = '%';
+			}
+		}
+		uri[n] = '\0';
+		expected = curl_encode_uri(curl, uri);
+		len = rest_uri_encode(encoded, uri);
+		assert_string_equal(expected, encoded);
+		assert_int_equal((int)strlen(expected), (int)len);
+		free(expected);
+	}
+
+	curl_easy_cleanup(curl);
+}
+
+void test_rest_client_suite() {
+	test_fixture_start();
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+
+
+	start_test_msg("test_rest_client_init");
+	run_test(test_rest_client_init);
+	start_test_msg("test_rest_client_destroy");
+	run_test(test_rest_client_destroy);
+	start_test_msg("test_rest_client_execute");
+	run_test(test_rest_client_execute);
+	start_test_msg("test_rest_client_execute_with_buffer");
+	run_test(test_rest_client_execute_with_buffer);
+	start_test_msg("test_rest_client_execute_with_too_small_buffer");
+	run_test(test_rest_client_execute_with_too_small_buffer);
+	start_test_msg("test_rest_client_handle_pool");
+	run_test(test_rest_client_handle_pool);
+	start_test_msg("test_rest_client_connection_limit");
+	run_test(test_rest_client_connection_limit);
+	start_test_msg("test_rest_client_url_prefix");
+	run_test(test_rest_client_url_prefix);
+	start_test_msg("test_rest_request");
+	run_test(test_rest_request);
+	start_test_msg("test_rest_request_reset");
+	run_test(test_rest_request_reset);
+	start_test_msg("test_rest_header_values");
+	run_test(test_rest_header_values);
+	start_test_msg("test_rest_uri_encode");
+	run_test(test_rest_uri_encode);
+#ifdef _PTHREADS
+	start_test_msg("test_rest_client_threads");
 	run_test(test_rest_client_threads);
+	start_test_msg("test_rest_client_connection_reuse");
+	run_test(test_rest_client_connection_reuse);
+	start_test_msg("test_rest_client_connection_reuse_threads");
+	run_test(test_rest_client_connection_reuse_threads);
+	start_test_msg("test_rest_client_threads_without_cookies");
+	run_test(test_rest_client_threads_without_cookies);
+	start_test_msg("test_rest_client_http2");
+	run_test(test_rest_client_http2);
+	start_test_msg("test_rest_client_cookie_sharing");
+	run_test(test_rest_client_cookie_sharing);
+	start_test_msg("test_rest_client_submit");
+	run_test(test_rest_client_submit);
+	start_test_msg("test_rest_client_execute_batch");
+	run_test(test_rest_client_execute_batch);
+	start_test_msg("test_rest_client_body_prealloc");
+	run_test(test_rest_client_body_prealloc);
+	start_test_msg("test_rest_response_reset");
+	run_test(test_rest_response_reset);
+	start_test_msg("test_rest_response_many_headers");
+	run_test(test_rest_response_many_headers);
+	start_test_msg("test_rest_response_sink");
+	run_test(test_rest_response_sink);
+	start_test_msg("test_rest_request_iov_body");
+	run_test(test_rest_request_iov_body);
+	start_test_msg("test_rest_request_mmap_body");
+	run_test(test_rest_request_mmap_body);
+	start_test_msg("test_rest_response_use_fd");
+	run_test(test_rest_response_use_fd);
+	start_test_msg("test_rest_client_async_file_io");
+	run_test(test_rest_client_async_file_io);
+	start_test_msg("test_rest_client_parallel_download");
+	run_test(test_rest_client_parallel_download);
+	start_test_msg("test_rest_client_parallel_upload");
+	run_test(test_rest_client_parallel_upload);
+	start_test_msg("test_rest_filter_resume");
+	run_test(test_rest_filter_resume);
+	start_test_msg("test_rest_client_warmup");
+	run_test(test_rest_client_warmup);
+#if defined(HAVE_MAKECONTEXT) && defined(HAVE_SWAPCONTEXT)
+	// Needs queued requests to run concurrently on the engine.
+	start_test_msg("test_rest_client_priorities");
+	run_test(test_rest_client_priorities);
+#endif
+	start_test_msg("test_rest_loop");
+	run_test(test_rest_loop);
+	start_test_msg("test_rest_loop_wakeup");
+	run_test(test_rest_loop_wakeup);
 #endif
     
 	curl_global_cleanup();
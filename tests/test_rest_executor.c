@@ -0,0 +1,205 @@
+/*
+
+ Copyright (c) 2012, EMC Corporation
+
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+ * Neither the name of the EMC Corporation nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <string.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "seatest.h"
+#include "test.h"
+#include "test_rest_executor.h"
+#include "rest_executor.h"
+#ifdef _PTHREADS
+#include "test_server.h"
+
+#define EXECUTOR_REQUESTS 100
+#define EXECUTOR_WORKERS 4
+
+static int checksum_failures = 0;
+
+/**
+ * Verifies the response body on the way back up, standing in for CPU-heavy
+ * filter work like parsing or checksumming.
+ */
+void checksum_filter(RestFilter *self, RestClient *rest,
+		RestRequest *request, RestResponse *response) {
+	int64_t i;
+
+	if(self->next) {
+		((rest_http_filter)self->next->func)(self->next, rest, request, response);
+	}
+	for(i=0; i<response->content_length; i++) {
+		if(response->body[i] != TEST_SERVER_BYTE(i)) {
+			__atomic_fetch_add(&checksum_failures, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
+void count_complete(RestClient *rest, RestRequest *request,
+		RestResponse *response, void *ctx) {
+	__atomic_fetch_add((int*)ctx, 1, __ATOMIC_RELAXED);
+}
+
+void test_rest_executor() {
+	TestServer server;
+	RestClient c;
+	RestExecutor *executor;
+	RestFilter* chain = NULL;
+	RestRequest req[EXECUTOR_REQUESTS];
+	RestResponse res[EXECUTOR_REQUESTS];
+	RestFuture futures[EXECUTOR_REQUESTS];
+	RestResponse *response;
+	char uri[64];
+	int i, completed = 0;
+
+	checksum_failures = 0;
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	RestClient_set_executor_threads(&c, EXECUTOR_WORKERS);
+	chain = RestFilter_add(chain, &RestFilter_execute_curl_request);
+	chain = RestFilter_add(chain, &checksum_filter);
+
+	executor = RestClient_get_executor(&c);
+	assert_int_equal(EXECUTOR_WORKERS, executor->worker_count);
+	assert_true(executor == RestClient_get_executor(&c));
+
+	for(i=0; i<EXECUTOR_REQUESTS; i++) {
+		snprintf(uri, sizeof(uri), "/data/%d", (i + 1) * 1000);
+		RestRequest_init(&req[i], uri, HTTP_GET);
+		RestResponse_init(&res[i]);
+		RestFuture_init(&futures[i]);
+		RestExecutor_submit(executor, chain, &req[i], &res[i], &futures[i],
+				count_complete, &completed);
+	}
+
+	for(i=0; i<EXECUTOR_REQUESTS; i++) {
+		response = RestFuture_wait(&futures[i]);
+		assert_true(response == &res[i]);
+		assert_true(RestFuture_is_done(&futures[i]));
+		assert_int_equal(0, response->curl_error);
+		assert_int_equal(200, response->http_code);
+		assert_int_equal((i + 1) * 1000, (int)response->content_length);
+		RestFuture_destroy(&futures[i]);
+		RestResponse_destroy(&res[i]);
+		RestRequest_destroy(&req[i]);
+	}
+	assert_int_equal(EXECUTOR_REQUESTS, completed);
+	assert_int_equal(0, checksum_failures);
+
+	RestFilter_free(chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+}
+
+#define FAN_OUT 20
+
+static RestExecutor *fan_out_executor = NULL;
+static RestFilter *fan_out_chain = NULL;
+static int fan_out_succeeded = 0;
+
+/**
+ * Submits more requests from a worker and waits for them there.  With a
+ * single worker this only completes if the waiting worker runs them itself.
+ */
+void fan_out_filter(RestFilter *self, RestClient *rest,
+		RestRequest *request, RestResponse *response) {
+	RestRequest req[FAN_OUT];
+	RestResponse res[FAN_OUT];
+	RestFuture futures[FAN_OUT];
+	int i;
+
+	for(i=0; i<FAN_OUT; i++) {
+		RestRequest_init(&req[i], "/data/100", HTTP_GET);
+		RestResponse_init(&res[i]);
+		RestFuture_init(&futures[i]);
+		RestExecutor_submit(fan_out_executor, fan_out_chain, &req[i],
+				&res[i], &futures[i], NULL, NULL);
+	}
+	for(i=0; i<FAN_OUT; i++) {
+		if(RestFuture_wait(&futures[i])->http_code == 200) {
+			fan_out_succeeded++;
+		}
+		RestFuture_destroy(&futures[i]);
+		RestResponse_destroy(&res[i]);
+		RestRequest_destroy(&req[i]);
+	}
+}
+
+void test_rest_executor_nested() {
+	TestServer server;
+	RestClient c;
+	RestExecutor executor;
+	RestFilter *fan_out = NULL;
+	RestRequest req;
+	RestResponse res;
+	RestFuture future;
+
+	assert_int_equal(0, test_server_start(&server));
+	RestClient_init(&c, server.url, server.port);
+	RestExecutor_init(&executor, &c, 1);
+
+	fan_out_executor = &executor;
+	fan_out_chain = RestFilter_add(NULL, &RestFilter_execute_curl_request);
+	fan_out_succeeded = 0;
+	fan_out = RestFilter_add(fan_out, &fan_out_filter);
+
+	RestRequest_init(&req, "/", HTTP_GET);
+	RestResponse_init(&res);
+	RestFuture_init(&future);
+	RestExecutor_submit(&executor, fan_out, &req, &res, &future, NULL, NULL);
+	RestFuture_wait(&future);
+
+	assert_int_equal(FAN_OUT, fan_out_succeeded);
+
+	RestFuture_destroy(&future);
+	RestExecutor_destroy(&executor);
+	RestResponse_destroy(&res);
+	RestRequest_destroy(&req);
+	RestFilter_free(fan_out);
+	RestFilter_free(fan_out_chain);
+	RestClient_destroy(&c);
+	test_server_stop(&server);
+}
+#endif
+
+void test_rest_executor_suite() {
+	test_fixture_start();
+
+#ifdef _PTHREADS
+	start_test_msg("test_rest_executor");
+	run_test(test_rest_executor);
+	start_test_msg("test_rest_executor_nested");
+	run_test(test_rest_executor_nested);
+#endif
+
+	test_fixture_end();
+}
@@ -0,0 +1,728 @@
+/*
+
+ Copyright (c) 2012, EMC Corporation
+
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+ * Neither the name of the EMC Corporation nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+// The server runs on threads, so it's only built with pthread support.
+#ifdef _PTHREADS
+#include "test_server.h"
+
+#define REQUEST_BUFFER_SIZE 65536
+#define SEND_CHUNK_SIZE 16384
+
+// HTTP/2 frame types and flags
+#define H2_DATA 0
+#define H2_HEADERS 1
+#define H2_SETTINGS 4
+#define H2_PING 6
+#define H2_GOAWAY 7
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_END_HEADERS 0x4
+
+typedef struct {
+	char method[16];
+	char path[1024];
+	int64_t content_length;
+	int has_range;
+	int64_t range_start;
+	int64_t range_end;
+	/** Length of a suffix range, "bytes=-<length>" */
+	int64_t range_suffix;
+	int has_content_range;
+	int64_t content_range_start;
+	char if_match[64];
+	char cookie[256];
+	int close;
+	char *body;
+} TestRequest;
+
+typedef struct {
+	TestServer *server;
+	int fd;
+} TestConnection;
+
+static int send_all(int fd, const char *data, size_t len) {
+	while(len > 0) {
+		ssize_t c = send(fd, data, len, MSG_NOSIGNAL);
+		if(c <= 0) {
+			if(c < 0 && errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += c;
+		len -= c;
+	}
+	return 0;
+}
+
+static int send_status(int fd, int code, const char *status, int close) {
+	char head[256];
+	snprintf(head, sizeof(head),
+			"HTTP/1.1 %d %s\r\nContent-Length: 0\r\n%s\r\n", code, status,
+			close ? "Connection: close\r\n" : "");
+	return send_all(fd, head, strlen(head));
+}
+
+/**
+ * Sends length bytes of the deterministic content starting at offset.
+ */
+static int send_pattern(int fd, int64_t offset, int64_t length) {
+	char buffer[SEND_CHUNK_SIZE];
+
+	while(length > 0) {
+		size_t i;
+		size_t c = length > SEND_CHUNK_SIZE ? SEND_CHUNK_SIZE : (size_t)length;
+		for(i=0; i<c; i++) {
+			buffer[i] = TEST_SERVER_BYTE(offset + i);
+		}
+		if(send_all(fd, buffer, c)) {
+			return -1;
+		}
+		offset += c;
+		length -= c;
+	}
+	return 0;
+}
+
+/**
+ * Sends size bytes of content, honoring Range and If-Match headers.  If drop
+ * is set, the connection is closed after half of the body.  The ETag is
+ * "size" unless given.
+ */
+static int handle_data(int fd, TestRequest *req, int64_t size, int drop,
+		const char *etag) {
+	char head[512];
+	char default_etag[32];
+	int64_t start = 0, length = size;
+
+	if(!etag) {
+		snprintf(default_etag, sizeof(default_etag), "\"%lld\"",
+				(long long)size);
+		etag = default_etag;
+	}
+	if(req->if_match[0] && strcmp(req->if_match, etag)) {
+		return send_status(fd, 412, "Precondition Failed", req->close);
+	}
+	if(req->has_range) {
+		start = req->range_suffix ? size - (req->range_suffix < size ?
+				req->range_suffix : size) : req->range_start;
+		length = (req->range_end < 0 || req->range_end >= size ?
+				size - 1 : req->range_end) - start + 1;
+		if(start >= size || length <= 0) {
+			return send_status(fd, 416, "Range Not Satisfiable", req->close);
+		}
+		snprintf(head, sizeof(head), "HTTP/1.1 206 Partial Content\r\n"
+				"Content-Type: application/octet-stream\r\n"
+				"Content-Length: %lld\r\n"
+				"Content-Range: bytes %lld-%lld/%lld\r\n"
+				"ETag: %s\r\n%s\r\n",
+				(long long)length, (long long)start,
+				(long long)(start + length - 1), (long long)size,
+				etag, req->close ? "Connection: close\r\n" : "");
+	} else {
+		snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+				"Content-Type: application/octet-stream\r\n"
+				"Content-Length: %lld\r\n"
+				"Accept-Ranges: bytes\r\n"
+				"ETag: %s\r\n%s\r\n",
+				(long long)length, etag,
+				req->close ? "Connection: close\r\n" : "");
+	}
+	if(send_all(fd, head, strlen(head))) {
+		return -1;
+	}
+	if(!strcmp(req->method, "HEAD")) {
+		return 0;
+	}
+	if(drop) {
+		send_pattern(fd, start, length / 2);
+		return -1;
+	}
+	return send_pattern(fd, start, length);
+}
+
+/**
+ * Returns nonzero the first time a /flaky/ range starting at offset is
+ * requested.
+ */
+static int first_attempt(TestServer *server, int64_t offset) {
+	int i, first = 1;
+
+	pthread_mutex_lock(&server->lock);
+	for(i=0; i<server->flaky_count; i++) {
+		if(server->flaky_offsets[i] == offset) {
+			first = 0;
+			break;
+		}
+	}
+	if(first && server->flaky_count < TEST_SERVER_MAX_FLAKY) {
+		server->flaky_offsets[server->flaky_count++] = offset;
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	return first;
+}
+
+/**
+ * Sends an empty response with count headers named X-Test-<i>.  Odd lines
+ * end in a bare LF, which clients should accept too.
+ */
+static int handle_headers(int fd, TestRequest *req, int count) {
+	char line[64];
+	int i;
+
+	if(send_all(fd, "HTTP/1.1 200 OK\r\n", 17)) {
+		return -1;
+	}
+	for(i=0; i<count; i++) {
+		snprintf(line, sizeof(line), "X-Test-%d:  value %d  %s", i, i,
+				i % 2 ? "\n" : "\r\n");
+		if(send_all(fd, line, strlen(line))) {
+			return -1;
+		}
+	}
+	snprintf(line, sizeof(line), "Content-Length: 0\r\n%s\r\n",
+			req->close ? "Connection: close\r\n" : "");
+	return send_all(fd, line, strlen(line));
+}
+
+/**
+ * Sends the request body back as the response body.
+ */
+static int handle_echo(int fd, TestRequest *req) {
+	char head[256];
+
+	snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+			"Content-Type: application/octet-stream\r\n"
+			"Content-Length: %lld\r\n%s\r\n",
+			(long long)req->content_length,
+			req->close ? "Connection: close\r\n" : "");
+	if(send_all(fd, head, strlen(head))) {
+		return -1;
+	}
+	return send_all(fd, req->body, req->content_length);
+}
+
+/**
+ * Stores the body at its Content-Range offset in the server's upload buffer
+ * of size bytes.  If fail is set, the body is discarded and a 503 returned.
+ */
+static int handle_upload(TestServer *server, int fd, TestRequest *req,
+		int64_t size, int fail) {
+	int64_t start = req->has_content_range ? req->content_range_start : 0;
+
+	if(fail) {
+		return send_status(fd, 503, "Service Unavailable", req->close);
+	}
+	if(start < 0 || start + req->content_length > size) {
+		return send_status(fd, 416, "Range Not Satisfiable", req->close);
+	}
+	pthread_mutex_lock(&server->lock);
+	if(!server->upload) {
+		server->upload = calloc(1, size ? size : 1);
+		server->upload_size = size;
+	}
+	if(size == server->upload_size) {
+		memcpy(server->upload + start, req->body, req->content_length);
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	return send_status(fd, 200, "OK", req->close);
+}
+
+/**
+ * Handles /partial/<size>.  A PUT stores the body like handle_upload(), but
+ * the first one stores only half of it and closes the connection without a
+ * response.  A HEAD reports how much has been stored.  The ETag is the
+ * number of bytes stored.
+ */
+static int handle_partial(TestServer *server, int fd, TestRequest *req,
+		int64_t size) {
+	int64_t start = req->has_content_range ? req->content_range_start : 0;
+	int64_t length = req->content_length;
+	char head[256];
+	char etag[32];
+	int drop = 0;
+
+	pthread_mutex_lock(&server->lock);
+	snprintf(etag, sizeof(etag), "\"%lld\"", (long long)server->upload_length);
+	if(!strcmp(req->method, "HEAD")) {
+		pthread_mutex_unlock(&server->lock);
+		snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+				"Content-Length: %lld\r\nETag: %s\r\n%s\r\n",
+				(long long)server->upload_length, etag,
+				req->close ? "Connection: close\r\n" : "");
+		return send_all(fd, head, strlen(head));
+	}
+	if(req->if_match[0] && strcmp(req->if_match, etag)) {
+		pthread_mutex_unlock(&server->lock);
+		return send_status(fd, 412, "Precondition Failed", req->close);
+	}
+	if(start < 0 || start + length > size) {
+		pthread_mutex_unlock(&server->lock);
+		return send_status(fd, 416, "Range Not Satisfiable", req->close);
+	}
+	if(!server->put_dropped) {
+		server->put_dropped = 1;
+		drop = 1;
+		length /= 2;
+	}
+	if(!server->upload) {
+		server->upload = calloc(1, size ? size : 1);
+		server->upload_size = size;
+	}
+	if(size == server->upload_size) {
+		memcpy(server->upload + start, req->body, length);
+		if(start + length > server->upload_length) {
+			server->upload_length = start + length;
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	return drop ? -1 : send_status(fd, 200, "OK", req->close);
+}
+
+static int handle_request(TestServer *server, int fd, TestRequest *req) {
+	pthread_mutex_lock(&server->lock);
+	server->requests++;
+	pthread_mutex_unlock(&server->lock);
+
+	if(!strncmp(req->path, "/data/", 6) && !strcmp(req->method, "PUT")) {
+		return handle_upload(server, fd, req, strtoll(req->path + 6, NULL, 10),
+				0);
+	}
+	if(!strncmp(req->path, "/flaky/", 7) && !strcmp(req->method, "PUT")) {
+		return handle_upload(server, fd, req, strtoll(req->path + 7, NULL, 10),
+				first_attempt(server, req->content_range_start));
+	}
+	if(!strncmp(req->path, "/partial/", 9)) {
+		return handle_partial(server, fd, req, strtoll(req->path + 9, NULL, 10));
+	}
+	if(!strncmp(req->path, "/data/", 6)) {
+		return handle_data(fd, req, strtoll(req->path + 6, NULL, 10), 0, NULL);
+	}
+	if(!strncmp(req->path, "/flaky/", 7)) {
+		return handle_data(fd, req, strtoll(req->path + 7, NULL, 10),
+				first_attempt(server, req->has_range ? req->range_start : 0),
+				NULL);
+	}
+	if(!strncmp(req->path, "/drop/", 6)) {
+		char etag[32];
+		int drop;
+
+		pthread_mutex_lock(&server->lock);
+		drop = !server->get_dropped && strcmp(req->method, "HEAD");
+		server->get_dropped = 1;
+		snprintf(etag, sizeof(etag), "\"%d\"",
+				strstr(req->path, "?changed") ? server->requests : 0);
+		pthread_mutex_unlock(&server->lock);
+		if(!drop && strstr(req->path, "?norange")) {
+			req->has_range = 0;
+		}
+		return handle_data(fd, req, strtoll(req->path + 6, NULL, 10), drop,
+				etag);
+	}
+	if(!strncmp(req->path, "/headers/", 9)) {
+		return handle_headers(fd, req, atoi(req->path + 9));
+	}
+	if(!strcmp(req->path, "/cookies")) {
+		char head[512];
+
+		snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+				"Content-Length: %d\r\nSet-Cookie: test=1; Path=/\r\n%s\r\n%s",
+				(int)strlen(req->cookie),
+				req->close ? "Connection: close\r\n" : "", req->cookie);
+		return send_all(fd, head, strlen(head));
+	}
+	if(!strcmp(req->path, "/echo")) {
+		return handle_echo(fd, req);
+	}
+	if(!strcmp(req->path, "/discard")) {
+		return send_status(fd, 200, "OK", req->close);
+	}
+	if(!strncmp(req->path, "/delay/", 7)) {
+		usleep(atoi(req->path + 7) * 1000);
+		return send_status(fd, 200, "OK", req->close);
+	}
+
+	return send_status(fd, 404, "Not Found", req->close);
+}
+
+/**
+ * Parses the request line and headers in buffer.  Returns the length of the
+ * header block or zero if it's incomplete.
+ */
+static size_t parse_request(char *buffer, size_t len, TestRequest *req) {
+	char *end, *line, *next;
+
+	buffer[len] = '\0';
+	end = strstr(buffer, "\r\n\r\n");
+	if(!end) {
+		return 0;
+	}
+	*end = '\0';
+
+	memset(req, 0, sizeof(TestRequest));
+	req->range_end = -1;
+	sscanf(buffer, "%15s %1023s", req->method, req->path);
+
+	line = strstr(buffer, "\r\n");
+	while(line) {
+		line += 2;
+		next = strstr(line, "\r\n");
+		if(next) {
+			*next = '\0';
+		}
+		if(!strncasecmp(line, "Content-Length:", 15)) {
+			req->content_length = strtoll(line + 15, NULL, 10);
+		} else if(!strncasecmp(line, "Range:", 6)) {
+			char *spec = strchr(line, '=');
+			if(spec && spec[1] == '-') {
+				req->has_range = 1;
+				req->range_suffix = strtoll(spec + 2, NULL, 10);
+			} else if(spec) {
+				req->has_range = 1;
+				req->range_start = strtoll(spec + 1, &spec, 10);
+				if(*spec == '-' && spec[1]) {
+					req->range_end = strtoll(spec + 1, NULL, 10);
+				}
+			}
+		} else if(!strncasecmp(line, "Content-Range:", 14)) {
+			char *spec = strstr(line, "bytes ");
+			if(spec) {
+				req->has_content_range = 1;
+				req->content_range_start = strtoll(spec + 6, NULL, 10);
+			}
+		} else if(!strncasecmp(line, "Cookie:", 7)) {
+			snprintf(req->cookie, sizeof(req->cookie), "%s", line + 8);
+		} else if(!strncasecmp(line, "If-Match:", 9)) {
+			sscanf(line + 9, " %63s", req->if_match);
+		} else if(!strncasecmp(line, "Connection:", 11)) {
+			req->close = strstr(line, "close") != NULL;
+		}
+		line = next;
+	}
+
+	return end - buffer + 4;
+}
+
+/**
+ * Sends an HTTP/2 frame.
+ */
+static int send_h2_frame(int fd, int type, int flags, uint32_t stream,
+		const char *payload, size_t len) {
+	unsigned char head[9];
+
+	head[0] = (len >> 16) & 0xff;
+	head[1] = (len >> 8) & 0xff;
+	head[2] = len & 0xff;
+	head[3] = type;
+	head[4] = flags;
+	head[5] = (stream >> 24) & 0x7f;
+	head[6] = (stream >> 16) & 0xff;
+	head[7] = (stream >> 8) & 0xff;
+	head[8] = stream & 0xff;
+	if(send_all(fd, (char*)head, sizeof(head))) {
+		return -1;
+	}
+	return len ? send_all(fd, payload, len) : 0;
+}
+
+/**
+ * Sends a 200 response of length bytes of the deterministic content on an
+ * HTTP/2 stream.
+ */
+static int send_h2_pattern(int fd, uint32_t stream, int64_t length) {
+	char buffer[SEND_CHUNK_SIZE];
+	int64_t offset = 0;
+	size_t c;
+
+	// ":status: 200" from the HPACK static table, then content-length
+	// (static table entry 28) as a literal without indexing.
+	buffer[0] = (char)0x88;
+	buffer[1] = 0x0f;
+	buffer[2] = 28 - 15;
+	c = snprintf(buffer + 4, sizeof(buffer) - 4, "%lld", (long long)length);
+	buffer[3] = c;
+	if(send_h2_frame(fd, H2_HEADERS, H2_FLAG_END_HEADERS, stream, buffer,
+			4 + c)) {
+		return -1;
+	}
+	// SEND_CHUNK_SIZE is the default maximum frame size.
+	do {
+		size_t i;
+
+		c = length - offset > SEND_CHUNK_SIZE ? SEND_CHUNK_SIZE
+				: (size_t)(length - offset);
+		for(i=0; i<c; i++) {
+			buffer[i] = TEST_SERVER_BYTE(offset + i);
+		}
+		offset += c;
+		if(send_h2_frame(fd, H2_DATA, offset == length ? H2_FLAG_END_STREAM : 0,
+				stream, buffer, c)) {
+			return -1;
+		}
+	} while(offset < length);
+	return 0;
+}
+
+/**
+ * Serves HTTP/2 with prior knowledge once the "PRI * HTTP/2.0" request line
+ * has been read; buffer (of REQUEST_BUFFER_SIZE bytes) starts with the len
+ * bytes received after it.  Request headers aren't decoded: every stream
+ * gets a 200 response of h2_body_size bytes as soon as its request ends.
+ * Flow control isn't tracked, so the bodies must fit the client's windows.
+ */
+static void serve_h2(TestServer *server, int fd, char *buffer, size_t len) {
+	int preface = 6;
+
+	if(send_h2_frame(fd, H2_SETTINGS, 0, 0, NULL, 0)) {
+		return;
+	}
+	for(;;) {
+		const unsigned char *frame = (unsigned char*)buffer + preface;
+		size_t frame_len;
+		uint32_t stream;
+		ssize_t c;
+		int type, flags;
+
+		if(len >= preface + 9) {
+			frame_len = (frame[0] << 16) | (frame[1] << 8) | frame[2];
+			if(len >= preface + 9 + frame_len) {
+				type = frame[3];
+				flags = frame[4];
+				stream = ((frame[5] & 0x7f) << 24) | (frame[6] << 16)
+						| (frame[7] << 8) | frame[8];
+				if(type == H2_GOAWAY) {
+					return;
+				}
+				if(type == H2_SETTINGS && !(flags & H2_FLAG_ACK)) {
+					c = send_h2_frame(fd, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+				} else if(type == H2_PING && !(flags & H2_FLAG_ACK)) {
+					c = send_h2_frame(fd, H2_PING, H2_FLAG_ACK, 0,
+							(char*)frame + 9, frame_len);
+				} else if((type == H2_HEADERS || type == H2_DATA)
+						&& (flags & H2_FLAG_END_STREAM)) {
+					pthread_mutex_lock(&server->lock);
+					server->requests++;
+					pthread_mutex_unlock(&server->lock);
+					c = send_h2_pattern(fd, stream, server->h2_body_size);
+				} else {
+					c = 0;
+				}
+				if(c) {
+					return;
+				}
+				len -= preface + 9 + frame_len;
+				memmove(buffer, frame + 9 + frame_len, len);
+				preface = 0;
+				continue;
+			}
+		}
+		if(len == REQUEST_BUFFER_SIZE) {
+			return;
+		}
+		c = recv(fd, buffer + len, REQUEST_BUFFER_SIZE - len, 0);
+		if(c <= 0) {
+			return;
+		}
+		len += c;
+	}
+}
+
+static void *connection_main(void *arg) {
+	TestConnection *conn = arg;
+	char *buffer = malloc(REQUEST_BUFFER_SIZE + 1);
+	size_t len = 0;
+
+	for(;;) {
+		TestRequest req;
+		size_t header_len;
+		ssize_t c;
+
+		while(!(header_len = parse_request(buffer, len, &req))) {
+			if(len == REQUEST_BUFFER_SIZE) {
+				goto done;
+			}
+			c = recv(conn->fd, buffer + len, REQUEST_BUFFER_SIZE - len, 0);
+			if(c <= 0) {
+				goto done;
+			}
+			len += c;
+		}
+
+		if(!strcmp(req.method, "PRI")) {
+			memmove(buffer, buffer + header_len, len - header_len);
+			serve_h2(conn->server, conn->fd, buffer, len - header_len);
+			break;
+		}
+
+		// Read the body
+		req.body = malloc(req.content_length + 1);
+		{
+			int64_t have = len - header_len;
+			if(have > req.content_length) {
+				have = req.content_length;
+			}
+			memcpy(req.body, buffer + header_len, have);
+			memmove(buffer, buffer + header_len + have,
+					len - header_len - have);
+			len -= header_len + have;
+			while(have < req.content_length) {
+				c = recv(conn->fd, req.body + have, req.content_length - have, 0);
+				if(c <= 0) {
+					free(req.body);
+					goto done;
+				}
+				have += c;
+			}
+		}
+
+		c = handle_request(conn->server, conn->fd, &req);
+		free(req.body);
+		if(c || req.close) {
+			break;
+		}
+	}
+
+done:
+	free(buffer);
+	shutdown(conn->fd, SHUT_RDWR);
+	free(conn);
+	return NULL;
+}
+
+static void *accept_main(void *arg) {
+	TestServer *self = arg;
+	int one = 1;
+
+	while(!self->stop) {
+		TestConnection *conn;
+		int fd = accept(self->listen_fd, NULL, NULL);
+		if(fd < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		pthread_mutex_lock(&self->lock);
+		if(self->stop || self->connections == TEST_SERVER_MAX_CONNECTIONS) {
+			pthread_mutex_unlock(&self->lock);
+			close(fd);
+			continue;
+		}
+		// Headers and body are sent separately; don't let Nagle hold
+		// the body back.
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		conn = malloc(sizeof(TestConnection));
+		conn->server = self;
+		conn->fd = fd;
+		self->conn_fds[self->connections] = fd;
+		pthread_create(&self->conn_threads[self->connections], NULL,
+				connection_main, conn);
+		self->connections++;
+		pthread_mutex_unlock(&self->lock);
+	}
+
+	return NULL;
+}
+
+int test_server_start(TestServer *self) {
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	int one = 1;
+
+	memset(self, 0, sizeof(TestServer));
+	pthread_mutex_init(&self->lock, NULL);
+
+	self->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(self->listen_fd < 0) {
+		return -1;
+	}
+	setsockopt(self->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	if(bind(self->listen_fd, (struct sockaddr*)&addr, sizeof(addr))
+			|| listen(self->listen_fd, 128)
+			|| getsockname(self->listen_fd, (struct sockaddr*)&addr, &addr_len)) {
+		close(self->listen_fd);
+		return -1;
+	}
+	self->port = ntohs(addr.sin_port);
+	snprintf(self->url, sizeof(self->url), "http://127.0.0.1:%d", self->port);
+
+	return pthread_create(&self->accept_thread, NULL, accept_main, self);
+}
+
+void test_server_stop(TestServer *self) {
+	int i;
+
+	self->stop = 1;
+	shutdown(self->listen_fd, SHUT_RDWR);
+	pthread_join(self->accept_thread, NULL);
+	close(self->listen_fd);
+
+	for(i=0; i<self->connections; i++) {
+		shutdown(self->conn_fds[i], SHUT_RDWR);
+		pthread_join(self->conn_threads[i], NULL);
+		close(self->conn_fds[i]);
+	}
+	free(self->upload);
+	pthread_mutex_destroy(&self->lock);
+}
+
+int test_server_connections(TestServer *self) {
+	int connections;
+
+	pthread_mutex_lock(&self->lock);
+	connections = self->connections;
+	pthread_mutex_unlock(&self->lock);
+
+	return connections;
+}
+#endif
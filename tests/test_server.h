@@ -0,0 +1,137 @@
+/*
+
+ Copyright (c) 2012, EMC Corporation
+
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+ * Neither the name of the EMC Corporation nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef TEST_SERVER_H_
+#define TEST_SERVER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Maximum number of connections a TestServer will accept over its lifetime.
+ */
+#define TEST_SERVER_MAX_CONNECTIONS 256
+
+/**
+ * Maximum number of distinct ranges a TestServer fails under /flaky/.
+ */
+#define TEST_SERVER_MAX_FLAKY 256
+
+/**
+ * Byte at offset i of the deterministic content served under /data/.
+ */
+#define TEST_SERVER_BYTE(i) ((char)((((int64_t)(i)) * 7 + 13) & 0xff))
+
+/**
+ * A tiny HTTP/1.1 server bound to 127.0.0.1 on an ephemeral port.  It supports
+ * keep-alive so tests can check connection reuse.
+ *
+ * Routes:
+ *  - GET|HEAD /data/<size> returns size bytes of TEST_SERVER_BYTE content.
+ *  - PUT /data/<size> stores the body at its Content-Range offset (or zero)
+ *    in upload, a buffer of size bytes.
+ *  - GET /flaky/<size> is like /data/<size>, but the first request for each
+ *    range start drops the connection halfway through the body.
+ *  - PUT /flaky/<size> is like PUT /data/<size>, but the first request for
+ *    each range start fails with 503.
+ *  - GET /drop/<size> is like /data/<size>, but the first request drops the
+ *    connection halfway through the body.  With "?changed", the ETag is
+ *    different on every request; with "?norange", later requests ignore
+ *    Range and return the whole object.
+ *  - PUT /partial/<size> is like PUT /data/<size>, but the first request
+ *    stores only half of the body and closes the connection without a
+ *    response.  HEAD /partial/<size> returns the number of bytes stored as
+ *    Content-Length and ETag.
+ *  - GET /delay/<ms> returns an empty 200 response after ms milliseconds.
+ *  - GET /headers/<count> returns an empty 200 response with count headers
+ *    "X-Test-<i>: value <i>".
+ *  - GET /cookies returns the request's Cookie header as the body and sets
+ *    the cookie "test=1".
+ *  - POST|PUT /echo returns the request body.
+ *  - POST|PUT /discard reads the request body and returns an empty 200.
+ *
+ * GETs of /data/, /flaky/ and /drop/ and PUTs to /partial/ fail with 412 if
+ * an If-Match header doesn't match the ETag.
+ *
+ * A connection starting with the HTTP/2 preface is served as HTTP/2 with
+ * prior knowledge.  The request path isn't decoded: every request gets a 200
+ * response with h2_body_size bytes of the /data/ content.
+ */
+typedef struct {
+	int listen_fd;
+	int port;
+	volatile int stop;
+	/** Number of TCP connections accepted so far */
+	int connections;
+	/** Number of requests handled so far */
+	int requests;
+	/** Range starts already requested under /flaky/ */
+	int64_t flaky_offsets[TEST_SERVER_MAX_FLAKY];
+	int flaky_count;
+	/** Content received by PUT /data/ and /flaky/, or NULL */
+	char *upload;
+	int64_t upload_size;
+	/** End of the content received by PUT /partial/ */
+	int64_t upload_length;
+	/** Whether /drop/ and /partial/ have dropped their connection */
+	int get_dropped;
+	int put_dropped;
+	/**
+	 * Size of the body of every HTTP/2 response, zero by default.  Change it
+	 * only while no HTTP/2 request is in flight.
+	 */
+	int64_t h2_body_size;
+	pthread_t accept_thread;
+	pthread_mutex_t lock;
+	pthread_t conn_threads[TEST_SERVER_MAX_CONNECTIONS];
+	int conn_fds[TEST_SERVER_MAX_CONNECTIONS];
+	/** Endpoint URL of the server, e.g. http://127.0.0.1:12345 */
+	char url[64];
+} TestServer;
+
+/**
+ * Starts the server on a background thread.
+ * @return zero on success.
+ */
+int test_server_start(TestServer *self);
+
+/**
+ * Stops the server and closes all of its connections.
+ */
+void test_server_stop(TestServer *self);
+
+/**
+ * Returns the number of connections accepted so far.
+ */
+int test_server_connections(TestServer *self);
+
+#endif /* TEST_SERVER_H_ */